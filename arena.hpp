@@ -0,0 +1,177 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <bytell_hash_map.hpp>
+
+//Bump allocator that owns everything allocated from it, there is no per-object free.
+//Only trivially destructible types may live in here, since reset() just drops the blocks on the floor.
+struct Arena
+{
+    static constexpr size_t default_block_size = 1 << 20;
+
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    char* cursor = nullptr;
+    char* end = nullptr;
+    size_t block_size;
+    size_t used = 0;
+
+    Arena(size_t block_size = default_block_size) : block_size(block_size) {}
+    Arena(const Arena& copy) = delete;
+    Arena(Arena&& move) = default;
+    Arena& operator=(Arena&& move) = default;
+
+    void* allocate(size_t size, size_t align)
+    {
+        size_t pad = (align - (reinterpret_cast<uintptr_t>(cursor) & (align - 1))) & (align - 1);
+        if (cursor == nullptr || size_t(end - cursor) < size + pad)
+        {
+            grow(size + align);
+            pad = (align - (reinterpret_cast<uintptr_t>(cursor) & (align - 1))) & (align - 1);
+        }
+
+        char* out = cursor + pad;
+        cursor = out + size;
+        used += size + pad;
+        return out;
+    }
+
+    template<typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        static_assert(std::is_trivially_destructible_v<T>, "arena objects are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template<typename T>
+    T* make_array(size_t count)
+    {
+        static_assert(std::is_trivially_destructible_v<T>, "arena objects are never destroyed");
+        if (count == 0)
+            return nullptr;
+
+        T* out = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+        for (size_t i = 0; i < count; i++)
+            new (out + i) T();
+        return out;
+    }
+
+    //Free everything in one go, the first block is kept around so a reload doesn't have to go back to the system allocator
+    void reset()
+    {
+        if (blocks.size() > 1)
+            blocks.erase(blocks.begin() + 1, blocks.end());
+
+        if (blocks.empty())
+        {
+            cursor = end = nullptr;
+        }
+        else
+        {
+            cursor = blocks.front().data.get();
+            end = cursor + blocks.front().size;
+        }
+        used = 0;
+    }
+
+    size_t reserved() const
+    {
+        size_t total = 0;
+        for (auto& block : blocks)
+            total += block.size;
+        return total;
+    }
+
+private:
+    void grow(size_t at_least)
+    {
+        size_t size = std::max(block_size, at_least);
+        blocks.push_back({ std::make_unique<char[]>(size), size });
+        cursor = blocks.back().data.get();
+        end = cursor + size;
+    }
+};
+
+
+//Every distinct string is stored exactly once and handed out as a stable pointer, so equal strings compare by address.
+//Entries live until clear(), which has to wait until nothing points into the pool any more. It is split into
+//independently locked shards so several converter threads can intern at the same time.
+struct StringPool
+{
+    static constexpr size_t shard_count = 16;
+
+    struct Shard
+    {
+        mutable std::mutex lock;
+        std::deque<std::string> storage;
+        ska::bytell_hash_map<std::string_view, const std::string*> index;
+    };
+
+    std::array<Shard, shard_count> shards;
+
+    static size_t shard_of(std::string_view str)
+    {
+        return std::hash<std::string_view>()(str) % shard_count;
+    }
+
+    const std::string* intern(std::string_view str)
+    {
+        Shard& shard = shards[shard_of(str)];
+        std::lock_guard<std::mutex> guard(shard.lock);
+
+        if (auto it = shard.index.find(str); it != shard.index.end())
+            return it->second;
+
+        const std::string* entry = &shard.storage.emplace_back(str);
+        shard.index.emplace(std::string_view(*entry), entry);
+        return entry;
+    }
+
+    const std::string* find(std::string_view str) const
+    {
+        const Shard& shard = shards[shard_of(str)];
+        std::lock_guard<std::mutex> guard(shard.lock);
+
+        if (auto it = shard.index.find(str); it != shard.index.end())
+            return it->second;
+        return nullptr;
+    }
+
+    void clear()
+    {
+        for (auto& shard : shards)
+        {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            shard.index.clear();
+            shard.storage.clear();
+        }
+    }
+
+    size_t size() const
+    {
+        size_t total = 0;
+        for (auto& shard : shards)
+        {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            total += shard.storage.size();
+        }
+        return total;
+    }
+};
@@ -0,0 +1,228 @@
+#include "chunk_cache.hpp"
+
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <fstream>
+#include <thread>
+
+#include <lauxlib.h>
+
+uint64_t ChunkCache::key_of(const std::string& path, const std::vector<char>& source)
+{
+    // The chunk name (and so every function's source) is baked into the bytecode, two copies of the same file at different
+    // paths need different entries
+    fnv1a hash;
+    hash.add_pod(version);
+    hash.add_pod(uint32_t(LUA_VERSION_NUM));
+    hash.add(path);
+    hash.add(std::string_view(source.data(), source.size()));
+    return hash.value();
+}
+
+fs::path ChunkCache::disk_path(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".luac", key);
+    return disk_dir / name;
+}
+
+bool ChunkCache::read_disk(uint64_t key, std::vector<char>& out) const
+{
+    std::ifstream in(disk_path(key), std::ios::binary | std::ios::ate);
+    if (!in)
+        return false;
+
+    size_t size = size_t(in.tellg());
+    Header header;
+    if (size < sizeof(header))
+        return false;
+
+    in.seekg(0);
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (header.magic != magic || header.version != version || header.key != key || header.size != size - sizeof(header))
+        return false;
+
+    out.resize(size_t(header.size));
+    in.read(out.data(), out.size());
+    if (!in)
+        return false;
+
+    // lua trusts bytecode completely, a torn or damaged file must never reach lua_load
+    fnv1a check;
+    check.add(out.data(), out.size());
+    return check.value() == header.checksum;
+}
+
+void ChunkCache::write_disk(uint64_t key, const std::vector<char>& bytecode) const
+{
+    Header header{};
+    header.magic = magic;
+    header.version = version;
+    header.key = key;
+    header.size = bytecode.size();
+    fnv1a check;
+    check.add(bytecode.data(), bytecode.size());
+    header.checksum = check.value();
+
+    // Workers of several VMs can compile the same file at once, each gets its own temp file and the last rename wins
+    const fs::path file = disk_path(key);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%zx.tmp", std::hash<std::thread::id>()(std::this_thread::get_id()));
+    fs::path temp = file;
+    temp += suffix;
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(bytecode.data(), bytecode.size());
+        if (!out)
+            return;
+    }
+
+    std::error_code ec;
+    fs::rename(temp, file, ec);
+}
+
+static int write_chunk(lua_State*, const void* p, size_t sz, void* ud)
+{
+    auto* out = static_cast<std::vector<char>*>(ud);
+    out->insert(out->end(), static_cast<const char*>(p), static_cast<const char*>(p) + sz);
+    return 0;
+}
+
+void ChunkCache::precompile(const std::vector<std::string>& paths, unsigned threads, const source_reader& read)
+{
+    prof timer;
+    timer.start();
+
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max(1u, std::min(threads, unsigned(paths.size())));
+
+    bool use_disk = !disk_dir.empty();
+    if (use_disk)
+    {
+        std::error_code ec;
+        fs::create_directories(disk_dir, ec);
+        if (ec)
+        {
+            logger->warn("could not create lua chunk cache {0}: {1}", ws2s(disk_dir.wstring()), ec.message());
+            use_disk = false;
+        }
+    }
+
+    // Results go into their own slot so the workers never share anything but the job counter
+    std::vector<std::vector<char>> results(paths.size());
+    std::atomic<size_t> next_job{ 0 };
+    std::atomic<size_t> from_disk{ 0 };
+
+    auto worker = [&]() {
+        lua_State* L = nullptr;
+        for (size_t job = next_job++; job < paths.size(); job = next_job++)
+        {
+            const std::string& path = paths[job];
+            std::vector<char> source;
+            try
+            {
+                if (read)
+                {
+                    if (!read(path, source))
+                        continue;
+                }
+                else
+                {
+                    source = load_file_contents(path);
+                }
+            }
+            catch (const std::exception&)
+            {
+                continue;
+            }
+            uint64_t key = key_of(path, source);
+
+            if (use_disk)
+            {
+                if (read_disk(key, results[job]))
+                {
+                    from_disk++;
+                    continue;
+                }
+                // A rejected file may have been read in part
+                results[job].clear();
+            }
+
+            // Only the parser and lua_dump run here, so a bare state with no libraries is enough
+            if (!L)
+                L = luaL_newstate();
+
+            const std::string chunkname = "@" + path;
+            const std::string_view text = lua_source(source);
+            if (luaL_loadbuffer(L, text.data(), text.size(), chunkname.c_str()) == LUA_OK)
+            {
+                lua_dump(L, write_chunk, &results[job]);
+                if (use_disk)
+                    write_disk(key, results[job]);
+            }
+            lua_settop(L, 0);
+        }
+        if (L)
+            lua_close(L);
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool)
+        thread.join();
+
+    size_t compiled = 0;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        if (!results[i].empty())
+        {
+            chunks[paths[i]] = std::move(results[i]);
+            compiled++;
+        }
+    }
+
+    timer.stop();
+    timer.print(*logger, "precompile lua");
+    logger->info("lua chunks: {0} of {1} precompiled, {2} from disk, {3} threads", compiled, paths.size(), size_t(from_disk), threads);
+}
+
+struct chunk_reader
+{
+    const std::vector<char>* bytecode;
+    bool done = false;
+};
+
+static const char* read_chunk(lua_State*, void* ud, size_t* sz)
+{
+    auto* reader = static_cast<chunk_reader*>(ud);
+    if (reader->done)
+    {
+        *sz = 0;
+        return nullptr;
+    }
+    reader->done = true;
+    *sz = reader->bytecode->size();
+    return reader->bytecode->data();
+}
+
+bool ChunkCache::load(lua_State* L, const std::string& path) const
+{
+    auto it = chunks.find(path);
+    if (it == chunks.end())
+        return false;
+
+    chunk_reader reader{ &it->second };
+    const std::string chunkname = "@" + path;
+    if (lua_load(L, read_chunk, &reader, chunkname.c_str(), "b") != LUA_OK)
+    {
+        logger->warn("precompiled chunk for {0} did not load: {1}", path, lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <lua.h>
+
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+//Precompiled bytecode for every lua file the data stage can require, so the main thread only has to lua_load it instead of
+//lexing and parsing the source.
+//
+//Files are compiled on worker threads, each with its own throwaway lua_State, and the lua_dump output is kept in memory.
+//If a cache directory is given the bytecode is also written there, named by a hash of the file's path and contents, so the
+//next launch only reads files it hasn't seen before.
+struct ChunkCache
+{
+    static constexpr uint32_t magic = 0x43524446; // "FDRC"
+    static constexpr uint32_t version = 1;
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t key;
+        uint64_t size;
+        uint64_t checksum;
+    };
+
+    //Empty means memory only
+    fs::path disk_dir;
+    std::shared_ptr<spdlog::logger> logger;
+
+    ChunkCache(std::shared_ptr<spdlog::logger> logger, fs::path disk_dir = {}) : disk_dir(std::move(disk_dir)), logger(std::move(logger)) {}
+
+    using source_reader = std::function<bool(const std::string& path, std::vector<char>& out)>;
+
+    //Paths have to be normalized the way VM::load_file does it, they are also the chunk names. 0 threads means one per
+    //hardware thread. Files that can't be read or don't compile are skipped and left for the normal loader to report.
+    //read is called from the worker threads, by default it reads the path from disk.
+    void precompile(const std::vector<std::string>& paths, unsigned threads = 0, const source_reader& read = {});
+
+    //Pushes the chunk for path like luaL_loadfile would, false (and nothing pushed) if it isn't cached
+    bool load(lua_State* L, const std::string& path) const;
+
+    //Bytecode is only needed while the data stage runs
+    void clear() { chunks.clear(); }
+
+    size_t size() const { return chunks.size(); }
+
+private:
+    ska::bytell_hash_map<std::string, std::vector<char>> chunks;
+
+    static uint64_t key_of(const std::string& path, const std::vector<char>& source);
+    fs::path disk_path(uint64_t key) const;
+    bool read_disk(uint64_t key, std::vector<char>& out) const;
+    void write_disk(uint64_t key, const std::vector<char>& bytecode) const;
+};
@@ -0,0 +1,324 @@
+#include "converter.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+#include "util.hpp"
+
+// The lua internals define a lot of short macros (cast, check_exp, ...) so keep them at the bottom
+#include <lobject.h>
+#include <lstate.h>
+#include <ltable.h>
+
+FString LuaConverter::intern(const TString* ts)
+{
+    // Long strings don't carry a real hash (and aren't interned by lua), but the pointer is still a fine cache key
+    size_t hash = ts->tsv.tt == LUA_TSHRSTR ? ts->tsv.hash : size_t(uintptr_t(ts) >> 4);
+    string_cache_entry& entry = strings[hash & (string_cache_size - 1)];
+    if (entry.ts == ts)
+        return entry.str;
+
+    entry.ts = ts;
+    entry.str = FString::intern(pool, std::string_view(getstr(ts), ts->tsv.len));
+    return entry.str;
+}
+
+FString LuaConverter::index_key(size_t index)
+{
+    return FObject::index_key(index, pool);
+}
+
+// Keys that can be part of an array, t[1] and up
+static bool is_array_key(const lua_TValue* key)
+{
+    return ttisnumber(key) && nvalue(key) >= 1 && FValue::is_integral(nvalue(key));
+}
+
+FString LuaConverter::convert_key(const lua_TValue* key)
+{
+    switch (ttypenv(key))
+    {
+        case LUA_TSTRING:
+            return intern(rawtsvalue(key));
+        case LUA_TNUMBER:
+        {
+            lua_Number n = nvalue(key);
+            if (FValue::is_integral(n))
+            {
+                if (n >= 0)
+                    return index_key(size_t(n));
+                return FString::intern(pool, std::to_string(uint64_t(int64_t(n))));
+            }
+            return FString::intern(pool, std::to_string(double(n)));
+        }
+        case LUA_TBOOLEAN:
+            return FString::intern(pool, bvalue(key) ? "true" : "false");
+        default:
+            logger.critical("unsupported lua type for key: {0}", ttypenv(key));
+            abort();
+    }
+}
+
+FValue LuaConverter::convert_value(const lua_TValue* value)
+{
+    switch (ttypenv(value))
+    {
+        case LUA_TSTRING:
+            return intern(rawtsvalue(value));
+        case LUA_TNUMBER:
+            return FValue::number(nvalue(value));
+        case LUA_TBOOLEAN:
+            return bool(bvalue(value));
+        case LUA_TTABLE:
+            return convert_table(hvalue(value));
+        default:
+            logger.critical("unsupported lua type for value: {0}", ttypenv(value));
+            abort();
+    }
+}
+
+FObject* LuaConverter::convert_table(const Table* t)
+{
+    FObject* obj = dedup ? nullptr : arena.make<FObject>();
+    size_t start = scratch.size();
+    size_t array_start = array_scratch.size();
+    size_t pending_start = pending.size();
+
+    // Lua's array part up to its first hole starts ours, whatever comes after the hole may still continue it
+    int i = 0;
+    for (; i < t->sizearray && !ttisnil(&t->array[i]); i++)
+    {
+        FValue converted = convert_value(&t->array[i]);
+        array_scratch.push_back(converted);
+    }
+    for (; i < t->sizearray; i++)
+    {
+        if (ttisnil(&t->array[i]))
+            continue;
+
+        FValue converted = convert_value(&t->array[i]);
+        pending.emplace_back(uint64_t(i) + 1, converted);
+    }
+
+    for (const Node* n = t->firstadded; n; n = n->next)
+    {
+        if (ttisnil(gval(n)))
+            continue;
+
+        if (is_array_key(gkey(n)))
+        {
+            FValue converted = convert_value(gval(n));
+            pending.emplace_back(uint64_t(nvalue(gkey(n))), converted);
+            continue;
+        }
+
+        FString key = convert_key(gkey(n));
+        FValue converted = convert_value(gval(n));
+        scratch.emplace_back(key, converted);
+    }
+
+    return finish_table(obj, start, array_start, pending_start);
+}
+
+FObject* LuaConverter::finish_table(FObject* obj, size_t start, size_t array_start, size_t pending_start)
+{
+    // Integer keys outside lua's array part, in order: the ones that continue the array join it, the rest are plain keys
+    std::sort(pending.begin() + pending_start, pending.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (auto it = pending.begin() + pending_start; it != pending.end(); ++it)
+    {
+        if (it->first == array_scratch.size() - array_start + 1)
+            array_scratch.push_back(it->second);
+        else
+            scratch.emplace_back(index_key(size_t(it->first)), it->second);
+    }
+    pending.resize(pending_start);
+
+    uint32_t count = uint32_t(scratch.size() - start);
+    size_t array_count = array_scratch.size() - array_start;
+    if (dedup)
+    {
+        // Equal tables only have equal children once both are in key order
+        std::sort(scratch.begin() + start, scratch.end(), FObject::key_order);
+        obj = dedup->intern(scratch.data() + start, count, array_scratch.data() + array_start, array_count, arena);
+    }
+    else
+    {
+        if (!obj)
+            obj = arena.make<FObject>();
+        obj->children.items = arena.make_array<FKeyValue>(count);
+        obj->children.count = count;
+        std::copy(scratch.begin() + start, scratch.end(), obj->children.items);
+        obj->array = FArray::pack(array_scratch.data() + array_start, array_count, arena);
+        obj->sort();
+    }
+    scratch.resize(start);
+    array_scratch.resize(array_start);
+    return obj;
+}
+
+FObject* LuaConverter::convert_parallel(const Table* t, std::vector<Arena>& worker_arenas, unsigned threads)
+{
+    struct job
+    {
+        const Table* table;
+        FValue* slot;
+    };
+    std::vector<job> jobs;
+
+    // Both top levels are sized up front and filled in place, so the slots handed to the workers don't move until they
+    // are done. Sorting and packing the array parts have to wait until after the join for the same reason.
+    auto shallow = [&](const Table* t, auto on_table) {
+        // Integer keys are sorted out into array part and plain keys the same way finish_table does it
+        std::vector<std::pair<uint64_t, const TValue*>> indexed;
+        std::vector<std::pair<FString, const TValue*>> named;
+        for (int i = 0; i < t->sizearray; i++)
+        {
+            if (!ttisnil(&t->array[i]))
+                indexed.emplace_back(uint64_t(i) + 1, &t->array[i]);
+        }
+        for (const Node* n = t->firstadded; n; n = n->next)
+        {
+            if (ttisnil(gval(n)))
+                continue;
+            if (is_array_key(gkey(n)))
+                indexed.emplace_back(uint64_t(nvalue(gkey(n))), gval(n));
+            else
+                named.emplace_back(convert_key(gkey(n)), gval(n));
+        }
+        std::sort(indexed.begin(), indexed.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        size_t array_count = 0;
+        for (const auto& [index, value] : indexed)
+        {
+            if (index == array_count + 1)
+                array_count++;
+            else
+                named.emplace_back(index_key(size_t(index)), value);
+        }
+
+        auto fill = [&](FValue& slot, const TValue* value) {
+            if (ttistable(value))
+                on_table(hvalue(value), slot);
+            else
+                slot = convert_value(value);
+        };
+
+        FObject* obj = arena.make<FObject>();
+        obj->children.items = arena.make_array<FKeyValue>(named.size());
+        obj->children.count = uint32_t(named.size());
+        for (size_t i = 0; i < named.size(); i++)
+        {
+            obj->children.items[i].key = named[i].first;
+            fill(obj->children.items[i].value, named[i].second);
+        }
+
+        // Full FValues for now, a worker may still be filling one of them in
+        FValue* elements = arena.make_array<FValue>(array_count);
+        obj->array.items = elements;
+        obj->array.count = uint32_t(array_count);
+        for (size_t i = 0; i < array_count; i++)
+            fill(elements[i], indexed[i].second);
+        return obj;
+    };
+
+    std::vector<FObject*> types;
+    FObject* root = shallow(t, [&](const Table* type_table, FValue& type_slot) {
+        FObject* type = shallow(type_table, [&](const Table* prototype, FValue& slot) {
+            jobs.push_back({ prototype, &slot });
+        });
+        types.push_back(type);
+        type_slot = type;
+    });
+
+    threads = std::max(1u, std::min(threads, unsigned(jobs.size())));
+    if (worker_arenas.size() < threads)
+        worker_arenas.resize(threads);
+
+    // Prototypes vary a lot in size, so workers pull the next one off a shared counter rather than getting a fixed slice
+    std::atomic<size_t> next_job{ 0 };
+    auto worker = [&](Arena& worker_arena) {
+        LuaConverter converter(worker_arena, pool, logger);
+        converter.dedup = dedup;
+        for (size_t i = next_job++; i < jobs.size(); i = next_job++)
+        {
+            *jobs[i].slot = converter.convert_table(jobs[i].table);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+    {
+        pool.emplace_back(worker, std::ref(worker_arenas[i]));
+    }
+    worker(worker_arenas[0]);
+    for (auto& thread : pool)
+    {
+        thread.join();
+    }
+
+    auto finish = [&](FObject* obj) {
+        if (!obj->array.empty())
+            obj->array = FArray::pack(obj->array.values(), obj->array.size(), arena);
+        obj->sort();
+    };
+    for (FObject* type : types)
+    {
+        finish(type);
+    }
+    finish(root);
+    return root;
+}
+
+FValue LuaConverter::convert(lua_State* L, int index)
+{
+    if (lua_istable(L, index))
+    {
+        return convert_table(static_cast<const Table*>(lua_topointer(L, index)));
+    }
+
+    switch (lua_type(L, index))
+    {
+        case LUA_TSTRING:
+        {
+            size_t len;
+            const char* buffer = lua_getstring(L, index, &len);
+            return FString::intern(pool, std::string_view(buffer, len));
+        }
+        case LUA_TNUMBER:
+            return FValue::number(lua_tonumber(L, index));
+        case LUA_TBOOLEAN:
+            return bool(lua_toboolean(L, index));
+        default:
+            return FValue();
+    }
+}
+
+FString LuaConverter::convert_key(lua_State* L, int index)
+{
+    switch (lua_type(L, index))
+    {
+        case LUA_TSTRING:
+        {
+            size_t len;
+            const char* buffer = lua_getstring(L, index, &len);
+            return FString::intern(pool, std::string_view(buffer, len));
+        }
+        case LUA_TNUMBER:
+        {
+            lua_Number n = lua_tonumber(L, index);
+            if (FValue::is_integral(n))
+            {
+                if (n >= 0)
+                    return index_key(size_t(n));
+                return FString::intern(pool, std::to_string(uint64_t(int64_t(n))));
+            }
+            return FString::intern(pool, std::to_string(double(n)));
+        }
+        case LUA_TBOOLEAN:
+            return FString::intern(pool, lua_toboolean(L, index) ? "true" : "false");
+        default:
+            logger.critical("unsupported lua type for key: {0}", lua_type(L, index));
+            abort();
+    }
+}
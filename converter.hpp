@@ -0,0 +1,70 @@
+#pragma once
+#include <vector>
+
+#include <lua.h>
+
+#include "arena.hpp"
+#include "fobject.hpp"
+#include "tree_dedup.hpp"
+
+struct Table;
+struct lua_TValue;
+union TString;
+
+//Converts lua tables into FObjects by walking the Table/Node structures directly instead of going through lua_next.
+//Nothing is pushed onto the lua stack and the lua heap is only read, never written, while converting.
+struct LuaConverter
+{
+    static constexpr size_t string_cache_size = 1 << 16;
+
+    struct string_cache_entry
+    {
+        const TString* ts = nullptr;
+        FString str;
+    };
+
+    Arena& arena;
+    //Every string in the converted tree is interned here, the parallel workers share it with their own arenas
+    StringPool& pool;
+    //A table holding something that isn't a string, number, boolean or table is fatal, this says which
+    spdlog::logger& logger;
+
+    //Lua already interns short strings, so a TString* identifies its contents. This is a direct-mapped cache on the hash lua
+    //computed when it created the string, a miss just falls through to the StringPool.
+    std::vector<string_cache_entry> strings;
+    //Children of every table currently being converted, innermost table on top. Each table copies its slice into the arena
+    //and pops it before returning, so the nodes only get walked once and the arena allocation is exact.
+    std::vector<FKeyValue> scratch;
+    //Same for the array parts
+    std::vector<FValue> array_scratch;
+    //Integer keys that might continue an array part, sorted out in finish_table
+    std::vector<std::pair<uint64_t, FValue>> pending;
+    //Shares identical tables instead of converting each copy, see TreeDedup. Not owned, may be shared between converters.
+    TreeDedup* dedup = nullptr;
+
+    //Only the Table walks (convert_table, convert_parallel) use the string cache, one that only converts off the lua stack
+    //can do without it
+    LuaConverter(Arena& arena, StringPool& pool, spdlog::logger& logger, bool string_cache = true)
+        : arena(arena), pool(pool), logger(logger), strings(string_cache ? string_cache_size : 0) {}
+
+    //Convert the value at a stack index
+    FValue convert(lua_State* L, int index);
+    //Convert a table key at a stack index
+    FString convert_key(lua_State* L, int index);
+
+    FObject* convert_table(const Table* t);
+    //Turns everything pushed onto scratch, array_scratch and pending since the given sizes into obj (a new object if
+    //null), or into the shared copy when deduplicating, and pops it again
+    FObject* finish_table(FObject* obj, size_t start, size_t array_start, size_t pending_start);
+
+    //data.raw shaped conversion spread over worker threads: the top two levels (prototype type -> prototype name) are built
+    //here, every prototype below that is handed out to a worker, which converts it into its own arena. The lua heap has to
+    //stay untouched until this returns.
+    FObject* convert_parallel(const Table* t, std::vector<Arena>& worker_arenas, unsigned threads);
+
+private:
+    FValue convert_value(const lua_TValue* value);
+    FString convert_key(const lua_TValue* key);
+    FString intern(const TString* ts);
+    FString index_key(size_t index);
+};
@@ -0,0 +1,581 @@
+//Times the load pipeline phase by phase over a generated modpack, see usage(). Results go to stdout (or --output) as JSON,
+//everything the VM reports goes to stderr.
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util.hpp"
+#include "vm.hpp"
+#include "fobject.hpp"
+#include "data_tree.hpp"
+#include "search_index.hpp"
+#include "reference_index.hpp"
+#include "production_graph.hpp"
+#include "modpack_generator.hpp"
+#include "data_writer.hpp"
+
+#include "spdlog/sinks/stdout_color_sinks.h"
+
+// Every C++ allocation in the process is counted, lua's own blocks come out of LuaPool slabs and are reported from the
+// VM's heap accounting instead
+static std::atomic<uint64_t> allocations{ 0 };
+static std::atomic<uint64_t> allocated_bytes{ 0 };
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* ptr = malloc(size ? size : 1); ptr)
+        return ptr;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    try { return operator new(size); }
+    catch (...) { return nullptr; }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return operator new(size, std::nothrow); }
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+
+
+//What the browser's treebox holds, without nana: populated, expanded and filtered exactly like data_browser.cpp does it
+//through DataTree, so the cost of building paths and labels and walking the FObjects is measured without a window
+struct TreeModel
+{
+    static constexpr const char* placeholder_key = "...";
+
+    struct Item
+    {
+        std::string key;
+        std::string text;
+        uint32_t owner;
+        std::vector<uint32_t> children;
+        bool expanded = false;
+        bool hidden = false;
+    };
+    std::vector<Item> items;
+    DataTree tree;
+    SearchIndex::Result filter;
+    std::vector<uint64_t> type_signatures;
+
+    TreeModel(const FObject& data_raw) : tree(data_raw) {}
+
+    uint32_t insert(uint32_t owner, std::string key, std::string text)
+    {
+        const uint32_t index = uint32_t(items.size());
+        items.push_back({ std::move(key), std::move(text), owner });
+        if (index != owner)
+            items[owner].children.push_back(index);
+        return index;
+    }
+
+    std::string_view path_of(uint32_t node) const { return node == 0 ? std::string_view("data/raw") : std::string_view(items[node].key); }
+
+    bool is_filled(uint32_t node) const
+    {
+        return !(items[node].children.size() == 1 && items[items[node].children[0]].key == placeholder_key);
+    }
+
+    void fill(uint32_t node)
+    {
+        if (is_filled(node))
+            return;
+        // Like the treebox, cleared children are gone from the tree, the vector just doesn't reuse their slots
+        items[node].children.clear();
+
+        std::vector<std::string_view> keys;
+        for (uint32_t at = node; at != 0; at = items[at].owner)
+            keys.push_back(path_of(at).substr(path_of(items[at].owner).size() + 1));
+        std::reverse(keys.begin(), keys.end());
+
+        std::vector<uint32_t> open;
+        tree.rows(tree.table(keys), path_of(node), keys.size(), [&](const DataTree::Row& row) {
+            const uint32_t child = insert(node, std::string(row.path), DataTree::label(row.entry));
+            if (row.expandable)
+            {
+                insert(child, placeholder_key, "...");
+                if (row.expand)
+                    open.push_back(child);
+            }
+        });
+
+        for (uint32_t child : open)
+            expand(child);
+    }
+
+    void expand(uint32_t node)
+    {
+        items[node].expanded = true;
+        fill(node);
+    }
+
+    void populate()
+    {
+        items.clear();
+        insert(0, "raw", "data.raw");
+        insert(0, placeholder_key, "...");
+        expand(0);
+        type_signatures.assign(items[0].children.size(), 1);
+    }
+
+    void apply_filter(const SearchIndex& index, SearchIndex::Result result)
+    {
+        filter = std::move(result);
+        tree.index = &index;
+        tree.filter = &filter;
+
+        for (size_t i = 0; i < items[0].children.size(); i++)
+        {
+            const uint32_t type = items[0].children[i];
+            const uint32_t document = index.find(path_of(type));
+            const SearchIndex::Result::visibility shown = filter.of(document);
+            items[type].hidden = shown == SearchIndex::Result::hidden;
+
+            const uint64_t signature = index.shown_prototypes(filter, document);
+            if (signature != type_signatures[i] && is_filled(type))
+            {
+                items[type].children.clear();
+                insert(type, placeholder_key, "...");
+                fill(type);
+            }
+            type_signatures[i] = signature;
+
+            if (shown == SearchIndex::Result::opened && !items[type].expanded)
+                expand(type);
+        }
+    }
+};
+
+
+struct Phase
+{
+    struct Sample
+    {
+        std::chrono::steady_clock::duration elapsed;
+        uint64_t allocations;
+        uint64_t bytes;
+        uint64_t lua_bytes;
+    };
+
+    std::string name;
+    std::vector<Sample> samples;
+};
+
+//Times whatever runs between construction and stop(), with the allocations it made
+struct PhaseTimer
+{
+    Phase& phase;
+    uint64_t start_allocations = allocations.load();
+    uint64_t start_bytes = allocated_bytes.load();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    PhaseTimer(Phase& phase) : phase(phase) {}
+
+    void stop(bool record, uint64_t lua_bytes = 0)
+    {
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        if (record)
+            phase.samples.push_back({ elapsed, allocations.load() - start_allocations, allocated_bytes.load() - start_bytes, lua_bytes });
+    }
+};
+
+template<typename T>
+static T median(std::vector<T> values)
+{
+    std::sort(values.begin(), values.end());
+    const size_t mid = values.size() / 2;
+    return values.size() % 2 ? values[mid] : T((values[mid - 1] + values[mid]) / 2);
+}
+
+static double ms(std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+static std::string json_string(const std::string& text)
+{
+    std::string out = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (uint8_t(c) >= 0x20)
+            out += c;
+    }
+    return out + "\"";
+}
+
+static std::string phase_json(const Phase& phase)
+{
+    std::vector<double> times;
+    std::vector<uint64_t> counts, bytes, lua_bytes;
+    for (const Phase::Sample& sample : phase.samples)
+    {
+        times.push_back(ms(sample.elapsed));
+        counts.push_back(sample.allocations);
+        bytes.push_back(sample.bytes);
+        lua_bytes.push_back(sample.lua_bytes);
+    }
+
+    std::string runs;
+    for (double time : times)
+        runs += fmt::format("{0}{1:.3f}", runs.empty() ? "" : ",", time);
+
+    std::string out = fmt::format("\"{0}\":{{\"median_ms\":{1:.3f},\"min_ms\":{2:.3f},\"max_ms\":{3:.3f},\"runs_ms\":[{4}],"
+                                  "\"allocations\":{5},\"allocated_bytes\":{6}",
+                                  phase.name, median(times), *std::min_element(times.begin(), times.end()),
+                                  *std::max_element(times.begin(), times.end()), runs, median(counts), median(bytes));
+    if (*std::max_element(lua_bytes.begin(), lua_bytes.end()))
+        out += fmt::format(",\"lua_allocated_bytes\":{0}", median(lua_bytes));
+    return out + "}";
+}
+
+//data.raw of a VM of its own as the binary DataWriter stream, empty if anything failed. Everything stays on the calling
+//thread, so several of these can run side by side.
+static std::string load_binary(const fs::path& game, const fs::path& lualib, bool dedup, const std::string& name)
+{
+    // A logger of its own, named so the lines can be told apart. Only warnings and errors, the stats of a dozen VMs
+    // loading the same pack would just bury them.
+    auto logger = std::make_shared<spdlog::logger>(name, std::make_shared<spdlog::sinks::stderr_color_sink_mt>());
+    logger->set_level(spdlog::level::warn);
+    VM vm(game, logger, lualib, 1);
+    vm.dedup_data_raw = dedup;
+    if (!vm.schedule_mods(vm.modlist))
+        return {};
+    vm.run_data_stage(1);
+    FObject* data_raw = vm.get_data_raw(1);
+
+    FILE* file = std::tmpfile();
+    if (!file)
+        return {};
+    std::string out;
+    if (DataWriter::write(*data_raw, DataWriter::Format::binary, file) && fflush(file) == 0)
+    {
+        rewind(file);
+        char buffer[1 << 16];
+        for (size_t read; (read = fread(buffer, 1, sizeof(buffer), file)) != 0;)
+            out.append(buffer, read);
+    }
+    fclose(file);
+    return out;
+}
+
+static void usage(const char* self)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --mods N           generated mods (default 50)\n"
+        "  --prototypes N     prototypes per mod and in base (default 200)\n"
+        "  --depth N          nesting depth of every prototype's tables (default 3)\n"
+        "  --fanout N         files each data.lua requires (default 4)\n"
+        "  --dependencies N   info.json dependencies per mod (default 3)\n"
+        "  --seed N           generator seed (default 1)\n"
+        "  --runs N           measured runs per phase, the report has medians (default 5)\n"
+        "  --warmup N         unmeasured runs first, they fill the chunk and page caches (default 1)\n"
+        "  --dedup            share identical tables in get_data_raw\n"
+        "  --threads N        threads for discovery and conversion, 0 is one per hardware thread (default 0)\n"
+        "  --stress N         instead of the phases, load N VMs one after another and then N at once on their own threads,\n"
+        "                     each run fails if any tree's binary DataWriter output differs from the serial ones\n"
+        "  --dir DIR          where to generate the game dir (default a temp dir)\n"
+        "  --game DIR         benchmark an existing game dir instead of generating one\n"
+        "  --label TEXT       stored in the report as is, e.g. the commit being measured\n"
+        "  --lualib DIR       where serpent.lua and bootstrap.lua are, default is next to this executable\n"
+        "  -o, --output FILE  write the JSON report to FILE instead of stdout\n",
+        self);
+}
+
+int main(int argc, char** argv)
+{
+    ModpackGenerator::Config config;
+    uint32_t runs = 5;
+    uint32_t warmup = 1;
+    unsigned threads = 0;
+    uint32_t stress = 0;
+    bool dedup = false;
+    fs::path dir = fs::temp_directory_path() / "naughty_factorio_bench";
+    fs::path game;
+    fs::path lualib;
+    fs::path output;
+    std::string label;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "%s needs a value\n", arg.c_str());
+                exit(2);
+            }
+            return argv[++i];
+        };
+        auto number = [&]() { return uint32_t(std::stoul(value())); };
+
+        if (arg == "-h" || arg == "--help")
+        {
+            usage(argv[0]);
+            return 0;
+        }
+        else if (arg == "--mods")
+            config.mods = number();
+        else if (arg == "--prototypes")
+            config.prototypes = number();
+        else if (arg == "--depth")
+            config.depth = number();
+        else if (arg == "--fanout")
+            config.fanout = number();
+        else if (arg == "--dependencies")
+            config.dependencies = number();
+        else if (arg == "--seed")
+            config.seed = number();
+        else if (arg == "--runs")
+            runs = std::max(number(), 1u);
+        else if (arg == "--warmup")
+            warmup = number();
+        else if (arg == "--dedup")
+            dedup = true;
+        else if (arg == "--threads")
+            threads = number();
+        else if (arg == "--stress")
+            stress = number();
+        else if (arg == "--dir")
+            dir = value();
+        else if (arg == "--game")
+            game = value();
+        else if (arg == "--label")
+            label = value();
+        else if (arg == "--lualib")
+            lualib = value();
+        else if (arg == "-o" || arg == "--output")
+            output = value();
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (lualib.empty())
+    {
+        std::error_code ec;
+        const fs::path self_dir = fs::weakly_canonical(fs::absolute(argv[0]), ec).parent_path();
+        if (!ec && fs::exists(self_dir / "serpent.lua"))
+            lualib = self_dir;
+    }
+
+    Phase generate{ "generate" };
+    if (game.empty())
+    {
+        PhaseTimer timer(generate);
+        if (!ModpackGenerator::generate(config, dir))
+            return 1;
+        timer.stop(true);
+        game = dir;
+    }
+
+    Phase stress_serial{ "stress_serial" };
+    Phase stress_parallel{ "stress_parallel" };
+    size_t mismatches = 0;
+    for (uint32_t run = 0; stress && run < warmup + runs; run++)
+    {
+        const bool record = run >= warmup;
+
+        std::vector<std::string> serial(stress), parallel(stress);
+        PhaseTimer serial_timer(stress_serial);
+        for (uint32_t i = 0; i < stress; i++)
+            serial[i] = load_binary(game, lualib, dedup, fmt::format("serial vm {0}", i));
+        serial_timer.stop(record);
+
+        PhaseTimer parallel_timer(stress_parallel);
+        std::vector<std::thread> pool;
+        for (uint32_t i = 0; i < stress; i++)
+            pool.emplace_back([&, i]() { parallel[i] = load_binary(game, lualib, dedup, fmt::format("parallel vm {0}", i)); });
+        for (auto& thread : pool)
+            thread.join();
+        parallel_timer.stop(record);
+
+        // Serial runs are checked against each other too, a difference there isn't down to threading but is just as wrong
+        for (uint32_t i = 0; i < stress; i++)
+        {
+            if (serial[i].empty() || serial[i] != serial[0] || parallel[i] != serial[0])
+            {
+                fprintf(stderr, "stress run %u: vm %u differs (serial %zu bytes, parallel %zu bytes, first serial %zu bytes)\n", run, i,
+                        serial[i].size(), parallel[i].size(), serial[0].size());
+                mismatches++;
+            }
+        }
+    }
+
+    Phase discover{ "discover_mods" };
+    Phase schedule{ "schedule_mods" };
+    Phase data_stage{ "run_data_stage" };
+    Phase convert{ "get_data_raw" };
+    Phase sort{ "sort" };
+    Phase populate{ "tree_populate" };
+    Phase expand{ "tree_expand" };
+    Phase search_index{ "search_index" };
+    Phase filter{ "apply_filter" };
+    Phase scan{ "pool_scan" };
+    Phase reference_index{ "reference_index" };
+    Phase uses{ "uses_query" };
+    Phase production_graph{ "production_graph" };
+    Phase raw_cost{ "raw_cost" };
+
+    // Filters as they'd be typed: nothing, a type, a mod prefix, a single prototype and something that matches nothing
+    const std::vector<std::string> filters = { "", "recipe", ModpackGenerator::mod_name(config.mods / 2), "base-item-10", "no-such-prototype" };
+
+    auto logger = std::make_shared<spdlog::logger>("bench", std::make_shared<spdlog::sinks::stderr_color_sink_mt>());
+    size_t tree_items = 0;
+    size_t uses_queries = 0;
+    size_t uses_sites = 0;
+    size_t recipes = 0;
+    size_t objects = 0;
+    for (uint32_t run = 0; !stress && run < warmup + runs; run++)
+    {
+        const bool record = run >= warmup;
+
+        PhaseTimer discover_timer(discover);
+        VM vm(game, logger, lualib, threads);
+        vm.dedup_data_raw = dedup;
+        discover_timer.stop(record);
+
+        PhaseTimer schedule_timer(schedule);
+        if (!vm.schedule_mods(vm.modlist))
+            return 1;
+        schedule_timer.stop(record);
+
+        PhaseTimer data_stage_timer(data_stage);
+        vm.run_data_stage(threads);
+        size_t lua_bytes = vm.lualib_heap.allocated;
+        for (Mod* mod : vm.load_order)
+            lua_bytes += mod->heap.allocated;
+        data_stage_timer.stop(record, lua_bytes);
+
+        PhaseTimer convert_timer(convert);
+        FObject* data_raw = vm.get_data_raw(threads);
+        convert_timer.stop(record);
+
+        // Converting sorts as it goes, so the children are shuffled (the same way every run) to give sort real work
+        std::vector<FObject*> tables = { data_raw };
+        for (size_t i = 0; i < tables.size(); i++)
+        {
+            for (const FKeyValue& kv : tables[i]->children)
+                if (FObject* const* child = kv.value.as<FObject*>(); child)
+                    tables.push_back(*child);
+            if (tables[i]->array.kind == FArray::Kind::values)
+                for (size_t j = 0; j < tables[i]->array.size(); j++)
+                    if (FObject* const* child = tables[i]->array.values()[j].as<FObject*>(); child)
+                        tables.push_back(*child);
+        }
+        std::mt19937 rng(config.seed);
+        for (FObject* table : tables)
+            std::shuffle(table->children.begin(), table->children.end(), rng);
+        objects = tables.size();
+
+        PhaseTimer sort_timer(sort);
+        for (FObject* table : tables)
+            table->sort();
+        sort_timer.stop(record);
+
+        TreeModel tree(*data_raw);
+        PhaseTimer populate_timer(populate);
+        tree.populate();
+        populate_timer.stop(record);
+
+        // Opening every prototype type, about what the old tree built up front
+        PhaseTimer expand_timer(expand);
+        for (uint32_t type : std::vector<uint32_t>(tree.items[0].children))
+            tree.expand(type);
+        expand_timer.stop(record);
+        tree_items = tree.items.size();
+
+        PhaseTimer index_timer(search_index);
+        SearchIndex index;
+        index.build(*data_raw);
+        index_timer.stop(record);
+
+        // Queries run here instead of on BackgroundSearch's worker, so they are timed together with applying them
+        PhaseTimer filter_timer(filter);
+        for (const std::string& text : filters)
+        {
+            SearchIndex::Result result;
+            index.query(text, result, [] { return false; }, true);
+            tree.apply_filter(index, std::move(result));
+        }
+        filter_timer.stop(record);
+
+        // The filter's budget is a frame. Copies of the index text up to 50 MB, scanned for something that is nowhere in it.
+        std::string pool;
+        while (!index.text.empty() && pool.size() < (50 << 20))
+            pool += index.text;
+        PhaseTimer scan_timer(scan);
+        const size_t found = SubstringScan::find(pool, "no-such-prototype", true);
+        scan_timer.stop(record);
+        if (found != SubstringScan::npos)
+            fprintf(stderr, "pool scan found a match at %zu that can't be there\n", found);
+
+        PhaseTimer references_timer(reference_index);
+        ReferenceIndex references;
+        references.build(*data_raw, threads);
+        references_timer.stop(record);
+
+        // Where every prototype is used, what the browser's panel asks for each time one is selected
+        PhaseTimer uses_timer(uses);
+        size_t sites = 0;
+        for (const ReferenceIndex::Prototype& prototype : references.prototypes)
+            sites += references.uses(prototype.name).size();
+        uses_timer.stop(record);
+        uses_queries = references.prototypes.size();
+        uses_sites = sites;
+
+        PhaseTimer graph_timer(production_graph);
+        ProductionGraph graph;
+        graph.build(*data_raw);
+        graph_timer.stop(record);
+
+        PhaseTimer cost_timer(raw_cost);
+        RawCost cost;
+        cost.compute(graph, threads);
+        cost_timer.stop(record);
+        recipes = graph.recipes.size();
+    }
+
+    std::string report = "{";
+    report += fmt::format("\"label\":{0},\"game\":{1},\"generated\":{2},\"config\":{3},\"runs\":{4},\"warmup\":{5},\"threads\":{6},\"dedup\":{7},",
+                          json_string(label), json_string(ws2s(game.generic_wstring())), generate.samples.empty() ? "false" : "true", config.to_json(), runs, warmup, threads, dedup);
+    if (stress)
+        report += fmt::format("\"stress\":{0},\"mismatches\":{1},", stress, mismatches);
+    report += fmt::format("\"tables\":{0},\"tree_items\":{1},\"scan_kernel\":{2},\"uses_queries\":{3},\"uses_sites\":{4},\"recipes\":{5},\"phases\":{{",
+                          objects, tree_items, json_string(SubstringScan::kernel()), uses_queries, uses_sites, recipes);
+    bool first = true;
+    for (const Phase* phase : { &generate, &stress_serial, &stress_parallel, &discover, &schedule, &data_stage, &convert, &sort, &populate, &expand, &search_index, &filter, &scan, &reference_index, &uses, &production_graph, &raw_cost })
+    {
+        if (phase->samples.empty())
+            continue;
+        report += (first ? "" : ",") + phase_json(*phase);
+        first = false;
+    }
+    report += "}}\n";
+
+    FILE* out = output.empty() ? stdout : fopen(output.string().c_str(), "wb");
+    if (!out)
+    {
+        fprintf(stderr, "can't open %s for writing\n", output.string().c_str());
+        return 1;
+    }
+    fputs(report.c_str(), out);
+    if (out != stdout)
+        fclose(out);
+    return mismatches ? 1 : 0;
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <chrono>
 #include <codecvt>
 #include <cstdio>
@@ -5,6 +6,7 @@
 #include <fstream>
 #include <iostream>
 #include <locale>
+#include <optional>
 #include <nana/gui.hpp>
 #include <nana/gui/widgets/group.hpp>
 #include <nana/gui/widgets/button.hpp>
@@ -28,18 +30,17 @@
 #include "spdlog/sinks/basic_file_sink.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
 
-auto err_logger = spdlog::stderr_color_mt("stderr");
+static auto err_logger = spdlog::stderr_color_mt("stderr");
 
 #include "util.hpp"
 #include "fobject.hpp"
 #include "vm.hpp"
 #include "factorio_data.hpp"
-
-void prof::print(const std::string& name)
-{
-    fprintf(stderr, "elapsed (%s): %" PRId64 "ms\n", name.c_str(), int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed()).count()));
-}
-
+#include "snapshot.hpp"
+#include "frozen.hpp"
+#include "data_tree.hpp"
+#include "search_index.hpp"
+#include "reference_index.hpp"
 
 #if defined(VERBOSE_LOGGING)
 #define verbose_log fprintf
@@ -50,92 +51,13 @@ void prof::print(const std::string& name)
 namespace fs = std::filesystem;
 
 
-FILE* log_ = nullptr;
-
-std::wstring s2ws(const std::string& str)
-{
-    using convert_typeX = std::codecvt_utf8<wchar_t>;
-    std::wstring_convert<convert_typeX, wchar_t> converterX;
-
-    return converterX.from_bytes(str);
-}
-
-std::string ws2s(const std::wstring& wstr)
-{
-    using convert_typeX = std::codecvt_utf8<wchar_t>;
-    std::wstring_convert<convert_typeX, wchar_t> converterX;
-
-    return converterX.to_bytes(wstr);
-}
-
-std::chrono::time_point<std::chrono::steady_clock> last_updated;
-
-
-std::vector<char> load_file_contents(std::string const& filepath)
-{
-    std::ifstream ifs(filepath, std::ios::binary | std::ios::ate);
-
-    if (!ifs)
-        throw std::runtime_error(filepath + ": " + std::strerror(errno));
-
-    auto end = ifs.tellg();
-    ifs.seekg(0, std::ios::beg);
-
-    auto size = std::size_t(end - ifs.tellg());
-
-    if (size == 0) // avoid undefined behavior
-        return {};
-
-    std::vector<char> buffer(size);
 
-    if (!ifs.read((char*)buffer.data(), buffer.size()))
-        throw std::runtime_error(filepath + ": " + std::strerror(errno));
 
-    return buffer;
-}
-
-
-
-static void unhide_recursive_up(nana::treebox::item_proxy node)
-{
-    node.hide(false);
-    node.expand(true);
-    if (node.level())
-        unhide_recursive_up(node.owner());
-}
-static void unhide_recursive_down(nana::treebox::item_proxy node)
-{
-    if (node.level() >= 4) return;
-
-    node.hide(false);
-    for (auto ch : node)
-        unhide_recursive_down(ch);
-}
-
-static void apply_filter(const std::string& filter, nana::treebox::item_proxy node)
-{
-    // Don't filter too far down?
-    if (node.level() >= 4) return;
-
-    node.hide(true);
-
-    // check if this node matches
-    if (filter.length() == 0 || node.key().find(filter) != std::string::npos)
-    {
-        unhide_recursive_up(node);
-        unhide_recursive_down(node);
-    }
-    // or if our children do
-    else
-    {
-        for (auto ch : node)
-        {
-            apply_filter(filter, ch);
-        }
-    }
-}
 
-static const std::chrono::milliseconds filter_throttle_interval_ms(50);
+//How often the UI checks whether the search worker has a result, only while a query is outstanding
+static const std::chrono::milliseconds filter_poll_interval_ms(15);
+//Same for the reference index, while the usages panel is waiting for it to be built
+static const std::chrono::milliseconds usages_poll_interval_ms(100);
 
 
 //Base class for a value_editor, its job is to sit in a vector and hold references to widgets to they can be cleaned up on destruction
@@ -349,25 +271,171 @@ struct UI
     nana::treebox data_raw;
     nana::picture sprite_preview;
     nana::timer update_filtering;
+    nana::timer update_usages;
     nana::textbox search;
+    //Where the selected prototype, or string value, is used
+    nana::listbox usages;
     bool filter_pending = false;
+    std::chrono::steady_clock::time_point filter_submitted;
 
-    using bind_model_view = std::function<void(block_editor&, FObject&)>;
+    using bind_model_view = std::function<void(block_editor&, const FObject&)>;
     std::unordered_map<std::string, bind_model_view> model_bindings;
     std::unordered_map<std::string, std::unique_ptr<block_editor>> editors;
     
-    FObject& data;
-
-    UI(FObject& data) : 
+    const FObject& data;
+
+    //Items only exist below expanded nodes, see DataTree
+    DataTree tree;
+    nana::treebox::item_proxy root_item;
+    //Queries run on its worker, the tree only gets the result for the last one typed
+    std::optional<BackgroundSearch> searcher;
+    SearchIndex::Result filter_result;
+    //SearchIndex::shown_prototypes of every type (the root's children, which always exist) for the applied filter
+    std::vector<uint64_t> type_signatures;
+    //Built on a worker alongside the search index, or on this thread on first use when the tree is lazy
+    std::optional<BackgroundReferences> references;
+    //What the usages panel showed while the reference index wasn't built yet, it's looked up again once it is
+    std::string usages_pending;
+    //Tables get one of these as their only child until they're expanded, so the treebox draws an expander for them. Real
+    //keys are paths, so they never look like this
+    static constexpr const char* placeholder_key = "...";
+
+    //With a frozen copy of data the indices are built from that, on their workers, and data is only thawed where it's
+    //shown
+    UI(const FObject& data, bool index_on_worker, const FrozenObject& frozen = {}) : 
         win{ nana::API::make_center(1024, 1024), nana::appear::decorate<nana::appear::taskbar>() },
         data_raw(win),
         layout(win),
         search(win),
-        data(data)
+        usages(win),
+        data(data),
+        tree(data)
     {
+        if (frozen)
+        {
+            searcher.emplace(frozen);
+            references.emplace(frozen);
+        }
+        else
+        {
+            searcher.emplace(data, index_on_worker);
+            references.emplace(data, index_on_worker);
+        }
+        usages.append_header("used by", 280);
+        root_item = data_raw.insert("raw", "data.raw");
         install_events();
     }
 
+    //Items are keyed by path, apart from the root's which is just "raw"
+    std::string_view path_of(nana::treebox::item_proxy item) const
+    {
+        return item == root_item ? std::string_view("data/raw") : std::string_view(item.key());
+    }
+
+    bool is_filled(nana::treebox::item_proxy item) const
+    {
+        return !(item.size() == 1 && item.child().key() == placeholder_key);
+    }
+
+    void add_placeholder(nana::treebox::item_proxy item)
+    {
+        data_raw.insert(item, placeholder_key, "...");
+    }
+
+    //Swaps the placeholder under item for its rows, opening the ones the filter wants open
+    void fill(nana::treebox::item_proxy item)
+    {
+        if (is_filled(item))
+            return;
+        item.clear();
+
+        // The keys down to item are the differences between the paths, names can have a '/' in them
+        std::vector<std::string_view> keys;
+        for (nana::treebox::item_proxy at = item; !(at == root_item); at = at.owner())
+            keys.push_back(path_of(at).substr(path_of(at.owner()).size() + 1));
+        std::reverse(keys.begin(), keys.end());
+
+        std::vector<nana::treebox::item_proxy> open;
+        tree.rows(tree.table(keys), path_of(item), keys.size(), [&](const DataTree::Row& row) {
+            nana::treebox::item_proxy child = data_raw.insert(item, std::string(row.path), DataTree::label(row.entry));
+            if (row.expandable)
+            {
+                add_placeholder(child);
+                if (row.expand)
+                    open.push_back(child);
+            }
+        });
+
+        for (nana::treebox::item_proxy child : open)
+        {
+            child.expand(true);
+            fill(child);
+        }
+    }
+
+    //Collapsing drops everything below the item again
+    void on_data_expanded(const nana::arg_treebox& arg)
+    {
+        if (arg.operated)
+        {
+            fill(arg.item);
+        }
+        else if (!(arg.item == root_item) && is_filled(arg.item))
+        {
+            arg.item.clear();
+            add_placeholder(arg.item);
+        }
+    }
+
+    //The top level, unfiltered
+    void populate()
+    {
+        data_raw.auto_draw(false);
+        root_item.clear();
+        add_placeholder(root_item);
+        fill(root_item);
+        root_item.expand(true);
+        data_raw.auto_draw(true);
+        type_signatures.assign(root_item.size(), 1);
+    }
+
+    //Only touches what the new result changes: types get hidden or shown, expanded types whose shown prototypes changed
+    //get refilled and types that only show because of some of their prototypes get expanded
+    void apply_filter(SearchIndex::Result result)
+    {
+        const SearchIndex& index = searcher->index();
+        filter_result = std::move(result);
+        tree.index = &index;
+        tree.filter = &filter_result;
+
+        data_raw.auto_draw(false);
+        size_t i = 0;
+        for (nana::treebox::item_proxy type : root_item)
+        {
+            const uint32_t document = index.find(path_of(type));
+            const SearchIndex::Result::visibility shown = filter_result.of(document);
+            const bool hide = shown == SearchIndex::Result::hidden;
+            if (type.hidden() != hide)
+                type.hide(hide);
+
+            const uint64_t signature = index.shown_prototypes(filter_result, document);
+            if (signature != type_signatures[i] && is_filled(type))
+            {
+                type.clear();
+                add_placeholder(type);
+                fill(type);
+            }
+            type_signatures[i++] = signature;
+
+            if (shown == SearchIndex::Result::opened && !type.expanded())
+            {
+                type.expand(true);
+                fill(type);
+            }
+        }
+        data_raw.auto_draw(true);
+    }
+
     std::string path_to_editor_field(const std::string& in)
     {
         std::string copy = in;
@@ -391,65 +459,46 @@ struct UI
             layout[name.c_str()] << *it->second->root;
         }
         editor_switcher += ">";
-        std::string div_left = "< <vert left weight=300<search weight=40><mid>>";
+        std::string div_left = "< <vert left weight=300<search weight=40><mid><usages weight=200>>";
         layout.div(fmt::format("{0} | {1}", div_left, editor_switcher));
         layout["mid"] << data_raw;
 
         search.multi_lines(false);
         layout["search"] << search;
+        layout["usages"] << usages;
 
         layout.collocate();
     }
 
 
-    void do_filtering(const std::chrono::steady_clock::time_point& now)
+    void poll_filtering()
     {
-        fprintf(stderr, "filtering\n");
-        std::string filter = search.getline(0).value();
-        auto root = data_raw.find("raw");
-
-        data_raw.auto_draw(false);
-        apply_filter(filter, root);
-        auto mid = prof::now();
-        data_raw.auto_draw(true);
-        last_updated = now;
+        SearchIndex::Result result;
+        if (!searcher->take(result))
+            return;
+        update_filtering.stop();
         filter_pending = false;
 
-        auto rendered = prof::now();
-
-        update_filtering.stop();
+        auto now = prof::now();
+        apply_filter(std::move(result));
         auto end = prof::now();
 
-        fprintf(stderr, "elapsed     (filtering): %" PRId64 "ms\n", int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(mid - now).count()));
-        fprintf(stderr, "elapsed     (rendering): %" PRId64 "ms\n", int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(rendered - mid).count()));
-        fprintf(stderr, "elapsed    (stop clock): %" PRId64 "ms\n", int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(end - rendered).count()));
-
-        fprintf(stderr, "elapsed         (total): %" PRId64 "ms\n", int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(end - now).count()));
+        fprintf(stderr, "elapsed         (query): %" PRId64 "ms\n", int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(now - filter_submitted).count()));
+        fprintf(stderr, "elapsed         (apply): %" PRId64 "ms\n", int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(end - now).count()));
     }
 
     void on_search_text_changed(const nana::arg_textbox& arg)
     {
-        auto now = prof::now();
-        auto time_since_last_update = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_updated);
-
-        // throttle updates, basically if it's been a while since we last applied a filter, immediately appl it
-        if (time_since_last_update >= filter_throttle_interval_ms)
+        // The worker drops whatever query it was running for this one, the timer picks the result up. Smart case: a query
+        // with no upper case letter in it matches either case.
+        std::string query = search.getline(0).value();
+        const bool ignore_case = std::none_of(query.begin(), query.end(), [](char c) { return c >= 'A' && c <= 'Z'; });
+        searcher->submit(std::move(query), ignore_case);
+        filter_submitted = prof::now();
+        if (!filter_pending)
         {
-            do_filtering(now);
-        }
-        else
-        {
-            // Otherwise check if we don't already have queued up filter, schedule one for throttle-time_since_last_update i.e. the earliest possible time that is not less than throttle rate
-            if (!filter_pending)
-            {
-                update_filtering.reset();
-                update_filtering.interval(filter_throttle_interval_ms - time_since_last_update);
-                update_filtering.elapse([this]() {
-                    do_filtering(prof::now());
-                });
-                update_filtering.start();
-                filter_pending = true;
-            }
+            update_filtering.start();
+            filter_pending = true;
         }
     }
 
@@ -483,6 +532,7 @@ struct UI
         {
             return;
         }
+        show_usages(path);
 
         std::string truncated_path;
         std::string prototype_type;
@@ -523,8 +573,8 @@ struct UI
 
         if (!prototype_name.empty())
         {
-            FObject &prototype_table = data.table(prototype_type);
-            FObject &prototype = prototype_table.table(prototype_name);
+            const FObject &prototype_table = data.table(prototype_type);
+            const FObject &prototype = prototype_table.table(prototype_name);
             block_editor& editor = *editors[it->first];
             layout.field_display(path_to_editor_field(truncated_path).c_str(), true);
             editor.collocate();
@@ -533,12 +583,71 @@ struct UI
         }
     }
 
+    void show_usages(std::string_view path)
+    {
+        // "data/raw/<type>/<prototype>/...", a prototype is looked up by its name and anything deeper by its string value
+        std::vector<std::string_view> keys;
+        for (size_t start = 0; start <= path.size();)
+        {
+            const size_t end = std::min(path.find('/', start), path.size());
+            keys.push_back(path.substr(start, end - start));
+            start = end + 1;
+        }
+        keys.erase(keys.begin(), keys.begin() + std::min<size_t>(2, keys.size()));
+
+        const ReferenceIndex* index = keys.size() >= 2 ? references->index() : nullptr;
+        if (keys.size() >= 2 && !index)
+        {
+            usages.clear();
+            usages.at(0).append("(still indexing)");
+            usages_pending = path;
+            update_usages.start();
+            return;
+        }
+        usages_pending.clear();
+        update_usages.stop();
+
+        ReferenceIndex::Uses found;
+        if (keys.size() == 2)
+        {
+            found = index->uses(keys[1]);
+        }
+        else if (keys.size() > 2)
+        {
+            const std::string_view key = keys.back();
+            keys.pop_back();
+            const FValue value = tree.table(keys).child(key);
+            if (const FString* str = value.as<FString>(); str)
+                found = index->uses(str->view());
+        }
+
+        auto start = prof::now();
+        usages.auto_draw(false);
+        usages.clear();
+        auto category = usages.at(0);
+        for (const ReferenceIndex::Site& site : found)
+            category.append(index->path_of(site));
+        usages.auto_draw(true);
+        auto end = prof::now();
+        fprintf(stderr, "elapsed        (usages): %" PRId64 "ms for %zu\n", int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()), found.size());
+    }
+
     void install_events()
     {
         search.events().text_changed([this](auto arg) { on_search_text_changed(arg); });
         search.events().key_press([this](auto arg) { on_search_keypress(arg); });
 
         data_raw.events().selected([this](auto arg) { on_data_selected(arg); });
+        data_raw.events().expanded([this](auto arg) { on_data_expanded(arg); });
+
+        update_filtering.interval(filter_poll_interval_ms);
+        update_filtering.elapse([this]() { poll_filtering(); });
+
+        update_usages.interval(usages_poll_interval_ms);
+        update_usages.elapse([this]() {
+            if (references->index())
+                show_usages(std::string(usages_pending));
+        });
     }
 
 
@@ -556,19 +665,89 @@ struct UI
 int main()
 {
     //Create a new VM pointing at the factorio install
-     VM vm(STR(FACTORIOPATH));
+     VM vm(STR(FACTORIOPATH), err_logger);
+    if (!vm.schedule_mods(vm.modlist))
+        return -1;
+
+    // Times every lua file of the data stage (and samples lines) when it actually runs, see LuaProfiler
+#define PROFILE_DATA_STAGE 0
+#if PROFILE_DATA_STAGE
+    LuaProfiler profiler(1000, 10);
+    vm.profiler = &profiler;
+#endif
 
-     vm.run_data_stage();
-    
     //===============================================
     // IMPORTANT:
     // This is where we convert from the lua data.raw table into an FObject* (wrapped in an FValue)
-    FValue data_raw = vm.get_data_raw();
+    // If nothing changed since the last run the snapshot already has it and lua never starts. Without the snapshot cache
+    // it's converted lazily so only what the tree and the editors actually touch gets converted
+#define USE_SNAPSHOT_CACHE 1
+    // On top of the snapshot: every browser open on the same mods maps one frozen copy of the tree and only thaws the
+    // tables it actually shows
+#define USE_FROZEN_CACHE 1
+#define LAZY_DATA_RAW 1
+    // The tree is only ever read, so identical tables can be shared (doesn't apply to lazy conversion)
+#define DEDUP_DATA_RAW 1
+    vm.dedup_data_raw = DEDUP_DATA_RAW;
+    FValue data_raw;
+    bool lazy_tree = !USE_SNAPSHOT_CACHE && LAZY_DATA_RAW;
+    //Set when data_raw is thawed from the frozen cache, what the search and reference indices get built from
+    FrozenObject frozen_root;
+#if USE_SNAPSHOT_CACHE
+    const fs::path snapshot_path = fs::temp_directory_path() / "naughty_factorio_data.snapshot";
+    const uint64_t fingerprint = Snapshot::fingerprint(vm);
+#if USE_FROZEN_CACHE
+    const fs::path frozen_path = fs::temp_directory_path() / "naughty_factorio_data.frozen";
+    FrozenTree frozen = FrozenTree::map(frozen_path, *err_logger);
+    FrozenLoader frozen_loader(frozen, vm.data_arena, vm.data_strings);
+    if (!frozen.empty() && frozen.fingerprint() == fingerprint)
+    {
+        data_raw = frozen_loader.root();
+        frozen_root = frozen.root();
+        lazy_tree = true;
+    }
+#endif
+    if (!data_raw)
+    {
+        if (FObject* snapshot = Snapshot::load(snapshot_path, fingerprint, vm.data_arena, vm.data_strings, *err_logger); snapshot)
+        {
+            data_raw = snapshot;
+        }
+        else
+        {
+            // The snapshot needs the whole tree anyway, so convert it eagerly on every core
+            vm.run_data_stage();
+            FObject* converted = vm.get_data_raw(0);
+            Snapshot::save(snapshot_path, fingerprint, *converted, *err_logger);
+            data_raw = converted;
+        }
+#if USE_FROZEN_CACHE
+        // Replaced by rename, so browsers that still have the old one mapped keep working
+        FrozenTree::freeze(data_raw.obj(), fingerprint).save(frozen_path, *err_logger);
+#endif
+    }
+#else
+    vm.run_data_stage();
+#if LAZY_DATA_RAW
+    data_raw = vm.get_data_raw_lazy();
+#else
+    data_raw = vm.get_data_raw(0);
+#endif
+#endif
+#if PROFILE_DATA_STAGE
+    if (!profiler.spans.empty())
+        profiler.write_trace(fs::temp_directory_path() / "naughty_factorio_trace.json");
+    if (vm.L)
+        profiler.detach(vm.L);
+    vm.profiler = nullptr;
+#endif
     //===============================================
 
-    FObject& obj = data_raw.obj();
+    const FObject& obj = data_raw.obj();
 
-    UI ui(data_raw.obj());
+    // Lazily converted (or thawed) tables can only be filled in on this thread. A thawed tree's indices come from its
+    // frozen copy instead, a lazily converted one has to have them built here
+    UI ui(data_raw.obj(), !lazy_tree, frozen_root);
 
     //prototype_factories["data/raw/item"] = [&](const std::vector<std::string> &path) {
     //    if (path.size() < 4)
@@ -608,7 +787,8 @@ int main()
 
 
     //    preview_image.close();
-    //    preview_image.open(proto.icon.file_path);
+    //    if (proto.icon.data)
+    //        preview_image.open(proto.icon.data->data(), proto.icon.data->size());
     //    item_group.icon("icon", preview_image);
 
     //    item_group.normal("fuel_acceleration_multiplier", proto.fuel_acceleration_multiplier);
@@ -629,7 +809,7 @@ int main()
         builder.section("PrototypeBase", [](section_layout_builder& section) {
             section.add_row<factorio::data::string, base>(&base::name, "name");
         });
-    }, [](block_editor& ui, FObject& table) {
+    }, [](block_editor& ui, const FObject& table) {
     });
 
     ui.register_editor("data/raw/accumulator", [](editor_builder& builder) {
@@ -637,7 +817,7 @@ int main()
         builder.section("PrototypeBase", [](section_layout_builder& section) {
             section.add_row<factorio::data::string, base>(&base::name, "name");
         });
-    }, [](block_editor& ui, FObject& table) {
+    }, [](block_editor& ui, const FObject& table) {
     });
 
         //base.group->caption("TileEffectPrototype");
@@ -665,7 +845,7 @@ int main()
         builder.section("TileEffectPrototype", [](section_layout_builder& section) {
             section.add_row<double, proto>(&proto::animation_speed, "animation_speed");
         });
-    }, [](block_editor& ui, FObject& table) {
+    }, [](block_editor& ui, const FObject& table) {
         factorio::data::TileEffectPrototype proto(table);
         ui.bind(&proto);
     });
@@ -673,54 +853,8 @@ int main()
     //This has to be done after we register the prototpe factories so the ui can generate a selection layout to switch between them
     ui.create_layout();
 
-    // Populate the data_raw tree
-    auto root_unfiltered = ui.data_raw.insert("raw", "data.raw");
-
-    FKeyValue raw("data.raw", data_raw);
-
-    std::deque<nana::treebox::item_proxy> visual_stack;
-    visual_stack.push_front(root_unfiltered);
-
-    std::string path = "data/raw";
-
-    ui.data_raw.auto_draw(false);
-    raw.table().visit([&](int dir, FKeyValue entry)
-    {
-        FObject::visit_result mode = FObject::visit_result::DESCEND;
-
-        nana::treebox::item_proxy node;
-        std::string local_path = path + "/" + entry.key;
-        if (dir >= 0)
-        {
-            std::string label;
-            if (dir == 0)
-                label = fmt::format("{0}: {1}", entry.key, entry.value.to_string());
-            else
-                label = entry.key;
-
-            node = ui.data_raw.insert(visual_stack.front(), local_path, label);
-        }
-        if (dir > 0)
-        {
-            if (visual_stack.size() > 1)
-            {
-                mode = FObject::visit_result::CONTINUE;
-            }
-            else
-            {
-                path = local_path;
-                visual_stack.push_front(node);
-            }
-        }
-        else if (dir < 0)
-        {
-            path.resize(path.rfind('/'), 0);
-            visual_stack.pop_front();
-        }
-
-        return mode;
-    });
-    ui.data_raw.auto_draw(false);
+    // Only the prototype types to start with, the rest gets added as it is expanded
+    ui.populate();
 
     ui.win.show();
 
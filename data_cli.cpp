@@ -0,0 +1,366 @@
+//Headless counterpart of the browser: runs the data stage of a game dir and streams data.raw out, see usage()
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+#include "vm.hpp"
+#include "fobject.hpp"
+#include "fork_server.hpp"
+#include "lua_profiler.hpp"
+#include "data_writer.hpp"
+#include "reference_index.hpp"
+#include "production_graph.hpp"
+
+#include "spdlog/sinks/stdout_color_sinks.h"
+
+static void usage(const char* self)
+{
+    fprintf(stderr,
+        "usage: %s <game dir> [options]\n"
+        "  -o, --output FILE       write data.raw to FILE instead of stdout\n"
+        "  -f, --format FORMAT     json (default), lua or binary\n"
+        "  -m, --mods A,B,...      only load these mods (core and base always load), default is every mod found\n"
+        "  -v, --variant NAME=A,B  build data.raw for this mod set too, repeatable. Variants share the common part of the\n"
+        "                          data stage and are written to FILE with .NAME before its extension, needs --output\n"
+        "  -u, --uses NAME         list where the string NAME is used in data.raw instead of writing data.raw, repeatable\n"
+        "      --raw-cost          list the raw resource cost of every item and fluid instead of writing data.raw\n"
+        "      --expensive         cost expensive mode recipes instead of normal ones\n"
+        "      --dedup             share identical tables while converting, same output with less memory\n"
+        "  -t, --threads N         threads for mod discovery and conversion, 0 (default) is one per hardware thread\n"
+        "      --profile FILE      write a chrome trace of the data stage to FILE and a summary to stderr\n"
+        "      --lualib DIR        where serpent.lua and bootstrap.lua are, default is next to this executable\n",
+        self);
+}
+
+static std::vector<std::string> split(const std::string& list, char separator)
+{
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (start <= list.size())
+    {
+        size_t end = list.find(separator, start);
+        if (end == std::string::npos)
+            end = list.size();
+        if (end > start)
+            parts.push_back(list.substr(start, end - start));
+        start = end + 1;
+    }
+    return parts;
+}
+
+static bool write_data_raw(const FObject& root, DataWriter::Format format, const fs::path& output)
+{
+    FILE* out = stdout;
+    if (!output.empty())
+    {
+        out = fopen(output.string().c_str(), "wb");
+        if (!out)
+        {
+            fprintf(stderr, "can't open %s for writing\n", output.string().c_str());
+            return false;
+        }
+    }
+
+    prof p;
+    p.start();
+    const bool written = DataWriter::write(root, format, out);
+    p.stop();
+    if (out != stdout)
+        fclose(out);
+    if (!written)
+    {
+        fprintf(stderr, "writing %s failed\n", output.empty() ? "stdout" : output.string().c_str());
+        return false;
+    }
+    p.print("write data.raw");
+    return true;
+}
+
+//One "NAME: N uses" line per name, then the sites it's used at
+static bool write_uses(const FObject& root, const std::vector<std::string>& names, unsigned threads, const fs::path& output)
+{
+    ReferenceIndex references;
+    references.build(root, threads);
+
+    FILE* out = stdout;
+    if (!output.empty())
+    {
+        out = fopen(output.string().c_str(), "wb");
+        if (!out)
+        {
+            fprintf(stderr, "can't open %s for writing\n", output.string().c_str());
+            return false;
+        }
+    }
+
+    for (const std::string& name : names)
+    {
+        prof lookup;
+        lookup.start();
+        const ReferenceIndex::Uses uses = references.uses(name);
+        lookup.stop();
+        fprintf(stderr, "uses of %s: %zu in %.3fms\n", name.c_str(), uses.size(), std::chrono::duration<double, std::milli>(lookup.elapsed()).count());
+
+        fprintf(out, "%s: %zu uses\n", name.c_str(), uses.size());
+        for (const ReferenceIndex::Site& site : uses)
+            fprintf(out, "  %s\n", references.path_of(site).c_str());
+    }
+    if (out != stdout)
+        fclose(out);
+    return true;
+}
+
+//One line per item or fluid: "item/electronic-circuit via electronic-circuit: 1 item/iron-ore, 1.5 item/copper-ore"
+static bool write_raw_cost(const FObject& root, ProductionGraph::Difficulty difficulty, unsigned threads, const fs::path& output)
+{
+    ProductionGraph graph;
+    graph.build(root, difficulty);
+    RawCost cost;
+    cost.compute(graph, threads);
+
+    FILE* out = stdout;
+    if (!output.empty())
+    {
+        out = fopen(output.string().c_str(), "wb");
+        if (!out)
+        {
+            fprintf(stderr, "can't open %s for writing\n", output.string().c_str());
+            return false;
+        }
+    }
+
+    std::string line;
+    for (uint32_t node = 0; node < graph.nodes.size(); node++)
+    {
+        line = graph.node_name(node);
+        if (cost.recipe[node] == RawCost::raw)
+        {
+            line += ": raw\n";
+            fputs(line.c_str(), out);
+            continue;
+        }
+        line += fmt::format(" via {0}:", graph.recipes[cost.recipe[node]].name.view());
+        bool first = true;
+        for (const ProductionGraph::Amount& term : cost.of(node))
+        {
+            line += fmt::format("{0} {1:g} {2}", first ? "" : ",", term.amount, graph.node_name(term.node));
+            first = false;
+        }
+        line += '\n';
+        fputs(line.c_str(), out);
+    }
+    if (out != stdout)
+        fclose(out);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    fs::path game_dir;
+    fs::path output;
+    fs::path profile;
+    fs::path lualib;
+    DataWriter::Format format = DataWriter::Format::json;
+    bool all_mods = true;
+    std::vector<std::string> mods;
+    std::vector<ForkServer::Variant> variants;
+    std::vector<std::string> uses;
+    bool raw_cost = false;
+    ProductionGraph::Difficulty difficulty = ProductionGraph::Difficulty::normal;
+    unsigned threads = 0;
+    bool dedup = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "%s needs a value\n", arg.c_str());
+                exit(2);
+            }
+            return argv[++i];
+        };
+
+        if (arg == "-h" || arg == "--help")
+        {
+            usage(argv[0]);
+            return 0;
+        }
+        else if (arg == "-o" || arg == "--output")
+            output = value();
+        else if (arg == "-f" || arg == "--format")
+        {
+            const char* name = value();
+            if (!DataWriter::parse_format(name, format))
+            {
+                fprintf(stderr, "unknown format %s\n", name);
+                return 2;
+            }
+        }
+        else if (arg == "-m" || arg == "--mods")
+        {
+            all_mods = false;
+            mods = split(value(), ',');
+        }
+        else if (arg == "-v" || arg == "--variant")
+        {
+            const std::string variant = value();
+            const size_t equals = variant.find('=');
+            if (equals == std::string::npos || equals == 0)
+            {
+                fprintf(stderr, "variant %s isn't NAME=A,B,...\n", variant.c_str());
+                return 2;
+            }
+            variants.push_back({ variant.substr(0, equals), split(variant.substr(equals + 1), ',') });
+        }
+        else if (arg == "-u" || arg == "--uses")
+            uses.push_back(value());
+        else if (arg == "--raw-cost")
+            raw_cost = true;
+        else if (arg == "--expensive")
+            difficulty = ProductionGraph::Difficulty::expensive;
+        else if (arg == "-t" || arg == "--threads")
+        {
+            const char* number = value();
+            char* end = nullptr;
+            const unsigned long parsed = strtoul(number, &end, 10);
+            if (end == number || *end != '\0' || number[0] == '-')
+            {
+                fprintf(stderr, "%s needs a number, got %s\n", arg.c_str(), number);
+                usage(argv[0]);
+                return 2;
+            }
+            threads = unsigned(parsed);
+        }
+        else if (arg == "--dedup")
+            dedup = true;
+        else if (arg == "--profile")
+            profile = value();
+        else if (arg == "--lualib")
+            lualib = value();
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            usage(argv[0]);
+            return 2;
+        }
+        else if (game_dir.empty())
+            game_dir = arg;
+        else
+        {
+            fprintf(stderr, "only one game dir, got %s and %s\n", game_dir.string().c_str(), arg.c_str());
+            return 2;
+        }
+    }
+
+    if (game_dir.empty())
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!variants.empty() && output.empty())
+    {
+        fprintf(stderr, "--variant needs --output\n");
+        return 2;
+    }
+    if (!variants.empty() && (!uses.empty() || raw_cost))
+    {
+        fprintf(stderr, "--uses and --raw-cost only work on a single data.raw, not with --variant\n");
+        return 2;
+    }
+    if (!uses.empty() && raw_cost)
+    {
+        fprintf(stderr, "--uses and --raw-cost both replace data.raw in the output, pick one\n");
+        return 2;
+    }
+
+    // Installed next to the executable by the build, fall back on the working dir like the browser does
+    if (lualib.empty())
+    {
+        std::error_code ec;
+        const fs::path self_dir = fs::weakly_canonical(fs::absolute(argv[0]), ec).parent_path();
+        if (!ec && fs::exists(self_dir / "serpent.lua"))
+            lualib = self_dir;
+    }
+
+    // stdout carries the data, everything else goes to stderr
+    auto logger = std::make_shared<spdlog::logger>(game_dir.filename().string(), std::make_shared<spdlog::sinks::stderr_color_sink_mt>());
+    VM vm(game_dir, logger, lualib, threads);
+    vm.dedup_data_raw = dedup;
+
+    if (!variants.empty())
+    {
+        Arena arena;
+        StringPool strings;
+        prof p;
+        p.start();
+        std::vector<ForkServer::Result> results = ForkServer::run(vm, variants, arena, strings, threads);
+        p.stop();
+        p.print("variants");
+
+        int failed = 0;
+        for (const ForkServer::Result& result : results)
+        {
+            if (!result.root)
+            {
+                fprintf(stderr, "variant %s failed: %s\n", result.name.c_str(), result.error.c_str());
+                failed++;
+                continue;
+            }
+            fs::path file = output;
+            file.replace_filename(output.stem().string() + "." + result.name +
+                                  (output.has_extension() ? output.extension().string() : DataWriter::extension(format)));
+            if (!write_data_raw(*result.root, format, file))
+                failed++;
+        }
+        return failed ? 1 : 0;
+    }
+
+    std::vector<Mod*> active;
+    if (all_mods)
+    {
+        active = vm.modlist;
+    }
+    else
+    {
+        for (const std::string& name : mods)
+        {
+            auto it = vm.mod_name_to_mod.find(name);
+            if (it == vm.mod_name_to_mod.end() || !it->second)
+            {
+                fprintf(stderr, "unknown mod %s\n", name.c_str());
+                return 1;
+            }
+            if (name != "core")
+                active.push_back(it->second);
+        }
+    }
+    if (!vm.schedule_mods(active))
+        return 1;
+
+    LuaProfiler profiler(1000, 10);
+    if (!profile.empty())
+        vm.profiler = &profiler;
+
+    vm.run_data_stage(threads);
+    FObject* data_raw = vm.get_data_raw(threads);
+
+    if (!profile.empty())
+    {
+        if (vm.L)
+            profiler.detach(vm.L);
+        vm.profiler = nullptr;
+        if (!profiler.write_trace(profile))
+            fprintf(stderr, "can't write %s\n", profile.string().c_str());
+        fprintf(stderr, "%s", profiler.summary().c_str());
+    }
+
+    if (!uses.empty())
+        return write_uses(*data_raw, uses, threads, output) ? 0 : 1;
+    if (raw_cost)
+        return write_raw_cost(*data_raw, difficulty, threads, output) ? 0 : 1;
+    return write_data_raw(*data_raw, format, output) ? 0 : 1;
+}
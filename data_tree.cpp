@@ -0,0 +1,20 @@
+#include "data_tree.hpp"
+
+std::string DataTree::label(const FKeyValue& entry)
+{
+    if (entry.value.as<FObject*>())
+        return entry.key.get();
+    return fmt::format("{0}: {1}", entry.key.view(), entry.value.to_string());
+}
+
+const FObject& DataTree::table(const std::vector<std::string_view>& keys) const
+{
+    const FObject* at = &root;
+    for (std::string_view key : keys)
+    {
+        at = &at->table(key);
+        if (!*at)
+            break;
+    }
+    return *at;
+}
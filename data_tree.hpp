@@ -0,0 +1,67 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "fobject.hpp"
+#include "search_index.hpp"
+
+//What the data.raw tree view shows, worked out from the FObject tree when a node is expanded instead of being built up
+//front. A view only holds items for expanded nodes: expanding a table asks for its rows, collapsing it drops them again,
+//so the items (and their keys and labels) that exist are the ones that can be on screen.
+//
+//Filtering applies to the top filter_depth levels (prototype types and names), which are the SearchIndex's documents: a
+//row shows the way the latest query's result says, and types with only some prototypes matching get expanded by the view.
+struct DataTree
+{
+    //Levels below the root the filter applies to, deeper rows are always shown
+    static constexpr size_t filter_depth = 2;
+
+    struct Row
+    {
+        const FKeyValue& entry;
+        //Path of the row, the root path and every key down to entry's joined by '/'
+        std::string_view path;
+        //A table, shown with an expander
+        bool expandable;
+        //Only some of what's under it matches the filter, the view should expand it
+        bool expand;
+    };
+
+    const FObject& root;
+    //Everything shows until both are set
+    const SearchIndex* index = nullptr;
+    const SearchIndex::Result* filter = nullptr;
+
+    DataTree(const FObject& root, std::string_view root_path = "data/raw") : root(root), walker(root_path) {}
+
+    //Calls callback(const Row&) for every row under table, which is depth levels below the root and has path. The row and
+    //its path only live for the call, and the callback can't ask for rows itself: expand rows once this returns.
+    template<typename T>
+    void rows(const FObject& table, std::string_view path, size_t depth, T callback)
+    {
+        const bool filtered = index && filter && !filter->all && depth < filter_depth;
+        walker.path.reset(path);
+        walker.walk(table, [&](int dir, const FKeyValue& entry, const FPath& row_path) {
+            bool expand = false;
+            if (filtered)
+            {
+                const SearchIndex::Result::visibility shown = filter->of(index->find(row_path.view()));
+                if (shown == SearchIndex::Result::hidden)
+                    return FObject::visit_result::CONTINUE;
+                expand = shown == SearchIndex::Result::opened;
+            }
+            callback(Row{ entry, row_path.view(), dir > 0, expand });
+            return FObject::visit_result::CONTINUE;
+        }, 1);
+    }
+
+    //"key" for a table, "key: value" for anything else
+    static std::string label(const FKeyValue& entry);
+
+    //The table keys leads to from the root, nil if any of them isn't there (anymore)
+    const FObject& table(const std::vector<std::string_view>& keys) const;
+
+private:
+    FWalker walker;
+};
@@ -0,0 +1,395 @@
+#include "data_writer.hpp"
+
+#include <cmath>
+#include <cstring>
+
+#include <bytell_hash_map.hpp>
+
+static bool is_integer_key(std::string_view key)
+{
+    if (key.empty() || key.size() > 18)
+        return false;
+    size_t start = key[0] == '-' ? 1 : 0;
+    if (start == key.size() || (key[start] == '0' && key.size() > start + 1))
+        return false;
+    for (size_t i = start; i < key.size(); i++)
+        if (key[i] < '0' || key[i] > '9')
+            return false;
+    return true;
+}
+
+static void write_number(OutputBuffer& out, double value)
+{
+    char buffer[32];
+    auto result = fmt::format_to_n(buffer, sizeof(buffer), "{}", value);
+    out.write(buffer, result.size);
+}
+
+static void write_number(OutputBuffer& out, uint64_t value)
+{
+    // Integral lua numbers are stored as their int64 bit pattern
+    char buffer[24];
+    auto result = fmt::format_to_n(buffer, sizeof(buffer), "{}", int64_t(value));
+    out.write(buffer, result.size);
+}
+
+static void indent(OutputBuffer& out, int depth)
+{
+    out.put('\n');
+    for (int i = 0; i < depth; i++)
+        out.write("  ", 2);
+}
+
+
+struct JsonWriter
+{
+    OutputBuffer& out;
+
+    void string(std::string_view text)
+    {
+        static const char hex[] = "0123456789abcdef";
+        out.put('"');
+        size_t plain = 0;
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            const uint8_t c = uint8_t(text[i]);
+            if (c >= 0x20 && c != '"' && c != '\\')
+                continue;
+            out.write(text.data() + plain, i - plain);
+            plain = i + 1;
+            switch (c)
+            {
+                case '"': out.write("\\\"", 2); break;
+                case '\\': out.write("\\\\", 2); break;
+                case '\n': out.write("\\n", 2); break;
+                case '\r': out.write("\\r", 2); break;
+                case '\t': out.write("\\t", 2); break;
+                default:
+                {
+                    const char escape[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+                    out.write(escape, 6);
+                }
+            }
+        }
+        out.write(text.data() + plain, text.size() - plain);
+        out.put('"');
+    }
+
+    void value(const FValue& value, int depth)
+    {
+        std::visit(overloaded{
+            [&](std::monostate) { out.write("null"); },
+            [&](bool arg) { out.write(arg ? "true" : "false"); },
+            [&](uint64_t arg) { write_number(out, arg); },
+            [&](double arg) {
+                // JSON has no inf or NaN, 1e999 reads back as inf everywhere that matters
+                if (std::isnan(arg))
+                    out.write("null");
+                else if (std::isinf(arg))
+                    out.write(arg > 0 ? "1e999" : "-1e999");
+                else
+                    write_number(out, arg);
+            },
+            [&](FString arg) { string(arg.view()); },
+            [&](FObject*) { table(value.obj(), depth); },
+        }, value.data);
+    }
+
+    void table(const FObject& obj, int depth)
+    {
+        obj.materialize();
+        if (obj.size() == 0)
+        {
+            out.write("{}");
+            return;
+        }
+
+        bool first = true;
+        if (obj.children.empty())
+        {
+            out.put('[');
+            for (size_t i = 0; i < obj.array.size(); i++)
+            {
+                if (!first)
+                    out.put(',');
+                first = false;
+                indent(out, depth + 1);
+                value(obj.array[i], depth + 1);
+            }
+            indent(out, depth);
+            out.put(']');
+            return;
+        }
+
+        // A table with both parts is an object, the array part keyed "1".."n" ahead of the other keys
+        out.put('{');
+        for (size_t i = 0; i < obj.array.size(); i++)
+        {
+            if (!first)
+                out.put(',');
+            first = false;
+            indent(out, depth + 1);
+            string(FObject::index_key(i + 1).view());
+            out.write(": ", 2);
+            value(obj.array[i], depth + 1);
+        }
+        for (const FKeyValue& kv : obj.children)
+        {
+            if (!first)
+                out.put(',');
+            first = false;
+            indent(out, depth + 1);
+            string(kv.key.view());
+            out.write(": ", 2);
+            value(kv.value, depth + 1);
+        }
+        indent(out, depth);
+        out.put('}');
+    }
+};
+
+
+//Same layout serpent.block uses, so the output loads back with `return <file>` or serpent.load
+struct LuaWriter
+{
+    OutputBuffer& out;
+
+    static bool is_identifier(std::string_view key)
+    {
+        static const char* const keywords[] = {
+            "and", "break", "do", "else", "elseif", "end", "false", "for", "function", "goto", "if", "in",
+            "local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while",
+        };
+        if (key.empty() || (key[0] >= '0' && key[0] <= '9'))
+            return false;
+        for (char c : key)
+            if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')))
+                return false;
+        for (const char* keyword : keywords)
+            if (key == keyword)
+                return false;
+        return true;
+    }
+
+    void string(std::string_view text)
+    {
+        out.put('"');
+        size_t plain = 0;
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            const uint8_t c = uint8_t(text[i]);
+            if (c >= 0x20 && c != '"' && c != '\\' && c != 0x7f)
+                continue;
+            out.write(text.data() + plain, i - plain);
+            plain = i + 1;
+            switch (c)
+            {
+                case '"': out.write("\\\"", 2); break;
+                case '\\': out.write("\\\\", 2); break;
+                case '\n': out.write("\\n", 2); break;
+                case '\r': out.write("\\r", 2); break;
+                case '\t': out.write("\\t", 2); break;
+                default:
+                {
+                    // Always three digits, a digit following the escape would otherwise become part of it
+                    const char escape[4] = { '\\', char('0' + c / 100), char('0' + c / 10 % 10), char('0' + c % 10) };
+                    out.write(escape, 4);
+                }
+            }
+        }
+        out.write(text.data() + plain, text.size() - plain);
+        out.put('"');
+    }
+
+    void value(const FValue& value, int depth)
+    {
+        std::visit(overloaded{
+            [&](std::monostate) { out.write("nil"); },
+            [&](bool arg) { out.write(arg ? "true" : "false"); },
+            [&](uint64_t arg) { write_number(out, arg); },
+            [&](double arg) {
+                if (std::isnan(arg))
+                    out.write("0/0");
+                else if (std::isinf(arg))
+                    out.write(arg > 0 ? "math.huge" : "-math.huge");
+                else
+                    write_number(out, arg);
+            },
+            [&](FString arg) { string(arg.view()); },
+            [&](FObject*) { table(value.obj(), depth); },
+        }, value.data);
+    }
+
+    void table(const FObject& obj, int depth)
+    {
+        obj.materialize();
+        if (obj.size() == 0)
+        {
+            out.write("{}");
+            return;
+        }
+
+        bool first = true;
+        out.put('{');
+        // Positional values first, the other keys after them like serpent puts them
+        for (size_t i = 0; i < obj.array.size(); i++)
+        {
+            if (!first)
+                out.put(',');
+            first = false;
+            indent(out, depth + 1);
+            value(obj.array[i], depth + 1);
+        }
+        for (const FKeyValue& kv : obj.children)
+        {
+            if (!first)
+                out.put(',');
+            first = false;
+            indent(out, depth + 1);
+            std::string_view key = kv.key.view();
+            if (is_identifier(key))
+            {
+                out.write(key);
+            }
+            else
+            {
+                // The converter stringifies number keys, put them back as numbers
+                out.put('[');
+                if (is_integer_key(key))
+                    out.write(key);
+                else
+                    string(key);
+                out.put(']');
+            }
+            out.write(" = ", 3);
+            value(kv.value, depth + 1);
+        }
+        indent(out, depth);
+        out.put('}');
+    }
+};
+
+
+struct BinaryWriter
+{
+    OutputBuffer& out;
+    //Strings are interned, so the pool pointer identifies a string
+    ska::bytell_hash_map<const std::string*, uint32_t> ids;
+
+    void varint(uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.put(char(uint8_t(value) | 0x80));
+            value >>= 7;
+        }
+        out.put(char(value));
+    }
+
+    void u32(uint32_t value)
+    {
+        const char bytes[4] = { char(value), char(value >> 8), char(value >> 16), char(value >> 24) };
+        out.write(bytes, 4);
+    }
+
+    void string(FString str)
+    {
+        auto [it, inserted] = ids.emplace(str.str, uint32_t(ids.size()));
+        if (!inserted)
+        {
+            out.put(char(DataWriter::tag_string_ref));
+            varint(it->second);
+            return;
+        }
+        out.put(char(DataWriter::tag_new_string));
+        varint(str.view().size());
+        out.write(str.view());
+    }
+
+    void value(const FValue& value)
+    {
+        std::visit(overloaded{
+            [&](std::monostate) { out.put(char(DataWriter::tag_nil)); },
+            [&](bool arg) { out.put(char(arg ? DataWriter::tag_true : DataWriter::tag_false)); },
+            [&](uint64_t arg) {
+                const int64_t number = int64_t(arg);
+                out.put(char(DataWriter::tag_int));
+                varint((uint64_t(number) << 1) ^ uint64_t(number >> 63));
+            },
+            [&](double arg) {
+                uint64_t bits;
+                memcpy(&bits, &arg, sizeof(bits));
+                out.put(char(DataWriter::tag_double));
+                const char bytes[8] = { char(bits), char(bits >> 8), char(bits >> 16), char(bits >> 24),
+                                        char(bits >> 32), char(bits >> 40), char(bits >> 48), char(bits >> 56) };
+                out.write(bytes, 8);
+            },
+            [&](FString arg) { string(arg); },
+            [&](FObject*) { table(value.obj()); },
+        }, value.data);
+    }
+
+    void table(const FObject& obj)
+    {
+        obj.materialize();
+        out.put(char(DataWriter::tag_table));
+        varint(obj.array.size());
+        for (size_t i = 0; i < obj.array.size(); i++)
+            value(obj.array[i]);
+        varint(obj.children.size());
+        for (const FKeyValue& kv : obj.children)
+        {
+            string(kv.key);
+            value(kv.value);
+        }
+    }
+};
+
+
+bool DataWriter::parse_format(std::string_view name, Format& out)
+{
+    if (name == "json")
+        out = Format::json;
+    else if (name == "lua")
+        out = Format::lua;
+    else if (name == "binary" || name == "bin")
+        out = Format::binary;
+    else
+        return false;
+    return true;
+}
+
+const char* DataWriter::extension(Format format)
+{
+    switch (format)
+    {
+        case Format::json: return ".json";
+        case Format::lua: return ".lua";
+        default: return ".bin";
+    }
+}
+
+bool DataWriter::write(const FObject& root, Format format, FILE* file)
+{
+    OutputBuffer out(file);
+    switch (format)
+    {
+        case Format::json:
+            JsonWriter{ out }.table(root, 0);
+            out.put('\n');
+            break;
+        case Format::lua:
+            LuaWriter{ out }.table(root, 0);
+            out.put('\n');
+            break;
+        case Format::binary:
+        {
+            BinaryWriter writer{ out };
+            writer.u32(binary_magic);
+            writer.u32(binary_version);
+            writer.table(root);
+            break;
+        }
+    }
+    return out.flush() && fflush(file) == 0;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+#include "fobject.hpp"
+
+//Streams a converted data.raw out as JSON, serpent style lua or a compact binary stream.
+//
+//Everything is written straight from the FObjects into a fixed buffer, nothing is built up per table or per value,
+//so the writer's memory doesn't depend on the size of the tree. Tables that only have an array part come out as JSON
+//arrays, lua output puts the array part first as positional values.
+//
+//The binary stream is "FDRB" and a u32 version, followed by the root table:
+//  value   = tag byte, then: table -> varint n, n x value (the array part, elements 1..n),
+//                                     varint count, count x (key string, value)
+//                            new string -> varint length, bytes (it gets the next string id, from 0)
+//                            string ref -> varint id
+//                            int -> zigzag varint, double -> 8 bytes little endian
+//                            nil, false, true -> nothing
+//  key string = a new string or string ref value
+struct DataWriter
+{
+    enum class Format { json, lua, binary };
+
+    static constexpr uint32_t binary_magic = 0x42524446; // "FDRB"
+    static constexpr uint32_t binary_version = 2;
+
+    enum binary_tag : uint8_t
+    {
+        tag_nil, tag_table, tag_new_string, tag_string_ref, tag_int, tag_double, tag_false, tag_true,
+    };
+
+    //"json", "lua" or "binary"
+    static bool parse_format(std::string_view name, Format& out);
+    static const char* extension(Format format);
+
+    //False if writing to out failed
+    static bool write(const FObject& root, Format format, FILE* out);
+};
+
+//Buffered FILE* output, flushes whenever the buffer fills up
+struct OutputBuffer
+{
+    static constexpr size_t size = 1 << 16;
+
+    FILE* file;
+    std::unique_ptr<char[]> data;
+    size_t used = 0;
+    bool failed = false;
+
+    OutputBuffer(FILE* file) : file(file), data(new char[size]) {}
+    OutputBuffer(const OutputBuffer& copy) = delete;
+    ~OutputBuffer() { flush(); }
+
+    void put(char c)
+    {
+        if (used == size)
+            flush();
+        data[used++] = c;
+    }
+
+    void write(const char* bytes, size_t count)
+    {
+        if (count > size - used)
+        {
+            flush();
+            if (count > size)
+            {
+                failed |= fwrite(bytes, 1, count, file) != count;
+                return;
+            }
+        }
+        memcpy(data.get() + used, bytes, count);
+        used += count;
+    }
+    void write(std::string_view text) { write(text.data(), text.size()); }
+
+    bool flush()
+    {
+        if (used)
+            failed |= fwrite(data.get(), 1, used, file) != used;
+        used = 0;
+        return !failed;
+    }
+};
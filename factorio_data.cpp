@@ -55,15 +55,15 @@ factorio::data::Color parse_fval(factorio::data::Color& out, const FValue& value
     out = factorio::data::Color();
     if (auto& array = value.obj(); array)
     {
-        if (auto index1 = array["1"]; index1)
+        if (array.array.size() >= 3)
         {
-            out.r = index1.to_double();
-            out.g = array.child("2").to_double();
-            out.b = array.child("3").to_double();
+            out.r = array.array.number(0);
+            out.g = array.array.number(1);
+            out.b = array.array.number(2);
 
-            if (auto index3 = array.child("3"); index3)
+            if (array.array.size() >= 4)
             {
-                out.a = index3.to_double();
+                out.a = array.array.number(3);
             }
         }
         else
@@ -87,9 +87,9 @@ factorio::data::array_opt<double, min, max> parse_fval(factorio::data::array_opt
     out.count = 0;
     if (auto& array = value.obj(); array)
     {
-        for (const auto& kv : array.children)
+        for (size_t i = 0; i < array.array.size(); i++)
         {
-            parse_fval(out.arr[out.count], kv.value);
+            parse_fval(out.arr[out.count], array.array[i]);
             out.count++;
             if (out.count > max)
                 abort(); //THROW AN ERROR YOU NINNY
@@ -16,11 +16,15 @@ struct factorio
         struct Icon
         {
             fs::path file_path;
+            //The image file itself, read from the zip for zipped mods. Null if it couldn't be read
+            std::shared_ptr<const std::vector<char>> data;
             Icon() = default;
             Icon(VM &vm, const FObject& obj)
             {
-                std::string path = *obj.child("icon").as<std::string>();
+                const FValue icon = obj.child("icon");
+                std::string path = *icon.as<std::string>();
                 file_path = vm.resolve_mod_path(path);
+                data = vm.read_mod_file(path);
             }
         };
 
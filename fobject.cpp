@@ -1,20 +1,89 @@
 #include "fobject.hpp"
 
-FValue FValue::nil;
+#include <string>
+#include <vector>
 
-FObject FObject::nil(false);
+const FValue FValue::nil;
+
+const FObject FObject::nil(false);
 
 const FObject& FValue::obj() const {
     const FObject*const* obj = as<FObject*>();
     if (obj)
+    {
+        (*obj)->materialize();
         return **obj;
+    }
     else
         return FObject::nil;
 }
 
 
-FObject &FValue::obj()
+
+static StringPool index_keys;
+
+FString FObject::index_key(size_t index)
+{
+    return index_key(index, index_keys);
+}
+
+FString FObject::index_key(size_t index, StringPool& pool)
+{
+    static const std::vector<FString> keys = [] {
+        std::vector<FString> keys(4096);
+        for (size_t i = 0; i < keys.size(); i++)
+            keys[i] = FString::intern(index_keys, std::to_string(i));
+        return keys;
+    }();
+    return index < keys.size() ? keys[index] : FString::intern(pool, std::to_string(index));
+}
+
+FArray::Kind FArray::kind_of(const FValue* values, size_t count)
 {
-    return const_cast<FObject&>(std::as_const(*this).obj());
+    bool any_double = false;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (values[i].as<double>())
+            any_double = true;
+        else if (!values[i].as<uint64_t>())
+            return Kind::values;
+    }
+    return any_double ? Kind::doubles : Kind::ints;
 }
 
+FArray FArray::pack(const FValue* values, size_t count, Arena& arena)
+{
+    FArray out;
+    if (count == 0)
+        return out;
+
+    out.count = uint32_t(count);
+    out.kind = kind_of(values, count);
+    switch (out.kind)
+    {
+        case Kind::ints:
+        {
+            int64_t* ints = arena.make_array<int64_t>(count);
+            for (size_t i = 0; i < count; i++)
+                ints[i] = int64_t(*values[i].as<uint64_t>());
+            out.items = ints;
+            break;
+        }
+        case Kind::doubles:
+        {
+            // Integral elements are below 2^53 (see FValue::number), so they survive the trip through double
+            double* doubles = arena.make_array<double>(count);
+            for (size_t i = 0; i < count; i++)
+                doubles[i] = values[i].to_double();
+            out.items = doubles;
+            break;
+        }
+        default:
+        {
+            FValue* copy = arena.make_array<FValue>(count);
+            std::copy(values, values + count, copy);
+            out.items = copy;
+        }
+    }
+    return out;
+}
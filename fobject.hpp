@@ -1,7 +1,15 @@
 #pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <variant>
+#include <vector>
 
 #include "util.hpp"
+#include "arena.hpp"
 #include "fmt/format.h"
 
 struct FObject;
@@ -10,65 +18,109 @@ struct FObject;
 template<class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
 template<class... Ts> overloaded(Ts...)->overloaded<Ts...>; // not needed as of C++20
 
+//Handle to an interned string, used for both keys and string values so the tree itself never owns heap memory. A tree's
+//strings live in the StringPool next to its Arena (see VM::data_strings), only the index keys are shared between trees.
+struct FString
+{
+    inline static const std::string empty;
+
+    const std::string* str = &empty;
+
+    FString() = default;
+    explicit FString(const std::string* str) : str(str) {}
+
+    static FString intern(StringPool& pool, std::string_view value) { return FString(pool.intern(value)); }
+
+    const std::string& get() const { return *str; }
+    std::string_view view() const { return *str; }
+    operator const std::string& () const { return *str; }
+
+    bool operator==(const FString& other) const { return str == other.str; }
+    bool operator!=(const FString& other) const { return str != other.str; }
+    bool operator<(const FString& other) const { return *str < *other.str; }
+};
+
 struct FValue
 {
-    using data_type = std::variant<std::monostate, FObject*, std::string, uint64_t, double, bool>;
+    using data_type = std::variant<std::monostate, FObject*, FString, uint64_t, double, bool>;
 
     data_type data;
 
     FValue() : data() {}
-    FValue(const std::string& data) : data(data) {}
+    FValue(FString data) : data(data) {}
     FValue(const uint64_t data) : data(data) {}
     FValue(const double data) : data(data) {}
     FValue(const bool data) : data(data) {}
     FValue(FObject *data) : data(data) {}
 
 
+    //Strings are interned, so as<std::string>() hands out the pooled copy
     template<typename T>
-    const T* as() const { return std::get_if<T>(&data); }
+    const T* as() const
+    {
+        if constexpr (std::is_same_v<T, std::string>)
+        {
+            const FString* str = std::get_if<FString>(&data);
+            return str ? str->str : nullptr;
+        }
+        else
+        {
+            return std::get_if<T>(&data);
+        }
+    }
 
     template<typename T>
-    T* as() { return const_cast<T*>(std::as_const(*this).as<T>()); }
+    T* as()
+    {
+        static_assert(!std::is_same_v<T, std::string>, "interned strings are immutable");
+        return const_cast<T*>(std::as_const(*this).as<T>());
+    }
 
+    //Missing or non-table values give FObject::nil, which is shared and so only ever handed out const
     const FObject& obj() const;
-    FObject& obj();
 
-    std::string to_string()
+    std::string to_string() const
     {
         const static std::string nil_s = "!<>";
         const static std::string true_s = "true";
         const static std::string false_s = "false";
         const static std::string table_s = "table";
 
-        std::visit(overloaded{
+        return std::visit(overloaded{
             [](std::monostate arg) {return nil_s;  },
             [](bool arg) {return arg ? true_s : false_s;  },
             [](double arg) {return fmt::to_string(arg);  },
             [](uint64_t arg) {return fmt::to_string(arg);  },
-            [](const std::string& arg) { return arg;  },
-            [](const FObject*& arg) { return table_s;  },
+            [](FString arg) { return arg.get();  },
+            [](FObject* arg) { return table_s;  },
             }, data);
-
-        __builtin_unreachable();
-        return nil_s;
     }
 
+    //Integral numbers are stored as their int64_t bit pattern
     double to_double() const
     {
         if (auto num = as<double>(); num)
             return *num;
-        return *as<uint64_t>();
+        return double(int64_t(*as<uint64_t>()));
+    }
+
+    //Exactly representable integers are kept as uint64_t(int64_t(n)), everything else as a double
+    static bool is_integral(double n)
+    {
+        return n >= -9007199254740992.0 && n <= 9007199254740992.0 && std::floor(n) == n;
     }
-    double to_double()
+    static FValue number(double n)
     {
-        return std::as_const(*this).to_double();
+        if (is_integral(n))
+            return uint64_t(int64_t(n));
+        return n;
     }
 
     
     template<typename T>
     void try_assign(T& target) const
     {
-        if (T* val = as<T>(); val)
+        if (const T* val = as<T>(); val)
         {
             target = *val;
         }
@@ -79,93 +131,224 @@ struct FValue
           std::visit(overloaded{
             [](auto arg) {},
             [&target](double arg) { target = arg; },
-            [&target](uint64_t arg) { target = double(arg); },
+            [&target](uint64_t arg) { target = double(int64_t(arg)); },
             }, data);
     }
 
     operator bool() const { return data.index() != 0; }
 
-    static FValue nil;
+    static const FValue nil;
 };
 
 
 
 struct FKeyValue
 {
-    std::string key;
+    FString key;
     FValue value;
 
     FKeyValue() {}
-    FKeyValue(const std::string& key, const FValue&& value) : key(key), value(value) {}
-    FKeyValue(const std::string& key, const FValue& value) : key(key), value(value) {}
+    FKeyValue(FString key, const FValue& value) : key(key), value(value) {}
+
+    const FObject& table() const { return value.obj(); }
+};
+
+
+//Fixed-size view of an object's children, the storage itself belongs to whichever Arena built the tree
+struct FChildren
+{
+    FKeyValue* items = nullptr;
+    uint32_t count = 0;
+
+    FKeyValue* begin() { return items; }
+    FKeyValue* end() { return items + count; }
+    const FKeyValue* begin() const { return items; }
+    const FKeyValue* end() const { return items + count; }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    FKeyValue& operator[](size_t i) { return items[i]; }
+    const FKeyValue& operator[](size_t i) const { return items[i]; }
+
+    const FKeyValue& at(size_t i) const
+    {
+        if (i >= count)
+            throw std::out_of_range("FChildren::at");
+        return items[i];
+    }
+    FKeyValue& at(size_t i) { return const_cast<FKeyValue&>(std::as_const(*this).at(i)); }
+};
+
+
+//Dense array part of an object, lua's t[1]..t[n]. An array of nothing but integers or nothing but numbers is packed into
+//int64_t or double elements, anything else keeps full FValues. Storage belongs to the Arena that built the tree.
+struct FArray
+{
+    enum class Kind : uint8_t { values, ints, doubles, };
+
+    const void* items = nullptr;
+    uint32_t count = 0;
+    Kind kind = Kind::values;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    const FValue* values() const { return static_cast<const FValue*>(items); }
+    const int64_t* ints() const { return static_cast<const int64_t*>(items); }
+    const double* doubles() const { return static_cast<const double*>(items); }
+
+    //Element i (from 0) as an FValue, packed integers come back the way FValue stores them
+    FValue operator[](size_t i) const
+    {
+        switch (kind)
+        {
+            case Kind::ints: return FValue(uint64_t(ints()[i]));
+            // Packing turned the integers of a mixed array into doubles, this turns them back
+            case Kind::doubles: return FValue::number(doubles()[i]);
+            default: return values()[i];
+        }
+    }
+
+    //Element i as a number without going through FValue, 0 for anything that isn't one
+    double number(size_t i) const
+    {
+        switch (kind)
+        {
+            case Kind::ints: return double(ints()[i]);
+            case Kind::doubles: return doubles()[i];
+            default:
+            {
+                double out = 0;
+                values()[i].try_to_double(out);
+                return out;
+            }
+        }
+    }
+
+    //How count values would be packed
+    static Kind kind_of(const FValue* values, size_t count);
+    //Copies the values into arena, packed if they can be
+    static FArray pack(const FValue* values, size_t count, Arena& arena);
+};
+
 
-    FObject& table() { return value.obj(); }
+//Fills in a stub FObject the first time it is reached, see VM::get_data_raw_lazy
+struct FLoader
+{
+    virtual void load(FObject& stub) = 0;
 };
 
 
 struct FObject
 {
     enum class visit_result { DESCEND, CONTINUE, EXIT, };
-    static FObject nil;
-    std::string type;
+    static const FObject nil;
     bool valid;
+    //Whatever the loader needs to find the source again, for the VM a reference into its lazy_pins table. Kept next to valid
+    //so the two share a word, there is one FObject per table
+    int source_ref = 0;
+
+    //Stubs have a loader and no children yet, FValue::obj() runs the loader before handing the object out
+    mutable FLoader* loader = nullptr;
 
     FObject(bool valid = true) : valid(valid) {}
+    FObject(FLoader* loader, int source_ref) : valid(true), source_ref(source_ref), loader(loader) {}
     FObject(const FObject& copy) = delete;
 
-    std::vector<FKeyValue> children;
-    ska::bytell_hash_map<std::string, int> name_to_child;
+    //Everything but the array part, sorted by key once sort() has been called, lookups binary search on that
+    FChildren children;
+    //t[1]..t[n], integer keys that don't continue it are in children as strings
+    FArray array;
 
-    const FValue& child(const std::string& key) const {
-        if (auto it = name_to_child.find(key); it != name_to_child.end())
+    bool is_stub() const { return loader != nullptr; }
+
+    void materialize() const
+    {
+        if (FLoader* pending = loader; pending)
         {
-            return children.at(it->second).value;
+            loader = nullptr;
+            pending->load(const_cast<FObject&>(*this));
         }
-        else
+    }
+
+    size_t size() const { return array.size() + children.size(); }
+
+    //"1", "2", ... as used for the array part when a key is needed, the first few thousand are built once and shared.
+    //Past those they go into a pool of their own, which only grows with the longest array part ever walked
+    static FString index_key(size_t index);
+    //Same, but keys past the shared ones go into a tree's own pool. For keys that end up in a tree, which can be sparse
+    static FString index_key(size_t index, StringPool& pool);
+
+    //Position in the array part for a key like "12", -1 if the key isn't one
+    ptrdiff_t array_index(std::string_view key) const
+    {
+        if (array.empty() || key.empty() || key.size() > 10 || key[0] == '0')
+            return -1;
+        size_t index = 0;
+        for (char c : key)
         {
-            return FValue::nil;
+            if (c < '0' || c > '9')
+                return -1;
+            index = index * 10 + size_t(c - '0');
         }
-    }
-    FValue& child(const std::string& key) {
-        return const_cast<FValue&>(std::as_const(*this).child(key));
+        return index <= array.size() ? ptrdiff_t(index) - 1 : -1;
     }
 
-    const FValue& operator[] (const std::string& key) const { return child(key); }
-    FValue& operator[](const std::string& key) { return child(key); }
-    const FValue& operator[] (const char* key) const { return child(key); }
-    FValue& operator[](const char* key) { return child(key); }
+    //Only searches children, array elements have no FKeyValue, see child()
+    const FKeyValue* find(std::string_view key) const
+    {
+        materialize();
+        auto it = std::lower_bound(children.begin(), children.end(), key, [](const FKeyValue& kv, std::string_view key) { return kv.key.view() < key; });
+        if (it != children.end() && it->key.view() == key)
+        {
+            return it;
+        }
+        return nullptr;
+    }
 
-    FObject& table(const std::string& key) {
-        if (auto it = name_to_child.find(key); it != name_to_child.end())
+    //By value, since a packed array element only exists as an FValue while someone looks at it
+    FValue child(std::string_view key) const {
+        materialize();
+        if (ptrdiff_t index = array_index(key); index >= 0)
+        {
+            return array[size_t(index)];
+        }
+        if (const FKeyValue* kv = find(key); kv)
         {
-            return children.at(it->second).table();
+            return kv->value;
         }
         else
         {
-            return nil;
+            return FValue::nil;
         }
     }
+    FValue operator[] (const std::string& key) const { return child(key); }
+    FValue operator[] (const char* key) const { return child(key); }
+
+    const FObject& table(std::string_view key) const {
+        return child(key).obj();
+    }
+
+    static bool key_order(const FKeyValue& a, const FKeyValue& b) { return a.key < b.key; }
 
     void sort()
     {
-        std::sort(children.begin(), children.end(), [](FKeyValue& a, FKeyValue& b) { return a.key < b.key; });
-        for (size_t i = 0; i < children.size(); i++)
-        {
-            name_to_child[children[i].key] = int(i);
-        }
-
+        std::sort(children.begin(), children.end(), key_order);
     }
 
+    //Tables are only materialized if the callback asks to descend into them. The array part comes first, in index order,
+    //with index_key() keys. Recursive, see FWalker for a walk that keeps track of the path.
     template<typename T>
-    void visit(T callback)
+    void visit(T callback) const
     {
-        for (auto& key : children)
-        {
-            if (auto& object = key.value.obj(); object)
+        materialize();
+        auto visit_one = [&](const FKeyValue& key) {
+            if (key.value.as<FObject*>())
             {
                 if (callback(1, key) == FObject::visit_result::DESCEND)
                 {
-                    object.visit(callback);
+                    key.value.obj().visit(callback);
                     callback(-1, key);
                 }
             }
@@ -173,7 +356,11 @@ struct FObject
             {
                 callback(0, key);
             }
-        }
+        };
+        for (size_t i = 0; i < array.size(); i++)
+            visit_one(FKeyValue(index_key(i + 1), array[i]));
+        for (const auto& key : children)
+            visit_one(key);
     }
 
     operator bool() const {
@@ -181,3 +368,132 @@ struct FObject
     }
 
 };
+
+
+//Path of the entry a walk is at: a root, then one segment per key, joined by a separator in a single buffer. Segments are
+//pushed and popped at the end, so once the buffer has grown to the deepest path keeping it up to date allocates nothing.
+struct FPath
+{
+    std::string buffer;
+    //Where each segment starts, its separator included
+    std::vector<uint32_t> ends;
+    char separator;
+
+    FPath(std::string_view root = {}, char separator = '/') : buffer(root), separator(separator) {}
+
+    //Start over from a new root, keeping the buffers
+    void reset(std::string_view root)
+    {
+        buffer.assign(root.data(), root.size());
+        ends.clear();
+    }
+
+    void push(std::string_view segment)
+    {
+        ends.push_back(uint32_t(buffer.size()));
+        buffer += separator;
+        buffer += segment;
+    }
+    void pop()
+    {
+        buffer.resize(ends.back());
+        ends.pop_back();
+    }
+
+    std::string_view view() const { return buffer; }
+    //The last key, or the root for an empty path
+    std::string_view back() const { return ends.empty() ? view() : view().substr(ends.back() + 1); }
+    size_t depth() const { return ends.size(); }
+};
+
+
+//Iterative FObject::visit: the tables being walked are kept on an explicit stack instead of the native one, so depth is
+//only bounded by memory, and the callback also gets the path of the entry. Entries are handed out by const reference,
+//children straight out of the tree and array elements out of a slot on the stack.
+//
+//The callback is called as callback(dir, entry, path) with the same dir as visit (1 entering a table, 0 a plain value,
+//-1 leaving a table it descended into) and path ending in entry's key. Returning EXIT stops the walk right there, the
+//tables it is in don't get their -1. Tables at max_depth (the root's entries are at depth 1) are reported but never
+//descended into. A walker can be reused, after the first walk its stack and path don't allocate again.
+struct FWalker
+{
+    struct Frame
+    {
+        const FObject* obj;
+        size_t next;
+        //The entry this table was reached through, for the -1 call and for array elements to live in while visited
+        FKeyValue entry;
+        FKeyValue element;
+    };
+
+    FPath path;
+    std::vector<Frame> stack;
+
+    FWalker(std::string_view root = {}, char separator = '/') : path(root, separator) {}
+
+    //False if the callback asked to EXIT
+    template<typename T>
+    bool walk(const FObject& root, T callback, size_t max_depth = SIZE_MAX)
+    {
+        const size_t base = path.depth();
+        stack.clear();
+        root.materialize();
+        stack.push_back(Frame{ &root, 0, FKeyValue(), FKeyValue() });
+
+        while (!stack.empty())
+        {
+            Frame& top = stack.back();
+            const FObject& obj = *top.obj;
+            if (top.next == obj.size())
+            {
+                if (stack.size() > 1)
+                {
+                    callback(-1, static_cast<const FKeyValue&>(top.entry), static_cast<const FPath&>(path));
+                    path.pop();
+                }
+                stack.pop_back();
+                continue;
+            }
+
+            const size_t i = top.next++;
+            const FKeyValue* entry;
+            if (i < obj.array.size())
+            {
+                top.element = FKeyValue(FObject::index_key(i + 1), obj.array[i]);
+                entry = &top.element;
+            }
+            else
+            {
+                entry = &obj.children[i - obj.array.size()];
+            }
+
+            path.push(entry->key.view());
+            if (entry->value.as<FObject*>())
+            {
+                FObject::visit_result result = callback(1, *entry, static_cast<const FPath&>(path));
+                if (result == FObject::visit_result::DESCEND && stack.size() < max_depth)
+                {
+                    // top is about to be invalidated, the child frame takes its own copy of the entry
+                    const FKeyValue copy = *entry;
+                    const FObject& child = copy.value.obj();
+                    stack.push_back(Frame{ &child, 0, copy, FKeyValue() });
+                    continue;
+                }
+                if (result == FObject::visit_result::EXIT)
+                {
+                    while (path.depth() > base)
+                        path.pop();
+                    return false;
+                }
+            }
+            else if (callback(0, *entry, static_cast<const FPath&>(path)) == FObject::visit_result::EXIT)
+            {
+                while (path.depth() > base)
+                    path.pop();
+                return false;
+            }
+            path.pop();
+        }
+        return true;
+    }
+};
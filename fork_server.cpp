@@ -0,0 +1,421 @@
+#include "fork_server.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <thread>
+
+#include "snapshot.hpp"
+#include "vm.hpp"
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+struct variant_plan
+{
+    std::vector<Mod*> load_order;
+    std::vector<VM::data_step> steps;
+};
+
+// Registry entry of the shared mods table: { backing = {name = version}, divergent = {name = true}, strict = bool }
+static const char* shared_mods_key = "naughty_factorio.shared_mods";
+
+static int shared_mods_index(lua_State* L)
+{
+    lua_getfield(L, lua_upvalueindex(1), "strict");
+    bool strict = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (strict)
+    {
+        lua_getfield(L, lua_upvalueindex(1), "divergent");
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
+        if (lua_toboolean(L, -1))
+            return luaL_error(L, "mods[\"%s\"] differs between variants", lua_tostring(L, 2));
+        lua_pop(L, 2);
+    }
+    lua_getfield(L, lua_upvalueindex(1), "backing");
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+static int shared_mods_pairs(lua_State* L)
+{
+    lua_getfield(L, lua_upvalueindex(1), "strict");
+    if (lua_toboolean(L, -1))
+        return luaL_error(L, "mods can't be iterated while variants share the data stage");
+    lua_getglobal(L, "next");
+    lua_getfield(L, lua_upvalueindex(1), "backing");
+    lua_pushnil(L);
+    return 3;
+}
+
+// mods as every variant sees it, anything they don't agree on raises
+static void push_shared_mods(VM& vm, const std::vector<variant_plan>& plans, const std::vector<size_t>& live)
+{
+    lua_State* L = vm.L;
+
+    std::map<std::string, std::pair<ModVersion, size_t>> seen;
+    std::map<std::string, bool> divergent;
+    for (size_t i : live)
+    {
+        for (Mod* mod : plans[i].load_order)
+        {
+            if (mod->name == "core")
+                continue;
+            auto [it, inserted] = seen.emplace(mod->name, std::make_pair(mod->version, size_t(0)));
+            if (!(it->second.first == mod->version))
+                divergent[mod->name] = true;
+            it->second.second++;
+        }
+    }
+
+    lua_newtable(L); // state
+    lua_newtable(L); // backing
+    lua_newtable(L); // divergent
+    for (auto& [name, version] : seen)
+    {
+        if (version.second != live.size() || divergent.count(name))
+        {
+            lua_pushboolean(L, 1);
+            lua_setfield(L, -2, name.c_str());
+        }
+        else
+        {
+            lua_pushstring(L, version.first.to_string().c_str());
+            lua_setfield(L, -3, name.c_str());
+        }
+    }
+    lua_setfield(L, -3, "divergent");
+    lua_setfield(L, -2, "backing");
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "strict");
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, shared_mods_key);
+
+    lua_newtable(L); // the mods global
+    lua_newtable(L); // its metatable
+    lua_pushvalue(L, -3);
+    lua_pushcclosure(L, shared_mods_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushvalue(L, -3);
+    lua_pushcclosure(L, shared_mods_pairs, 1);
+    lua_setfield(L, -2, "__pairs");
+    lua_setmetatable(L, -2);
+    lua_setglobal(L, "mods");
+    lua_pop(L, 1);
+}
+
+// Scripts that kept a reference to the shared table see the variant's real mods from now on
+static void unshare_mods(VM& vm)
+{
+    lua_State* L = vm.L;
+    vm.set_mods_global();
+
+    lua_getfield(L, LUA_REGISTRYINDEX, shared_mods_key);
+    if (lua_istable(L, -1))
+    {
+        lua_getglobal(L, "mods");
+        lua_setfield(L, -2, "backing");
+        lua_pushboolean(L, 0);
+        lua_setfield(L, -2, "strict");
+    }
+    lua_pop(L, 1);
+}
+
+static bool schedule_variant(VM& vm, const ForkServer::Variant& variant, variant_plan& plan, std::string& error)
+{
+    std::vector<Mod*> active;
+    for (const std::string& name : variant.mods)
+    {
+        auto it = vm.mod_name_to_mod.find(name);
+        if (it == vm.mod_name_to_mod.end())
+        {
+            error = "unknown mod " + name;
+            return false;
+        }
+        if (name != "core")
+            active.push_back(it->second);
+    }
+
+    if (!vm.schedule_mods(active))
+    {
+        error = "mod dependencies don't resolve";
+        return false;
+    }
+
+    plan.load_order = vm.load_order;
+    plan.steps = vm.data_steps();
+    return true;
+}
+
+// Converted data.raw as snapshot bytes, so it can cross a process boundary or outlive the lua state
+static void snapshot_data_raw(VM& vm, std::vector<char>& out)
+{
+    FObject* root = vm.get_data_raw(1);
+    Snapshot::write(out, 0, *root, false);
+}
+
+static void restore(VM& vm)
+{
+    vm.close_lua();
+    vm.chunks.clear();
+    vm.schedule_mods(vm.modlist);
+}
+
+#ifdef _WIN32
+
+std::vector<ForkServer::Result> ForkServer::run(VM& vm, const std::vector<Variant>& variants, Arena& arena, StringPool& strings, unsigned)
+{
+    std::vector<Result> results(variants.size());
+    std::vector<variant_plan> plans(variants.size());
+    std::vector<size_t> live;
+    for (size_t i = 0; i < variants.size(); i++)
+    {
+        results[i].name = variants[i].name;
+        if (schedule_variant(vm, variants[i], plans[i], results[i].error))
+            live.push_back(i);
+    }
+
+    if (!live.empty())
+        vm.begin_data_stage();
+
+    for (size_t i : live)
+    {
+        prof timer;
+        timer.start();
+
+        vm.load_order = plans[i].load_order;
+        vm.start_lua();
+        for (auto& step : plans[i].steps)
+            vm.run_step(step);
+
+        std::vector<char> bytes;
+        snapshot_data_raw(vm, bytes);
+        results[i].root = Snapshot::read(bytes.data(), bytes.size(), 0, arena, strings);
+        vm.free_data_raw();
+        vm.close_lua();
+
+        results[i].elapsed = timer.stop();
+    }
+
+    restore(vm);
+    return results;
+}
+
+#else
+
+static bool write_all(int fd, const void* data, size_t size)
+{
+    const char* at = static_cast<const char*>(data);
+    while (size)
+    {
+        ssize_t written = write(fd, at, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        at += written;
+        size -= size_t(written);
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t size)
+{
+    char* at = static_cast<char*>(data);
+    while (size)
+    {
+        ssize_t got = read(fd, at, size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        at += got;
+        size -= size_t(got);
+    }
+    return true;
+}
+
+[[noreturn]] static void run_child(VM& vm, const variant_plan& plan, size_t from, int fd)
+{
+    vm.load_order = plan.load_order;
+    unshare_mods(vm);
+    for (size_t i = from; i < plan.steps.size(); i++)
+        vm.run_step(plan.steps[i]);
+
+    std::vector<char> bytes;
+    snapshot_data_raw(vm, bytes);
+    uint64_t size = bytes.size();
+    bool ok = write_all(fd, &size, sizeof(size)) && write_all(fd, bytes.data(), bytes.size());
+    close(fd);
+
+    // Nothing of the parent's may run here, no destructors or atexit handlers
+    vm.logger->flush();
+    fflush(stderr);
+    _exit(ok ? 0 : 1);
+}
+
+struct running_child
+{
+    size_t variant;
+    pid_t pid;
+    int fd;
+    prof timer;
+};
+
+static void finish_child(running_child& child, ForkServer::Result& result, Arena& arena, StringPool& strings, spdlog::logger& logger)
+{
+    uint64_t size = 0;
+    std::vector<char> bytes;
+    bool got = read_all(child.fd, &size, sizeof(size));
+    if (got)
+    {
+        bytes.resize(size_t(size));
+        got = read_all(child.fd, bytes.data(), bytes.size());
+    }
+    close(child.fd);
+
+    int status = 0;
+    while (waitpid(child.pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    result.elapsed = child.timer.stop();
+
+    if (WIFSIGNALED(status))
+        result.error = "data stage killed by signal " + std::to_string(WTERMSIG(status));
+    else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        result.error = "data stage exited with status " + std::to_string(WEXITSTATUS(status));
+    else if (!got)
+        result.error = "data stage sent a short data.raw";
+    else
+    {
+        try
+        {
+            result.root = Snapshot::read(bytes.data(), bytes.size(), 0, arena, strings);
+        }
+        catch (const std::exception& e)
+        {
+            result.error = e.what();
+        }
+    }
+
+    if (!result.error.empty())
+        logger.warn("variant {0} failed: {1}", result.name, result.error);
+}
+
+std::vector<ForkServer::Result> ForkServer::run(VM& vm, const std::vector<Variant>& variants, Arena& arena, StringPool& strings, unsigned max_children)
+{
+    prof timer;
+    timer.start();
+
+    std::vector<Result> results(variants.size());
+    std::vector<variant_plan> plans(variants.size());
+    std::vector<size_t> live;
+    for (size_t i = 0; i < variants.size(); i++)
+    {
+        results[i].name = variants[i].name;
+        if (schedule_variant(vm, variants[i], plans[i], results[i].error))
+            live.push_back(i);
+        else
+            vm.logger->warn("variant {0} failed: {1}", results[i].name, results[i].error);
+    }
+    if (live.empty())
+    {
+        restore(vm);
+        return results;
+    }
+
+    // Longest run of steps every variant starts with
+    const std::vector<VM::data_step>& first = plans[live[0]].steps;
+    size_t shared = first.size();
+    for (size_t i : live)
+    {
+        const std::vector<VM::data_step>& steps = plans[i].steps;
+        size_t common = size_t(std::mismatch(first.begin(), first.begin() + std::min(shared, steps.size()), steps.begin()).first - first.begin());
+        shared = std::min(shared, common);
+    }
+
+    // A step that asks about a mod the variants disagree on ends the shared part, the state it left behind is thrown away
+    // and the steps before it run again from a fresh lua state
+    vm.begin_data_stage();
+    for (;;)
+    {
+        push_shared_mods(vm, plans, live);
+        size_t ran = 0;
+        std::string error;
+        while (ran < shared && vm.run_step(first[ran], &error))
+            ran++;
+        if (ran == shared)
+            break;
+
+        vm.logger->info("shared data stage stops before {0}/{1}: {2}", first[ran].mod->name, VM::data_stages[first[ran].stage], error);
+        shared = ran;
+        vm.close_lua();
+        vm.start_lua();
+    }
+    vm.logger->info("fork server: {0} shared steps, {1} variants", shared, live.size());
+
+    if (max_children == 0)
+        max_children = std::max(1u, std::thread::hardware_concurrency());
+
+    std::deque<running_child> running;
+    for (size_t i : live)
+    {
+        if (running.size() >= max_children)
+        {
+            finish_child(running.front(), results[running.front().variant], arena, strings, *vm.logger);
+            running.pop_front();
+        }
+
+        int fds[2];
+        if (pipe(fds) != 0)
+        {
+            results[i].error = std::string("pipe failed: ") + strerror(errno);
+            continue;
+        }
+
+        // Anything still buffered would be written once more by the child
+        vm.logger->flush();
+        fflush(stdout);
+        fflush(stderr);
+
+        running_child child{ i, -1, fds[0], {} };
+        child.timer.start();
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(fds[0]);
+            for (auto& other : running)
+                close(other.fd);
+            run_child(vm, plans[i], shared, fds[1]);
+        }
+        close(fds[1]);
+        if (pid < 0)
+        {
+            close(fds[0]);
+            results[i].error = std::string("fork failed: ") + strerror(errno);
+            continue;
+        }
+        child.pid = pid;
+        running.push_back(child);
+    }
+    while (!running.empty())
+    {
+        finish_child(running.front(), results[running.front().variant], arena, strings, *vm.logger);
+        running.pop_front();
+    }
+
+    restore(vm);
+
+    timer.stop();
+    timer.print(*vm.logger, "fork server");
+    return results;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#pragma once
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "arena.hpp"
+#include "fobject.hpp"
+
+struct VM;
+
+//Builds data.raw for several mod sets of the same game dir at once.
+//
+//Every variant's data stage starts the same way (lualib, core, base and whatever mods all of them load first), so that
+//part runs once in this process, then one child per variant is forked from there to run the rest of its own steps. The
+//child converts its data.raw and sends it back through a pipe as a snapshot (see Snapshot::write), which the parent
+//reads into the caller's arena. Children never share anything, a variant that crashes lua only loses its own result.
+//
+//While the shared part runs, mods is a stand-in that only answers for mods every variant agrees on. A script asking
+//about any other mod stops the shared part right before its step, so each variant still sees its own mods table.
+//
+//Without fork (windows) the variants run one after another, each from a fresh lua state. Only the calling thread exists
+//in a forked child, so don't run this while other threads use VMs.
+struct ForkServer
+{
+    struct Variant
+    {
+        std::string name;
+        //Mod names, core and base are always loaded
+        std::vector<std::string> mods;
+    };
+
+    struct Result
+    {
+        std::string name;
+        //nullptr when the variant failed, see error
+        FObject* root = nullptr;
+        std::string error;
+        std::chrono::steady_clock::duration elapsed{};
+    };
+
+    //Results are in the order of variants and live in arena and strings. max_children 0 means one per hardware thread.
+    //vm has to be freshly constructed, its lua state is closed again when this returns.
+    static std::vector<Result> run(VM& vm, const std::vector<Variant>& variants, Arena& arena, StringPool& strings, unsigned max_children = 0);
+};
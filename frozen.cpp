@@ -0,0 +1,495 @@
+#include "frozen.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(FrozenTree::Header) == 48, "frozen header is on disk");
+static_assert(sizeof(FrozenTree::Entry) == 24, "frozen entries are on disk");
+static_assert(sizeof(FrozenTree::Object) == 8, "frozen objects are on disk");
+
+static size_t align8(size_t offset)
+{
+    return (offset + 7) & ~size_t(7);
+}
+
+// Keys that could have come from an array part, what index_key() makes: "1", "12", ... and never "01"
+static bool index_of(std::string_view key, size_t& index)
+{
+    if (key.empty() || key.size() > 10 || key[0] == '0')
+        return false;
+    index = 0;
+    for (char c : key)
+    {
+        if (c < '0' || c > '9')
+            return false;
+        index = index * 10 + size_t(c - '0');
+    }
+    return true;
+}
+
+struct freezer
+{
+    std::vector<char> out;
+    std::vector<char> strings;
+    ska::bytell_hash_map<const std::string*, FrozenTree::Str> string_offsets;
+
+    FrozenTree::Str put_string(FString str)
+    {
+        if (auto it = string_offsets.find(str.str); it != string_offsets.end())
+            return it->second;
+
+        FrozenTree::Str placed{ uint32_t(strings.size()), uint32_t(str.get().size()) };
+        strings.insert(strings.end(), str.get().begin(), str.get().end());
+        string_offsets.emplace(str.str, placed);
+        return placed;
+    }
+
+    uint64_t put_object(const FObject& obj)
+    {
+        // The frozen layout has no array part, elements become "1".."n" entries merged in with the children
+        std::vector<FKeyValue> merged;
+        const FKeyValue* items = obj.children.begin();
+        if (!obj.array.empty())
+        {
+            merged.reserve(obj.size());
+            for (size_t i = 0; i < obj.array.size(); i++)
+                merged.push_back(FKeyValue{ FObject::index_key(i + 1), obj.array[i] });
+            merged.insert(merged.end(), obj.children.begin(), obj.children.end());
+            std::sort(merged.begin(), merged.end(), FObject::key_order);
+            items = merged.data();
+        }
+
+        // Reserve the whole entry array first, children land after it and get patched in by offset since out may grow
+        size_t at = align8(out.size());
+        uint32_t count = uint32_t(obj.size());
+        out.resize(at + sizeof(FrozenTree::Object) + count * sizeof(FrozenTree::Entry));
+
+        FrozenTree::Object header{ count, 0 };
+        memcpy(out.data() + at, &header, sizeof(header));
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            const FKeyValue& kv = items[i];
+
+            FrozenTree::Entry entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.key = put_string(kv.key);
+
+            std::visit(overloaded{
+                [&](std::monostate) { entry.tag = FrozenTree::Tag::nil; },
+                [&](bool value) { entry.tag = FrozenTree::Tag::boolean; entry.boolean = value; },
+                [&](uint64_t value) { entry.tag = FrozenTree::Tag::uint; entry.uint = value; },
+                [&](double value) { entry.tag = FrozenTree::Tag::number; entry.number = value; },
+                [&](FString value) { entry.tag = FrozenTree::Tag::string; entry.string = put_string(value); },
+                [&](FObject*) { entry.tag = FrozenTree::Tag::table; entry.table = put_object(kv.value.obj()); },
+            }, kv.value.data);
+
+            memcpy(out.data() + at + sizeof(FrozenTree::Object) + i * sizeof(FrozenTree::Entry), &entry, sizeof(entry));
+        }
+
+        return at;
+    }
+};
+
+FrozenTree FrozenTree::freeze(const FObject& root, uint64_t fingerprint)
+{
+    prof timer;
+    timer.start();
+
+    freezer f;
+    f.out.resize(sizeof(Header));
+
+    Header header{};
+    header.magic = magic;
+    header.version = version;
+    header.fingerprint = fingerprint;
+    header.root = f.put_object(root);
+    header.strings = align8(f.out.size());
+    header.strings_size = f.strings.size();
+
+    f.out.resize(header.strings);
+    f.out.insert(f.out.end(), f.strings.begin(), f.strings.end());
+    header.size = f.out.size();
+    memcpy(f.out.data(), &header, sizeof(header));
+
+    FrozenTree tree;
+    tree.owned = std::move(f.out);
+    tree.base = tree.owned.data();
+    tree.length = tree.owned.size();
+
+    timer.stop();
+    timer.print("freeze data.raw");
+    return tree;
+}
+
+bool FrozenTree::save(const fs::path& file, spdlog::logger& logger) const
+{
+    fs::path temp = file;
+    temp += ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        out.write(base, length);
+        if (!out)
+        {
+            logger.warn("could not write frozen data.raw to {0}", ws2s(temp.wstring()));
+            return false;
+        }
+    }
+
+    // A process that has the old file mapped keeps its copy, rename only swaps the directory entry
+    std::error_code ec;
+    fs::rename(temp, file, ec);
+    if (ec)
+    {
+        logger.warn("could not move frozen data.raw into place: {0}", ec.message());
+        return false;
+    }
+    return true;
+}
+
+FrozenTree FrozenTree::map(const fs::path& file, spdlog::logger& logger)
+{
+    FrozenTree tree;
+
+#if defined(_WIN32)
+    HANDLE handle = CreateFileW(file.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+        return tree;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(handle);
+        return tree;
+    }
+
+    HANDLE mapping_handle = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    void* view = mapping_handle ? MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (!view)
+    {
+        if (mapping_handle) CloseHandle(mapping_handle);
+        CloseHandle(handle);
+        return tree;
+    }
+
+    tree.file_handle = handle;
+    tree.mapping_handle = mapping_handle;
+    tree.mapping = view;
+    tree.length = size_t(size.QuadPart);
+#else
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        return tree;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        return tree;
+    }
+
+    void* view = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file alive on its own
+    close(fd);
+    if (view == MAP_FAILED)
+        return tree;
+
+    tree.mapping = view;
+    tree.length = size_t(info.st_size);
+#endif
+
+    tree.base = static_cast<const char*>(tree.mapping);
+    if (!tree.validate())
+    {
+        logger.warn("ignoring frozen data.raw {0}: does not validate", ws2s(file.wstring()));
+        tree.unmap();
+    }
+    return tree;
+}
+
+void FrozenTree::unmap()
+{
+    if (mapping)
+    {
+#if defined(_WIN32)
+        UnmapViewOfFile(mapping);
+        CloseHandle(mapping_handle);
+        CloseHandle(file_handle);
+        mapping_handle = file_handle = nullptr;
+#else
+        munmap(mapping, length);
+#endif
+        mapping = nullptr;
+    }
+    base = nullptr;
+    length = 0;
+}
+
+FrozenTree::FrozenTree(FrozenTree&& move) noexcept
+{
+    *this = std::move(move);
+}
+
+FrozenTree& FrozenTree::operator=(FrozenTree&& move) noexcept
+{
+    if (this != &move)
+    {
+        unmap();
+        owned = std::move(move.owned);
+        base = move.base;
+        length = move.length;
+        mapping = move.mapping;
+#if defined(_WIN32)
+        file_handle = move.file_handle;
+        mapping_handle = move.mapping_handle;
+        move.file_handle = move.mapping_handle = nullptr;
+#endif
+        move.mapping = nullptr;
+        move.base = nullptr;
+        move.length = 0;
+    }
+    return *this;
+}
+
+FrozenTree::~FrozenTree()
+{
+    unmap();
+}
+
+uint64_t FrozenTree::fingerprint() const
+{
+    return base ? reinterpret_cast<const Header*>(base)->fingerprint : 0;
+}
+
+FrozenObject FrozenTree::root() const
+{
+    if (!base)
+        return FrozenObject();
+
+    const Header* header = reinterpret_cast<const Header*>(base);
+    return FrozenObject(base, reinterpret_cast<const Object*>(base + header->root));
+}
+
+bool FrozenTree::validate() const
+{
+    if (!base || length < sizeof(Header))
+        return false;
+
+    const Header* header = reinterpret_cast<const Header*>(base);
+    if (header->magic != magic || header->version != version || header->size != length)
+        return false;
+    if (header->strings > length || header->strings_size > length - header->strings)
+        return false;
+    // FrozenLoader keeps an object's offset / 8 in FObject::source_ref
+    if (header->strings / 8 > uint64_t(std::numeric_limits<int>::max()))
+        return false;
+
+    auto string_ok = [&](Str str) { return uint64_t(str.offset) + str.length <= header->strings_size; };
+
+    // Children always come after their parent, which rules out cycles as well as keeping the walk bounded
+    std::vector<uint64_t> pending{ header->root };
+    uint64_t objects_end = header->strings;
+    while (!pending.empty())
+    {
+        uint64_t at = pending.back();
+        pending.pop_back();
+
+        if (at % 8 != 0 || at < sizeof(Header) || at + sizeof(Object) > objects_end)
+            return false;
+
+        const Object* object = reinterpret_cast<const Object*>(base + at);
+        if (object->count > (objects_end - at - sizeof(Object)) / sizeof(Entry))
+            return false;
+
+        const Entry* entries = object->entries();
+        for (uint32_t i = 0; i < object->count; i++)
+        {
+            const Entry& entry = entries[i];
+            if (!string_ok(entry.key))
+                return false;
+
+            switch (entry.tag)
+            {
+                case Tag::nil: case Tag::uint: case Tag::number: case Tag::boolean: break;
+                case Tag::string: if (!string_ok(entry.string)) return false; break;
+                case Tag::table:
+                    if (entry.table <= at)
+                        return false;
+                    pending.push_back(entry.table);
+                    break;
+                default: return false;
+            }
+        }
+    }
+    return true;
+}
+
+static std::string_view frozen_string(const char* base, FrozenTree::Str str)
+{
+    const FrozenTree::Header* header = reinterpret_cast<const FrozenTree::Header*>(base);
+    return std::string_view(base + header->strings + str.offset, str.length);
+}
+
+std::string_view FrozenValue::str() const
+{
+    if (!is_string())
+        return std::string_view();
+    return frozen_string(base, entry->string);
+}
+
+FrozenObject FrozenValue::obj() const
+{
+    if (!is_table())
+        return FrozenObject();
+    return FrozenObject(base, reinterpret_cast<const FrozenTree::Object*>(base + entry->table));
+}
+
+std::string FrozenValue::to_string() const
+{
+    if (!entry)
+        return "!<>";
+
+    switch (entry->tag)
+    {
+        case FrozenTree::Tag::boolean: return entry->boolean ? "true" : "false";
+        case FrozenTree::Tag::number: return fmt::to_string(entry->number);
+        case FrozenTree::Tag::uint: return fmt::to_string(int64_t(entry->uint));
+        case FrozenTree::Tag::string: return std::string(str());
+        case FrozenTree::Tag::table: return "table";
+        default: return "!<>";
+    }
+}
+
+FrozenObject FrozenKeyValue::table() const
+{
+    return value.obj();
+}
+
+std::string_view FrozenObject::key(size_t i) const
+{
+    return frozen_string(base, object->entries()[i].key);
+}
+
+FrozenValue FrozenObject::child(std::string_view key) const
+{
+    if (!object)
+        return FrozenValue();
+
+    // Entries are in FObject::sort() order, which is plain byte order on the key
+    size_t low = 0, high = object->count;
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        if (this->key(mid) < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if (low < object->count && this->key(low) == key)
+        return FrozenValue(base, object->entries() + low);
+    return FrozenValue();
+}
+
+
+FObject* FrozenLoader::root()
+{
+    if (tree.empty())
+        return nullptr;
+
+    const FrozenTree::Header* header = reinterpret_cast<const FrozenTree::Header*>(tree.data());
+    FObject* root = arena.make<FObject>(this, int(header->root / 8));
+    root->materialize();
+    return root;
+}
+
+void FrozenLoader::load(FObject& stub)
+{
+    const FrozenObject object(tree.data(), reinterpret_cast<const FrozenTree::Object*>(tree.data() + uint64_t(stub.source_ref) * 8));
+
+    // The array part was merged in as "1".."n" keys, which sort as strings ("10" before "2"), so they go back by index
+    std::vector<std::pair<size_t, FValue>> indexed;
+    children.clear();
+    array.clear();
+    for (size_t i = 0; i < object.size(); i++)
+    {
+        const FrozenKeyValue kv = object[i];
+        const FrozenTree::Entry& entry = *kv.value.entry;
+
+        FValue value;
+        switch (entry.tag)
+        {
+            case FrozenTree::Tag::boolean: value = FValue(entry.boolean); break;
+            case FrozenTree::Tag::uint: value = FValue(entry.uint); break;
+            case FrozenTree::Tag::number: value = FValue(entry.number); break;
+            case FrozenTree::Tag::string: value = FValue(FString::intern(strings, kv.value.str())); break;
+            case FrozenTree::Tag::table: value = FValue(arena.make<FObject>(this, int(entry.table / 8))); break;
+            default: break;
+        }
+
+        size_t index = 0;
+        if (index_of(kv.key, index))
+            indexed.emplace_back(index, value);
+        else
+            children.emplace_back(FString::intern(strings, kv.key), value);
+    }
+
+    std::sort(indexed.begin(), indexed.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (const auto& [index, value] : indexed)
+    {
+        if (index == array.size() + 1)
+            array.push_back(value);
+        else
+            children.emplace_back(FObject::index_key(index, strings), value);
+    }
+
+    stub.children.items = arena.make_array<FKeyValue>(children.size());
+    stub.children.count = uint32_t(children.size());
+    std::copy(children.begin(), children.end(), stub.children.items);
+    stub.array = FArray::pack(array.data(), array.size(), arena);
+    stub.sort();
+}
+
+
+void FrozenWalker::push(const FrozenObject& obj, const FrozenKeyValue& entry)
+{
+    const size_t first = order.size();
+
+    // Split the same way FrozenLoader::load does it: "1".."n" without a gap are the array part, other numbers are keys
+    indexed.clear();
+    for (uint32_t i = 0; i < obj.size(); i++)
+    {
+        size_t index = 0;
+        if (index_of(obj.key(i), index))
+            indexed.emplace_back(index, i);
+    }
+    std::sort(indexed.begin(), indexed.end());
+    size_t array_count = 0;
+    while (array_count < indexed.size() && indexed[array_count].first == array_count + 1)
+        array_count++;
+
+    for (size_t i = 0; i < array_count; i++)
+        order.push_back(indexed[i].second);
+    for (uint32_t i = 0; i < obj.size(); i++)
+    {
+        size_t index = 0;
+        if (!index_of(obj.key(i), index) || index > array_count)
+            order.push_back(i);
+    }
+
+    stack.push_back(Frame{ obj, first, 0, entry });
+}
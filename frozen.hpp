@@ -0,0 +1,298 @@
+#pragma once
+#include <filesystem>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "fobject.hpp"
+
+namespace fs = std::filesystem;
+
+struct FrozenObject;
+
+//Immutable copy of an FObject tree packed into one contiguous buffer. Everything refers to everything else by offset from
+//the start of the buffer, so the same bytes work in memory or mmap'd straight from disk (and then shared between every
+//process that maps the file).
+//
+//Layout: Header, then objects (an Object header followed by its Entry array, sorted by key), then the string pool.
+struct FrozenTree
+{
+    static constexpr uint32_t magic = 0x5a524446; // "FDRZ"
+    static constexpr uint32_t version = 2;
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t size;
+        //Snapshot::fingerprint of the mods it was built from
+        uint64_t fingerprint;
+        uint64_t root;
+        uint64_t strings;
+        uint64_t strings_size;
+    };
+
+    struct Str
+    {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    enum class Tag : uint8_t { nil, table, string, uint, number, boolean };
+
+    struct Entry
+    {
+        Str key;
+        Tag tag;
+        union
+        {
+            uint64_t uint;
+            double number;
+            bool boolean;
+            Str string;
+            uint64_t table;
+        };
+    };
+
+    struct Object
+    {
+        uint32_t count;
+        uint32_t reserved;
+
+        const Entry* entries() const { return reinterpret_cast<const Entry*>(this + 1); }
+    };
+
+    FrozenTree() = default;
+    FrozenTree(FrozenTree&& move) noexcept;
+    FrozenTree& operator=(FrozenTree&& move) noexcept;
+    FrozenTree(const FrozenTree& copy) = delete;
+    ~FrozenTree();
+
+    static FrozenTree freeze(const FObject& root, uint64_t fingerprint);
+
+    bool save(const fs::path& file, spdlog::logger& logger) const;
+
+    //Maps the file read-only, an empty tree if it is missing or doesn't validate
+    static FrozenTree map(const fs::path& file, spdlog::logger& logger);
+
+    FrozenObject root() const;
+
+    const char* data() const { return base; }
+    size_t size() const { return length; }
+    bool empty() const { return base == nullptr; }
+    uint64_t fingerprint() const;
+
+    //Bounds check every object, entry and string once, so the views never have to
+    bool validate() const;
+
+private:
+    std::vector<char> owned;
+    const char* base = nullptr;
+    size_t length = 0;
+
+    void* mapping = nullptr;
+#if defined(_WIN32)
+    void* file_handle = nullptr;
+    void* mapping_handle = nullptr;
+#endif
+
+    void unmap();
+};
+
+
+//Thaws a frozen tree into FObjects one table at a time, the first time each is reached (see FLoader). Whatever is never
+//looked at stays in the tree's buffer only, which for a mapped file is shared with every other process using it.
+struct FrozenLoader : FLoader
+{
+    const FrozenTree& tree;
+    Arena& arena;
+    StringPool& strings;
+
+    FrozenLoader(const FrozenTree& tree, Arena& arena, StringPool& strings) : tree(tree), arena(arena), strings(strings) {}
+
+    //A stub for the root, nullptr for an empty tree
+    FObject* root();
+    void load(FObject& stub) override;
+
+private:
+    std::vector<FKeyValue> children;
+    std::vector<FValue> array;
+};
+
+
+//Zero-copy view of a single frozen value, strings come back as views into the pool
+struct FrozenValue
+{
+    const char* base = nullptr;
+    const FrozenTree::Entry* entry = nullptr;
+
+    FrozenValue() = default;
+    FrozenValue(const char* base, const FrozenTree::Entry* entry) : base(base), entry(entry) {}
+
+    template<typename T>
+    const T* as() const
+    {
+        if (!entry) return nullptr;
+        if constexpr (std::is_same_v<T, uint64_t>) return entry->tag == FrozenTree::Tag::uint ? &entry->uint : nullptr;
+        else if constexpr (std::is_same_v<T, double>) return entry->tag == FrozenTree::Tag::number ? &entry->number : nullptr;
+        else if constexpr (std::is_same_v<T, bool>) return entry->tag == FrozenTree::Tag::boolean ? &entry->boolean : nullptr;
+        else static_assert(!sizeof(T), "use str() for strings and obj() for tables");
+    }
+
+    bool is_string() const { return entry && entry->tag == FrozenTree::Tag::string; }
+    bool is_table() const { return entry && entry->tag == FrozenTree::Tag::table; }
+
+    //Empty view if this isn't a string
+    std::string_view str() const;
+    FrozenObject obj() const;
+
+    std::string to_string() const;
+
+    double to_double() const
+    {
+        if (auto num = as<double>(); num)
+            return *num;
+        if (auto num = as<uint64_t>(); num)
+            return double(int64_t(*num));
+        return 0;
+    }
+
+    operator bool() const { return entry != nullptr && entry->tag != FrozenTree::Tag::nil; }
+};
+
+
+struct FrozenKeyValue
+{
+    std::string_view key;
+    FrozenValue value;
+
+    FrozenObject table() const;
+};
+
+
+//Same lookup and visiting surface as FObject, over a frozen buffer
+struct FrozenObject
+{
+    const char* base = nullptr;
+    const FrozenTree::Object* object = nullptr;
+
+    FrozenObject() = default;
+    FrozenObject(const char* base, const FrozenTree::Object* object) : base(base), object(object) {}
+
+    size_t size() const { return object ? object->count : 0; }
+
+    std::string_view key(size_t i) const;
+    FrozenKeyValue at(size_t i) const { return { key(i), FrozenValue(base, object->entries() + i) }; }
+    FrozenKeyValue operator[](size_t i) const { return at(i); }
+
+    FrozenValue child(std::string_view key) const;
+    FrozenValue operator[](const std::string& key) const { return child(key); }
+    FrozenValue operator[](const char* key) const { return child(key); }
+
+    FrozenObject table(std::string_view key) const { return child(key).obj(); }
+
+    template<typename T>
+    void visit(T callback) const
+    {
+        for (size_t i = 0; i < size(); i++)
+        {
+            FrozenKeyValue kv = at(i);
+            if (kv.value.is_table())
+            {
+                if (callback(1, kv) == FObject::visit_result::DESCEND)
+                {
+                    kv.value.obj().visit(callback);
+                    callback(-1, kv);
+                }
+            }
+            else
+            {
+                callback(0, kv);
+            }
+        }
+    }
+
+    operator bool() const { return object != nullptr; }
+};
+
+
+//FWalker over a frozen tree, with the same callback (taking a FrozenKeyValue) and the same order: the "1".."n" entries
+//an array part was merged into come first, in index order, then everything else by key. It only reads the buffer, so
+//any number of threads can walk one tree while the UI thread thaws it.
+struct FrozenWalker
+{
+    struct Frame
+    {
+        FrozenObject obj;
+        //This table's entries in walk order are order[first, first + obj.size())
+        size_t first;
+        size_t next;
+        //The entry this table was reached through, for the -1 call
+        FrozenKeyValue entry;
+    };
+
+    FPath path;
+    std::vector<Frame> stack;
+    std::vector<uint32_t> order;
+
+    FrozenWalker(std::string_view root = {}, char separator = '/') : path(root, separator) {}
+
+    //False if the callback asked to EXIT
+    template<typename T>
+    bool walk(const FrozenObject& root, T callback, size_t max_depth = SIZE_MAX)
+    {
+        const size_t base = path.depth();
+        stack.clear();
+        order.clear();
+        push(root, FrozenKeyValue());
+
+        while (!stack.empty())
+        {
+            Frame& top = stack.back();
+            if (top.next == top.obj.size())
+            {
+                if (stack.size() > 1)
+                {
+                    callback(-1, static_cast<const FrozenKeyValue&>(top.entry), static_cast<const FPath&>(path));
+                    path.pop();
+                }
+                order.resize(top.first);
+                stack.pop_back();
+                continue;
+            }
+
+            const FrozenKeyValue entry = top.obj.at(order[top.first + top.next++]);
+            path.push(entry.key);
+            if (entry.value.is_table())
+            {
+                FObject::visit_result result = callback(1, entry, static_cast<const FPath&>(path));
+                if (result == FObject::visit_result::DESCEND && stack.size() < max_depth)
+                {
+                    push(entry.value.obj(), entry);
+                    continue;
+                }
+                if (result == FObject::visit_result::EXIT)
+                {
+                    while (path.depth() > base)
+                        path.pop();
+                    return false;
+                }
+            }
+            else if (callback(0, entry, static_cast<const FPath&>(path)) == FObject::visit_result::EXIT)
+            {
+                while (path.depth() > base)
+                    path.pop();
+                return false;
+            }
+            path.pop();
+        }
+        return true;
+    }
+
+private:
+    std::vector<std::pair<size_t, uint32_t>> indexed;
+
+    //Puts obj's entries on order in walk order and obj on the stack
+    void push(const FrozenObject& obj, const FrozenKeyValue& entry);
+};
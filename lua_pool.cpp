@@ -0,0 +1,58 @@
+#include "lua_pool.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+bool LuaPool::refill(size_class& c)
+{
+    // Whatever is left at the end of the old slab is too small for this class and just stays unused
+    char* slab = new (std::nothrow) char[slab_size];
+    if (!slab)
+        return false;
+    slabs.emplace_back(slab);
+    c.cursor = slab;
+    c.end = slab + slab_size;
+    return true;
+}
+
+void* LuaPool::reallocate(void* ptr, size_t osize, size_t nsize)
+{
+    if (nsize == 0)
+    {
+        if (ptr)
+            deallocate(ptr, osize);
+        return nullptr;
+    }
+    if (!ptr)
+        return allocate(nsize);
+
+    if (pooled(osize) && pooled(nsize))
+    {
+        if (class_of(osize) == class_of(nsize))
+            return ptr;
+    }
+    else if (!pooled(osize) && !pooled(nsize))
+    {
+        return realloc(ptr, nsize);
+    }
+
+    void* moved = allocate(nsize);
+    if (!moved)
+    {
+        // lua assumes shrinking can't fail. Keeping the old block is fine: it is at least nsize big, and when lua frees it
+        // as nsize it only ends up on a smaller class' list (a malloc'd one then never goes back, this is out of memory
+        // anyway).
+        return nsize <= osize ? ptr : nullptr;
+    }
+    memcpy(moved, ptr, std::min(osize, nsize));
+    deallocate(ptr, osize);
+    return moved;
+}
+
+void LuaPool::release()
+{
+    slabs.clear();
+    for (auto& c : classes)
+        c = size_class();
+}
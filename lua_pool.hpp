@@ -0,0 +1,87 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+//Size-class allocator behind a lua_State (see VM::lua_alloc).
+//
+//Almost everything the data stage allocates is small: strings, table nodes and arrays, closures, upvalues. Blocks up to
+//max_pooled bytes come from per-class free lists that are refilled by bumping through 64K slabs, anything bigger goes to
+//malloc. Nothing is looked up on free: lua always passes the block's size back as osize, which picks the class.
+//
+//Slabs are only given back when the pool is released, which the VM does right after lua_close.
+struct LuaPool
+{
+    static constexpr size_t granularity = 16;
+    static constexpr size_t max_pooled = 512;
+    static constexpr size_t class_count = max_pooled / granularity;
+    static constexpr size_t slab_size = 64 * 1024;
+
+    struct free_block
+    {
+        free_block* next;
+    };
+
+    struct size_class
+    {
+        free_block* free = nullptr;
+        char* cursor = nullptr;
+        char* end = nullptr;
+    };
+
+    size_class classes[class_count];
+    std::vector<std::unique_ptr<char[]>> slabs;
+
+    LuaPool() = default;
+    LuaPool(const LuaPool& copy) = delete;
+
+    static bool pooled(size_t size) { return size <= max_pooled; }
+    static size_t class_of(size_t size) { return (size - 1) / granularity; }
+
+    void* allocate(size_t size)
+    {
+        if (!pooled(size))
+            return malloc(size);
+
+        size_class& c = classes[class_of(size)];
+        if (free_block* block = c.free; block)
+        {
+            c.free = block->next;
+            return block;
+        }
+        const size_t block_size = (class_of(size) + 1) * granularity;
+        if (size_t(c.end - c.cursor) < block_size)
+        {
+            if (!refill(c))
+                return nullptr;
+        }
+        void* out = c.cursor;
+        c.cursor += block_size;
+        return out;
+    }
+
+    void deallocate(void* ptr, size_t size)
+    {
+        if (!pooled(size))
+        {
+            free(ptr);
+            return;
+        }
+        size_class& c = classes[class_of(size)];
+        free_block* block = static_cast<free_block*>(ptr);
+        block->next = c.free;
+        c.free = block;
+    }
+
+    //lua_Alloc semantics, except that osize must be 0 when ptr is null
+    void* reallocate(void* ptr, size_t osize, size_t nsize);
+
+    //Drops every slab, only safe once the lua_State using the pool is closed
+    void release();
+
+    size_t reserved() const { return slabs.size() * slab_size; }
+
+private:
+    bool refill(size_class& c);
+};
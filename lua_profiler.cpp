@@ -0,0 +1,194 @@
+#include "lua_profiler.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <fstream>
+#include <map>
+
+#include "fmt/format.h"
+
+static const char registry_key = 0;
+
+void LuaProfiler::attach(lua_State* L)
+{
+    lua_pushlightuserdata(L, this);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &registry_key);
+    lua_sethook(L, hook, LUA_MASKCOUNT, int(count_period));
+}
+
+void LuaProfiler::detach(lua_State* L)
+{
+    lua_sethook(L, nullptr, 0, 0);
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &registry_key);
+}
+
+void LuaProfiler::hook(lua_State* L, lua_Debug* ar)
+{
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &registry_key);
+    LuaProfiler* profiler = static_cast<LuaProfiler*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    if (!profiler)
+        return;
+
+    profiler->instructions += profiler->count_period;
+    if (profiler->sample_every == 0 || ++profiler->until_sample < profiler->sample_every)
+        return;
+    profiler->until_sample = 0;
+
+    if (!lua_getinfo(L, "Sl", ar))
+        return;
+    profiler->line_samples[fmt::format("{0}:{1}", ar->short_src, ar->currentline)]++;
+    profiler->function_samples[fmt::format("{0}:{1}", ar->short_src, ar->linedefined)]++;
+}
+
+void LuaProfiler::enter(std::string file, std::string mod)
+{
+    const clock::time_point now = clock::now();
+    Span span;
+    span.file = std::move(file);
+    span.mod = std::move(mod);
+    span.start = now - started;
+    span.depth = uint32_t(open.size());
+    spans.push_back(std::move(span));
+    open.push_back({ spans.size() - 1, now, instructions });
+}
+
+void LuaProfiler::leave()
+{
+    const open_span top = open.back();
+    open.pop_back();
+
+    Span& span = spans[top.span];
+    span.total = clock::now() - top.start;
+    span.total_instructions = instructions - top.instructions;
+    span.self = span.total - top.children;
+    span.self_instructions = span.total_instructions - top.children_instructions;
+
+    if (!open.empty())
+    {
+        open.back().children += span.total;
+        open.back().children_instructions += span.total_instructions;
+    }
+}
+
+static std::string json_string(const std::string& text)
+{
+    std::string out = "\"";
+    for (char c : text)
+    {
+        switch (c)
+        {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (uint8_t(c) < 0x20)
+                    out += fmt::format("\\u{0:04x}", int(c));
+                else
+                    out += c;
+        }
+    }
+    return out + "\"";
+}
+
+static double micros(std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+bool LuaProfiler::write_trace(const fs::path& file) const
+{
+    std::ofstream out(file, std::ios::binary | std::ios::trunc);
+    out << "{\"traceEvents\":[";
+    for (size_t i = 0; i < spans.size(); i++)
+    {
+        const Span& span = spans[i];
+        out << (i ? ",\n" : "\n")
+            << fmt::format("{{\"name\":{0},\"cat\":{1},\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":{2:.3f},\"dur\":{3:.3f},"
+                           "\"args\":{{\"self_us\":{4:.3f},\"instructions\":{5},\"self_instructions\":{6}}}}}",
+                           json_string(span.file), json_string(span.mod), micros(span.start), micros(span.total), micros(span.self),
+                           span.total_instructions, span.self_instructions);
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return bool(out);
+}
+
+std::string LuaProfiler::summary(size_t top) const
+{
+    struct totals
+    {
+        clock::duration self{};
+        clock::duration total{};
+        uint64_t self_instructions = 0;
+        uint64_t total_instructions = 0;
+        size_t calls = 0;
+    };
+
+    // Nested runs of the same file (a module requiring itself through another) would count twice in total, only the
+    // outermost one is added
+    std::map<std::string, totals> by_mod;
+    std::map<std::pair<std::string, std::string>, totals> by_file;
+    std::map<std::pair<std::string, std::string>, uint32_t> open_depth;
+    std::vector<const Span*> stack;
+    for (const Span& span : spans)
+    {
+        while (!stack.empty() && stack.back()->depth >= span.depth)
+        {
+            open_depth[{ stack.back()->mod, stack.back()->file }]--;
+            stack.pop_back();
+        }
+
+        totals& mod = by_mod[span.mod];
+        totals& file = by_file[{ span.mod, span.file }];
+        mod.self += span.self;
+        mod.self_instructions += span.self_instructions;
+        file.self += span.self;
+        file.self_instructions += span.self_instructions;
+        file.calls++;
+        if (open_depth[{ span.mod, span.file }]++ == 0)
+        {
+            file.total += span.total;
+            file.total_instructions += span.total_instructions;
+        }
+        stack.push_back(&span);
+    }
+
+    std::string out;
+    out += fmt::format("lua profile: {0} spans, {1} instructions (counted every {2})\n", spans.size(), instructions, count_period);
+
+    auto by_self = [](const auto& a, const auto& b) { return a.second.self > b.second.self; };
+
+    std::vector<std::pair<std::string, totals>> mods(by_mod.begin(), by_mod.end());
+    std::sort(mods.begin(), mods.end(), by_self);
+    out += "  by mod, self time:\n";
+    for (size_t i = 0; i < mods.size() && i < top; i++)
+        out += fmt::format("    {0:>10.3f}ms {1:>12} instr  {2}\n", micros(mods[i].second.self) / 1000, mods[i].second.self_instructions, mods[i].first);
+
+    std::vector<std::pair<std::pair<std::string, std::string>, totals>> files(by_file.begin(), by_file.end());
+    std::sort(files.begin(), files.end(), by_self);
+    out += "  by file, self / total time:\n";
+    for (size_t i = 0; i < files.size() && i < top; i++)
+    {
+        const totals& file = files[i].second;
+        out += fmt::format("    {0:>10.3f}ms {1:>10.3f}ms {2:>12} instr {3:>5}x  {4}: {5}\n", micros(file.self) / 1000, micros(file.total) / 1000,
+                           file.self_instructions, file.calls, files[i].first.first, files[i].first.second);
+    }
+
+    auto hottest = [&](const char* title, const ska::bytell_hash_map<std::string, uint64_t>& samples) {
+        if (samples.empty())
+            return;
+        uint64_t count = 0;
+        std::vector<std::pair<std::string, uint64_t>> sorted(samples.begin(), samples.end());
+        for (auto& sample : sorted)
+            count += sample.second;
+        std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+        out += fmt::format("  {0}, {1} samples:\n", title, count);
+        for (size_t i = 0; i < sorted.size() && i < top; i++)
+            out += fmt::format("    {0:>5.1f}% {1}\n", 100.0 * double(sorted[i].second) / double(count), sorted[i].first);
+    };
+    hottest("hot functions", function_samples);
+    hottest("hot lines", line_samples);
+    return out;
+}
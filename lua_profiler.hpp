@@ -0,0 +1,80 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <bytell_hash_map.hpp>
+#include <lua.h>
+
+namespace fs = std::filesystem;
+
+//Where the data stage spends its time: every file run through VM::call_file or require is a span, timed and nested, with
+//the lua instructions it executed. The instruction counts come from a count hook, so they are only as precise as
+//count_period. With sample_every set, every that many hook calls the line and function that is running gets sampled.
+//
+//A VM only profiles while its profiler pointer is set, otherwise there is no hook and no bookkeeping at all.
+struct LuaProfiler
+{
+    using clock = std::chrono::steady_clock;
+
+    struct Span
+    {
+        std::string file;
+        //Mod whose data stage step was running, "(lualib)" outside of the steps
+        std::string mod;
+        clock::duration start;
+        clock::duration total{};
+        clock::duration self{};
+        uint64_t total_instructions = 0;
+        uint64_t self_instructions = 0;
+        uint32_t depth;
+    };
+
+    //Closes its span when it goes out of scope, lua errors unwind through it like any other exception
+    struct scope
+    {
+        LuaProfiler& profiler;
+        scope(LuaProfiler& profiler, std::string file, std::string mod) : profiler(profiler) { profiler.enter(std::move(file), std::move(mod)); }
+        ~scope() { profiler.leave(); }
+    };
+
+    const uint32_t count_period;
+    const uint32_t sample_every;
+
+    std::vector<Span> spans;
+    uint64_t instructions = 0;
+    ska::bytell_hash_map<std::string, uint64_t> line_samples;
+    ska::bytell_hash_map<std::string, uint64_t> function_samples;
+
+    LuaProfiler(uint32_t count_period = 1000, uint32_t sample_every = 0) : count_period(count_period), sample_every(sample_every), started(clock::now()) {}
+
+    //Installs the count hook, detach before the profiler goes away if the state outlives it
+    void attach(lua_State* L);
+    void detach(lua_State* L);
+
+    void enter(std::string file, std::string mod);
+    void leave();
+
+    //Chrome trace-event JSON (chrome://tracing, Perfetto), one complete event per span
+    bool write_trace(const fs::path& file) const;
+    //Self and total time per mod and per file, slowest first, then the hottest sampled functions and lines
+    std::string summary(size_t top = 20) const;
+
+private:
+    struct open_span
+    {
+        size_t span;
+        clock::time_point start;
+        uint64_t instructions;
+        clock::duration children{};
+        uint64_t children_instructions = 0;
+    };
+
+    clock::time_point started;
+    std::vector<open_span> open;
+    uint32_t until_sample = 0;
+
+    static void hook(lua_State* L, lua_Debug* ar);
+};
@@ -0,0 +1,119 @@
+#include "mod_archive.hpp"
+
+#include <algorithm>
+
+#include <zip.h>
+
+std::unique_ptr<ModArchive> ModArchive::open(const fs::path& path)
+{
+    zip_t* zip = zip_open(ws2s(path.wstring()).c_str(), 0, 'r');
+    if (!zip)
+        return nullptr;
+
+    auto archive = std::make_unique<ModArchive>(path, zip);
+
+    struct raw_entry
+    {
+        std::string name;
+        Entry entry;
+    };
+    std::vector<raw_entry> files;
+
+    int total = zip_total_entries(zip);
+    files.reserve(size_t(std::max(total, 0)));
+    for (int i = 0; i < total; i++)
+    {
+        if (zip_entry_openbyindex(zip, i) != 0)
+            continue;
+        if (!zip_entry_isdir(zip))
+            files.push_back({ zip_entry_name(zip), Entry{ i, zip_entry_size(zip) } });
+        zip_entry_close(zip);
+    }
+
+    // The shallowest info.json marks the mod's folder, usually the one top level directory
+    size_t root_depth = std::string::npos;
+    for (auto& file : files)
+    {
+        const std::string& name = file.name;
+        if (name == "info.json" || (name.size() > 10 && name.compare(name.size() - 10, 10, "/info.json") == 0))
+        {
+            size_t depth = size_t(std::count(name.begin(), name.end(), '/'));
+            if (depth < root_depth)
+            {
+                root_depth = depth;
+                archive->root = name.substr(0, name.size() - 9);
+            }
+        }
+    }
+    if (root_depth == std::string::npos)
+        return nullptr;
+
+    const std::string& root = archive->root;
+    archive->entries.reserve(files.size());
+    for (auto& file : files)
+    {
+        if (file.name.compare(0, root.size(), root) == 0)
+            archive->entries.emplace(file.name.substr(root.size()), file.entry);
+    }
+
+    return archive;
+}
+
+ModArchive::~ModArchive()
+{
+    zip_close(zip);
+}
+
+bool ModArchive::extract_locked(const Entry& entry, std::vector<char>& out)
+{
+    if (zip_entry_openbyindex(zip, entry.index) != 0)
+        return false;
+
+    out.resize(size_t(entry.size));
+    ssize_t read = entry.size ? zip_entry_noallocread(zip, out.data(), out.size()) : 0;
+    zip_entry_close(zip);
+    return read >= 0 && uint64_t(read) == entry.size;
+}
+
+bool ModArchive::extract(const std::string& name, std::vector<char>& out)
+{
+    auto it = entries.find(name);
+    if (it == entries.end())
+        return false;
+
+    std::lock_guard<std::mutex> guard(lock);
+    return extract_locked(it->second, out);
+}
+
+std::shared_ptr<const std::vector<char>> ModArchive::read(const std::string& name)
+{
+    auto entry = entries.find(name);
+    if (entry == entries.end())
+        return nullptr;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (auto it = cached.find(name); it != cached.end())
+    {
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+    }
+
+    auto contents = std::make_shared<std::vector<char>>();
+    if (!extract_locked(entry->second, *contents))
+        return nullptr;
+
+    lru.emplace_front(name, contents);
+    cached.emplace(name, lru.begin());
+    cached_size += contents->size();
+
+    // Callers hold their own reference, dropping an entry here never pulls a buffer out from under them
+    while (cached_size > cache_bytes && lru.size() > 1)
+    {
+        cached_size -= lru.back().second->size();
+        cached.erase(lru.back().first);
+        lru.pop_back();
+    }
+
+    return contents;
+}
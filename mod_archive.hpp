@@ -0,0 +1,62 @@
+#pragma once
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+namespace fs = std::filesystem;
+
+struct zip_t;
+
+//A zipped mod, read in place. The central directory is indexed once when the archive is opened, entries are only inflated
+//when someone asks for them.
+//
+//Mod zips keep everything under one top level folder (name_version/), names here are relative to that folder and always
+//use '/'.
+struct ModArchive
+{
+    struct Entry
+    {
+        int index;
+        uint64_t size;
+    };
+
+    //Inflated entries kept around for repeated reads (info.json, icons), least recently used goes first
+    static constexpr size_t cache_bytes = 16 << 20;
+
+    const fs::path path;
+    std::string root;
+    ska::bytell_hash_map<std::string, Entry> entries;
+
+    //nullptr if the file isn't a readable zip or has no info.json
+    static std::unique_ptr<ModArchive> open(const fs::path& path);
+
+    ModArchive(const fs::path& path, zip_t* zip) : path(path), zip(zip) {}
+    ModArchive(const ModArchive& copy) = delete;
+    ~ModArchive();
+
+    bool contains(const std::string& name) const { return entries.find(name) != entries.end(); }
+
+    //Inflates without touching the cache, for files that are only read once (lua sources). Safe from any thread.
+    bool extract(const std::string& name, std::vector<char>& out);
+
+    //Cached read, nullptr if there is no such entry or it doesn't inflate
+    std::shared_ptr<const std::vector<char>> read(const std::string& name);
+
+private:
+    using cached_entry = std::pair<std::string, std::shared_ptr<const std::vector<char>>>;
+
+    zip_t* zip;
+    //miniz keeps one open entry per archive, so every access goes through this
+    std::mutex lock;
+
+    std::list<cached_entry> lru;
+    ska::bytell_hash_map<std::string, std::list<cached_entry>::iterator> cached;
+    size_t cached_size = 0;
+
+    bool extract_locked(const Entry& entry, std::vector<char>& out);
+};
@@ -0,0 +1,320 @@
+#include "mod_info.hpp"
+
+#include <cstdint>
+
+static bool parse_int(std::string_view& text, int& out)
+{
+    size_t i = 0;
+    int value = 0;
+    while (i < text.size() && text[i] >= '0' && text[i] <= '9' && i < 9)
+        value = value * 10 + (text[i++] - '0');
+    if (i == 0)
+        return false;
+    out = value;
+    text.remove_prefix(i);
+    return true;
+}
+
+bool ModVersion::parse(std::string_view text, ModVersion& out)
+{
+    ModVersion version{ 0, 0, 0 };
+    if (!parse_int(text, version.major) || text.empty() || text[0] != '.')
+        return false;
+    text.remove_prefix(1);
+    if (!parse_int(text, version.minor))
+        return false;
+    if (!text.empty())
+    {
+        if (text[0] != '.')
+            return false;
+        text.remove_prefix(1);
+        if (!parse_int(text, version.patch) || !text.empty())
+            return false;
+    }
+    out = version;
+    return true;
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static std::string_view trim(std::string_view text)
+{
+    while (!text.empty() && is_space(text.front())) text.remove_prefix(1);
+    while (!text.empty() && is_space(text.back())) text.remove_suffix(1);
+    return text;
+}
+
+bool Dependency::parse(std::string_view text, Dependency& out)
+{
+    Dependency dep;
+    text = trim(text);
+
+    if (text.substr(0, 3) == "(?)") { dep.type = Type::optional_hidden; text.remove_prefix(3); }
+    else if (!text.empty() && text[0] == '?') { dep.type = Type::optional; text.remove_prefix(1); }
+    else if (!text.empty() && text[0] == '!') { dep.type = Type::forbidden; text.remove_prefix(1); }
+    else if (!text.empty() && text[0] == '~') { dep.type = Type::unordered; text.remove_prefix(1); }
+
+    // Names may contain spaces, so the name is everything up to the operator
+    size_t op_at = text.find_first_of("<>=");
+    std::string_view name = trim(text.substr(0, op_at));
+    if (name.empty())
+        return false;
+    dep.modName = std::string(name);
+
+    if (op_at != std::string_view::npos)
+    {
+        std::string_view rest = text.substr(op_at);
+        bool or_equal = rest.size() > 1 && rest[1] == '=';
+        switch (rest[0])
+        {
+            case '<': dep.op = or_equal ? Operator::le : Operator::lt; break;
+            case '>': dep.op = or_equal ? Operator::ge : Operator::gt; break;
+            default: dep.op = Operator::eq; break;
+        }
+        rest.remove_prefix(or_equal ? 2 : 1);
+
+        if (!ModVersion::parse(trim(rest), dep.versionComp))
+            return false;
+    }
+
+    out = std::move(dep);
+    return true;
+}
+
+bool Dependency::accepts(const ModVersion& version) const
+{
+    switch (op)
+    {
+        case Operator::le: return !(versionComp < version);
+        case Operator::lt: return version < versionComp;
+        case Operator::eq: return version == versionComp;
+        case Operator::gt: return versionComp < version;
+        case Operator::ge: return !(version < versionComp);
+    }
+    return false;
+}
+
+
+struct json_reader
+{
+    std::string_view text;
+    size_t at = 0;
+
+    void skip_space()
+    {
+        while (at < text.size() && is_space(text[at]))
+            at++;
+    }
+
+    bool eat(char c)
+    {
+        skip_space();
+        if (at < text.size() && text[at] == c)
+        {
+            at++;
+            return true;
+        }
+        return false;
+    }
+
+    static void put_utf8(std::string& out, uint32_t cp)
+    {
+        if (cp < 0x80) out += char(cp);
+        else if (cp < 0x800) { out += char(0xc0 | (cp >> 6)); out += char(0x80 | (cp & 0x3f)); }
+        else if (cp < 0x10000) { out += char(0xe0 | (cp >> 12)); out += char(0x80 | ((cp >> 6) & 0x3f)); out += char(0x80 | (cp & 0x3f)); }
+        else { out += char(0xf0 | (cp >> 18)); out += char(0x80 | ((cp >> 12) & 0x3f)); out += char(0x80 | ((cp >> 6) & 0x3f)); out += char(0x80 | (cp & 0x3f)); }
+    }
+
+    bool hex4(uint32_t& out)
+    {
+        if (text.size() - at < 4)
+            return false;
+        out = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            char c = text[at++];
+            out <<= 4;
+            if (c >= '0' && c <= '9') out |= uint32_t(c - '0');
+            else if (c >= 'a' && c <= 'f') out |= uint32_t(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') out |= uint32_t(c - 'A' + 10);
+            else return false;
+        }
+        return true;
+    }
+
+    //out may be null when the value is only being skipped
+    bool string(std::string* out)
+    {
+        if (!eat('"'))
+            return false;
+
+        while (at < text.size())
+        {
+            // Copy plain runs in one go, escapes are rare in info.json
+            size_t run = at;
+            while (at < text.size() && text[at] != '"' && text[at] != '\\')
+                at++;
+            if (out)
+                out->append(text.data() + run, at - run);
+            if (at == text.size())
+                return false;
+
+            if (text[at++] == '"')
+                return true;
+
+            if (at == text.size())
+                return false;
+            char c = text[at++];
+            char plain = 0;
+            switch (c)
+            {
+                case '"': plain = '"'; break;
+                case '\\': plain = '\\'; break;
+                case '/': plain = '/'; break;
+                case 'b': plain = '\b'; break;
+                case 'f': plain = '\f'; break;
+                case 'n': plain = '\n'; break;
+                case 'r': plain = '\r'; break;
+                case 't': plain = '\t'; break;
+                case 'u':
+                {
+                    uint32_t cp;
+                    if (!hex4(cp))
+                        return false;
+                    if (cp >= 0xd800 && cp < 0xdc00 && text.substr(at, 2) == "\\u")
+                    {
+                        at += 2;
+                        uint32_t low;
+                        if (!hex4(low) || low < 0xdc00 || low >= 0xe000)
+                            return false;
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                    }
+                    if (out)
+                        put_utf8(*out, cp);
+                    continue;
+                }
+                default: return false;
+            }
+            if (out)
+                *out += plain;
+        }
+        return false;
+    }
+
+    bool literal(std::string_view word)
+    {
+        if (text.substr(at, word.size()) != word)
+            return false;
+        at += word.size();
+        return true;
+    }
+
+    bool number()
+    {
+        size_t start = at;
+        while (at < text.size() && (text[at] == '-' || text[at] == '+' || text[at] == '.' || text[at] == 'e' || text[at] == 'E' || (text[at] >= '0' && text[at] <= '9')))
+            at++;
+        return at != start;
+    }
+
+    bool skip_value(int depth = 0)
+    {
+        if (depth > 64)
+            return false;
+
+        skip_space();
+        if (at == text.size())
+            return false;
+
+        switch (text[at])
+        {
+            case '"': return string(nullptr);
+            case 't': return literal("true");
+            case 'f': return literal("false");
+            case 'n': return literal("null");
+            case '[':
+                at++;
+                if (eat(']'))
+                    return true;
+                do
+                {
+                    if (!skip_value(depth + 1))
+                        return false;
+                } while (eat(','));
+                return eat(']');
+            case '{':
+                at++;
+                if (eat('}'))
+                    return true;
+                do
+                {
+                    if (!string(nullptr) || !eat(':') || !skip_value(depth + 1))
+                        return false;
+                } while (eat(','));
+                return eat('}');
+            default: return number();
+        }
+    }
+};
+
+bool ModInfo::parse(std::string_view json, ModInfo& out)
+{
+    json_reader reader{ json };
+    // Hand edited info.json files quite often start with a BOM
+    if (json.substr(0, 3) == "\xef\xbb\xbf")
+        reader.at = 3;
+
+    ModInfo info;
+    bool has_dependencies = false;
+
+    if (!reader.eat('{'))
+        return false;
+    if (!reader.eat('}'))
+    {
+        do
+        {
+            std::string key;
+            if (!reader.string(&key) || !reader.eat(':'))
+                return false;
+
+            bool ok;
+            if (key == "name") ok = reader.string(&info.name);
+            else if (key == "version") ok = reader.string(&info.version);
+            else if (key == "dependencies")
+            {
+                has_dependencies = true;
+                ok = reader.eat('[');
+                if (ok && !reader.eat(']'))
+                {
+                    do
+                    {
+                        info.dependencies.emplace_back();
+                        ok = reader.string(&info.dependencies.back());
+                    } while (ok && reader.eat(','));
+                    ok = ok && reader.eat(']');
+                }
+            }
+            else ok = reader.skip_value();
+
+            if (!ok)
+                return false;
+        } while (reader.eat(','));
+
+        if (!reader.eat('}'))
+            return false;
+    }
+
+    reader.skip_space();
+    if (reader.at != json.size() || info.name.empty())
+        return false;
+
+    // Factorio's default when the key is left out
+    if (!has_dependencies)
+        info.dependencies.push_back("base");
+
+    out = std::move(info);
+    return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct ModVersion {
+    int major, minor, patch;
+
+    //"1.2" or "1.2.3", a missing patch is 0
+    static bool parse(std::string_view text, ModVersion& out);
+    //Always "major.minor.patch", the way the game shows it in mods[]
+    std::string to_string() const
+    {
+        return std::to_string(major) + "." + std::to_string(minor) + "." + std::to_string(patch);
+    }
+
+    friend bool operator<(const ModVersion& a, const ModVersion& b)
+    {
+        if (a.major != b.major) return a.major < b.major;
+        if (a.minor != b.minor) return a.minor < b.minor;
+        return a.patch < b.patch;
+    }
+    friend bool operator==(const ModVersion& a, const ModVersion& b)
+    {
+        return a.major == b.major && a.minor == b.minor && a.patch == b.patch;
+    }
+};
+
+struct Dependency
+{
+    enum class Operator { le, lt, eq, gt, ge };
+    //unordered is "~": has to be there, but doesn't change load order
+    enum class Type { optional, required, forbidden, optional_hidden, unordered };
+    std::string modName;
+    Type type = Type::required;
+    //A dependency without a version is ">= 0.0.0"
+    Operator op = Operator::ge;
+    ModVersion versionComp = { 0, 0, 0 };
+
+    //"[prefix] name [op version]", prefix one of ! ? (?) ~
+    static bool parse(std::string_view text, Dependency& out);
+
+    bool accepts(const ModVersion& version) const;
+};
+
+//The parts of info.json discovery needs
+struct ModInfo
+{
+    std::string name;
+    std::string version;
+    std::vector<std::string> dependencies;
+
+    //Narrow char JSON reader, strings stay UTF-8. Keys it doesn't know are skipped but still have to be valid JSON.
+    static bool parse(std::string_view json, ModInfo& out);
+};
@@ -0,0 +1,206 @@
+#include "modpack_generator.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <vector>
+
+#include "fmt/format.h"
+
+static const char* const prototype_types[] = { "item", "recipe", "fluid", "technology", "assembling-machine" };
+
+static const char dataloader_lua[] = R"(data = { raw = {} }
+function data:extend(t)
+  for _, p in ipairs(t) do
+    self.raw[p.type] = self.raw[p.type] or {}
+    self.raw[p.type][p.name] = p
+  end
+end
+return data
+)";
+
+static const char util_lua[] = R"(local util = {}
+function util.copy(t)
+  if type(t) ~= "table" then return t end
+  local r = {}
+  for k, v in pairs(t) do r[k] = util.copy(v) end
+  return r
+end
+function util.merge(tables)
+  local r = {}
+  for _, t in ipairs(tables) do
+    for k, v in pairs(t) do
+      if type(v) == "table" and type(r[k]) == "table" then r[k] = util.merge({ r[k], v }) else r[k] = util.copy(v) end
+    end
+  end
+  return r
+end
+return util
+)";
+
+static const char core_data_lua[] = R"(local util = require("util")
+data:extend({{type="font", name="default", size=14, border=false}})
+)";
+
+std::string ModpackGenerator::Config::to_json() const
+{
+    return fmt::format("{{\"mods\":{0},\"prototypes\":{1},\"depth\":{2},\"fanout\":{3},\"dependencies\":{4},\"seed\":{5}}}",
+                       mods, prototypes, depth, fanout, dependencies, seed);
+}
+
+std::string ModpackGenerator::mod_name(uint32_t index)
+{
+    return fmt::format("bench-mod-{0:03}", index);
+}
+
+static bool write_file(const fs::path& file, const std::string& contents)
+{
+    std::error_code ec;
+    fs::create_directories(file.parent_path(), ec);
+    std::ofstream out(file, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), std::streamsize(contents.size()));
+    if (!out)
+    {
+        fprintf(stderr, "can't write %s\n", file.string().c_str());
+        return false;
+    }
+    return true;
+}
+
+static void nested_table(std::string& out, uint32_t depth, uint32_t value)
+{
+    out += fmt::format("{{ level = {0}, scale = {1}.5, values = {{ {2}, {3}, {4} }}, tint = {{ r = 0.{5}, g = 0.5, b = 1 }}",
+                       depth, value % 7, value, value + 1, value + 2, value % 10);
+    if (depth > 1)
+    {
+        out += ", child = ";
+        nested_table(out, depth - 1, value * 3 + 1);
+    }
+    out += " }";
+}
+
+// owner is the mod (or base) whose prototypes these are, recipes use the item of the index before theirs
+static void prototype(std::string& out, const ModpackGenerator::Config& config, const std::string& owner, uint32_t index, std::mt19937& rng)
+{
+    const char* type = prototype_types[index % std::size(prototype_types)];
+    const uint32_t amount = 1 + rng() % 50;
+    out += fmt::format("  {{ type = \"{0}\", name = \"{1}-{0}-{2}\", order = \"a[{1}]-b[{2}]\",\n", type, owner, index);
+    out += fmt::format("    icon = \"__{0}__/graphics/icons/{1}.png\", icon_size = 32, stack_size = {2},\n", owner, index, amount * 2);
+    if (type == std::string_view("recipe"))
+        out += fmt::format("    energy_required = {0}, ingredients = {{ {{ \"{1}-item-{2}\", {3} }}, {{ type = \"fluid\", name = \"water\", amount = {4} }} }}, result = \"{1}-item-{5}\",\n",
+                           amount * 0.25, owner, index ? index - 1 : 0, 1 + amount % 5, amount * 10, index);
+    else
+        out += "    flags = { \"goes-to-main-inventory\" },\n";
+    if (config.depth)
+    {
+        out += "    nested = ";
+        nested_table(out, config.depth, index);
+        out += ",\n";
+    }
+    out += "  },\n";
+}
+
+// data.lua plus its fanout required files, prototypes split between them
+static bool prototype_files(const ModpackGenerator::Config& config, const fs::path& dir, const std::string& owner, std::mt19937& rng)
+{
+    const uint32_t files = std::max(config.fanout, 1u);
+    std::string data = "local util = require(\"util\")\n";
+    for (uint32_t file = 0; file < files; file++)
+    {
+        std::string part = "return {\n";
+        for (uint32_t index = file; index < config.prototypes; index += files)
+            prototype(part, config, owner, index, rng);
+        part += "}\n";
+        if (!write_file(dir / "prototypes" / fmt::format("part-{0}.lua", file), part))
+            return false;
+        data += fmt::format("data:extend(require(\"prototypes.part-{0}\"))\n", file);
+    }
+    return write_file(dir / "data.lua", data);
+}
+
+bool ModpackGenerator::generate(const Config& config, const fs::path& dir)
+{
+    // --dir can point anywhere, so only ever delete what an earlier run wrote
+    std::error_code ec;
+    if (fs::exists(dir, ec))
+    {
+        if (!fs::is_directory(dir, ec) || !(fs::is_empty(dir, ec) || fs::exists(dir / marker, ec)))
+        {
+            fprintf(stderr, "refusing to replace %s: not an empty dir or one generated before (no %s in it)\n", dir.string().c_str(), marker);
+            return false;
+        }
+        fs::remove_all(dir, ec);
+    }
+    // First, so a run that fails half way still leaves a dir the next one may replace
+    if (!write_file(dir / marker, config.to_json()))
+        return false;
+
+    std::mt19937 rng(config.seed);
+
+    const fs::path core = dir / "data" / "core";
+    if (!write_file(core / "lualib" / "dataloader.lua", dataloader_lua) || !write_file(core / "lualib" / "util.lua", util_lua) ||
+        !write_file(core / "data.lua", core_data_lua))
+        return false;
+
+    const fs::path base = dir / "data" / "base";
+    if (!write_file(base / "info.json", "{\"name\":\"base\",\"version\":\"0.18.0\",\"title\":\"Base mod\",\"dependencies\":[\"core\"]}") ||
+        !prototype_files(config, base, "base", rng))
+        return false;
+
+    for (uint32_t mod = 0; mod < config.mods; mod++)
+    {
+        const std::string name = mod_name(mod);
+        const fs::path mod_dir = dir / "mods" / name;
+
+        std::vector<uint32_t> dependencies;
+        for (uint32_t i = 0; i < config.dependencies && mod > 0; i++)
+            dependencies.push_back(rng() % mod);
+        std::sort(dependencies.begin(), dependencies.end());
+        dependencies.erase(std::unique(dependencies.begin(), dependencies.end()), dependencies.end());
+
+        std::string info = fmt::format("{{\"name\":\"{0}\",\"version\":\"1.{1}.0\",\"title\":\"Bench mod {1}\",\"factorio_version\":\"0.18\",\"dependencies\":[\"base >= 0.18\"", name, mod);
+        for (size_t i = 0; i < dependencies.size(); i++)
+            info += fmt::format(",\"{0}{1} >= 1.0.0\"", i % 4 == 3 ? "? " : "", mod_name(dependencies[i]));
+        info += "]}";
+        if (!write_file(mod_dir / "info.json", info) || !prototype_files(config, mod_dir, name, rng))
+            return false;
+
+        // Patch and copy a few of the dependencies' prototypes, like compatibility code does
+        std::string updates = "local util = require(\"util\")\n";
+        for (uint32_t dependency : dependencies)
+        {
+            const uint32_t index = rng() % std::max(config.prototypes, 1u);
+            const std::string dep = mod_name(dependency);
+            updates += fmt::format("for _, p in pairs(data.raw[\"{0}\"] or {{}}) do\n"
+                                   "  if p.name:find(\"{1}\", 1, true) == 1 then p.stack_size = (p.stack_size or 1) * 2 end\n"
+                                   "end\n",
+                                   prototype_types[index % std::size(prototype_types)], dep);
+            updates += fmt::format("do\n"
+                                   "  local original = data.raw[\"{0}\"] and data.raw[\"{0}\"][\"{1}-{0}-{2}\"]\n"
+                                   "  if original then\n"
+                                   "    local copy = util.copy(original)\n"
+                                   "    copy.name = \"{3}-\" .. original.name\n"
+                                   "    data:extend({{ copy }})\n"
+                                   "  end\n"
+                                   "end\n",
+                                   prototype_types[index % std::size(prototype_types)], dep, index, name);
+        }
+        if (!write_file(mod_dir / "data-updates.lua", updates))
+            return false;
+
+        // Every fourth mod walks the whole of data.raw once more at the end
+        if (mod % 4 == 3)
+        {
+            const std::string fixes = fmt::format("for _, prototypes in pairs(data.raw) do\n"
+                                                  "  for _, p in pairs(prototypes) do\n"
+                                                  "    if p.order and p.stack_size then p.order = p.order .. \"-{0}\" end\n"
+                                                  "  end\n"
+                                                  "end\n",
+                                                  mod);
+            if (!write_file(mod_dir / "data-final-fixes.lua", fixes))
+                return false;
+        }
+    }
+    return true;
+}
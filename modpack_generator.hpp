@@ -0,0 +1,40 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+//Writes a synthetic game dir (data/core, data/base and mods/) whose data stage looks like a real modpack's: literal
+//prototype tables spread over required files, nested tables, info.json dependency chains, data-updates that copy and
+//patch what their dependencies defined, data-final-fixes that walk all of data.raw.
+//
+//Everything comes from seed, the same config always writes byte for byte the same files (std::mt19937 is specified,
+//the standard distributions aren't, so only its raw output is used).
+struct ModpackGenerator
+{
+    struct Config
+    {
+        uint32_t mods = 50;
+        //Per mod, base gets the same
+        uint32_t prototypes = 200;
+        //How deep each prototype's nested tables go
+        uint32_t depth = 3;
+        //Files each data.lua requires, the prototypes are split evenly between them
+        uint32_t fanout = 4;
+        //info.json dependencies per mod, on mods before it, every fourth one optional
+        uint32_t dependencies = 3;
+        uint32_t seed = 1;
+
+        std::string to_json() const;
+    };
+
+    //Left in every generated dir, the only kind of non-empty dir generate() will replace
+    static constexpr const char* marker = ".naughty_modpack";
+
+    //Replaces dir if it is empty or was generated before, anything else is left alone. Logs to stderr and returns false
+    //for such a dir or if a file can't be written.
+    static bool generate(const Config& config, const fs::path& dir);
+
+    static std::string mod_name(uint32_t index);
+};
@@ -0,0 +1,506 @@
+#include "production_graph.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+static double number_or(const FValue& value, double otherwise)
+{
+    value.try_to_double(otherwise);
+    return otherwise;
+}
+
+// { "iron-plate", 2 } or { type = "fluid", name = "water", amount = 10 }, results can also have amount_min/amount_max and a
+// probability. False if there's no name.
+static bool parse_amount(const FObject& entry, FString& name, bool& fluid, double& amount)
+{
+    if (const FValue named = entry.child("name"); named)
+    {
+        const FString* str = named.as<FString>();
+        if (!str)
+            return false;
+        name = *str;
+        const FValue type = entry.child("type");
+        fluid = type.as<FString>() && type.as<FString>()->view() == "fluid";
+        if (const FValue exact = entry.child("amount"); exact)
+            amount = number_or(exact, 1);
+        else
+            amount = (number_or(entry.child("amount_min"), 1) + number_or(entry.child("amount_max"), 1)) / 2;
+        amount *= number_or(entry.child("probability"), 1);
+        return true;
+    }
+
+    if (entry.array.empty())
+        return false;
+    const FValue first = entry.array[0];
+    if (!first.as<FString>())
+        return false;
+    name = *first.as<FString>();
+    fluid = false;
+    amount = entry.array.size() > 1 ? entry.array.number(1) : 1;
+    return true;
+}
+
+uint32_t ProductionGraph::node(FString name, bool fluid)
+{
+    auto added = by_name[fluid].emplace(name.view(), uint32_t(nodes.size()));
+    if (added.second)
+        nodes.push_back({ name, fluid });
+    return added.first->second;
+}
+
+void ProductionGraph::build(const FObject& data_raw, Difficulty difficulty)
+{
+    prof timer;
+    timer.start();
+
+    nodes.clear();
+    recipes.clear();
+    for (auto& names : by_name)
+        names.clear();
+    ingredient_offsets.assign(1, 0);
+    ingredients.clear();
+    result_offsets.assign(1, 0);
+    results.clear();
+
+    const char* wanted = difficulty == Difficulty::normal ? "normal" : "expensive";
+    const char* fallback = difficulty == Difficulty::normal ? "expensive" : "normal";
+
+    auto add = [&](const FObject& entry, std::vector<Amount>& out) {
+        FString name;
+        bool fluid = false;
+        double amount = 0;
+        if (parse_amount(entry, name, fluid, amount))
+            out.push_back({ node(name, fluid), amount });
+    };
+
+    const FObject& recipe_table = data_raw.table("recipe");
+    for (const FKeyValue& entry : recipe_table.children)
+    {
+        const FObject& recipe = entry.table();
+        if (!recipe)
+            continue;
+
+        // The recipe's own keys are used when it has neither difficulty table
+        const FObject* body = &recipe;
+        const FValue preferred = recipe.child(wanted);
+        if (const bool* enabled = preferred.as<bool>(); enabled && !*enabled)
+            continue;
+        if (preferred.as<FObject*>())
+            body = &preferred.obj();
+        else if (const FValue other = recipe.child(fallback); other.as<FObject*>())
+            body = &other.obj();
+
+        const FValue decompose = body->child("allow_decomposition") ? body->child("allow_decomposition") : recipe.child("allow_decomposition");
+        recipes.push_back({ entry.key, number_or(body->child("energy_required"), 0.5), !decompose.as<bool>() || *decompose.as<bool>() });
+
+        const FObject& ingredient_list = body->table("ingredients");
+        for (size_t i = 0; i < ingredient_list.array.size(); i++)
+            add(ingredient_list.array[i].obj(), ingredients);
+        for (const FKeyValue& ingredient : ingredient_list.children)
+            add(ingredient.table(), ingredients);
+        ingredient_offsets.push_back(uint32_t(ingredients.size()));
+
+        if (const FObject& result_list = body->table("results"); result_list)
+        {
+            for (size_t i = 0; i < result_list.array.size(); i++)
+                add(result_list.array[i].obj(), results);
+            for (const FKeyValue& result : result_list.children)
+                add(result.table(), results);
+        }
+        else if (const FValue result = body->child("result"); result.as<FString>())
+        {
+            results.push_back({ node(*result.as<FString>(), false), number_or(body->child("result_count"), 1) });
+        }
+        result_offsets.push_back(uint32_t(results.size()));
+    }
+
+    // Counted, then filled in recipe order, so every node's recipes come out ascending
+    auto invert = [&](const std::vector<Amount>& amounts, const std::vector<uint32_t>& offsets, std::vector<uint32_t>& out_offsets, std::vector<uint32_t>& out) {
+        out_offsets.assign(nodes.size() + 1, 0);
+        for (const Amount& amount : amounts)
+            out_offsets[amount.node + 1]++;
+        for (size_t i = 1; i < out_offsets.size(); i++)
+            out_offsets[i] += out_offsets[i - 1];
+        out.assign(amounts.size(), 0);
+        std::vector<uint32_t> fill(out_offsets.begin(), out_offsets.end() - 1);
+        for (uint32_t recipe = 0; recipe < recipes.size(); recipe++)
+        {
+            for (uint32_t i = offsets[recipe]; i < offsets[recipe + 1]; i++)
+            {
+                // A recipe listing the same node twice is still one producer
+                const uint32_t node = amounts[i].node;
+                if (fill[node] == out_offsets[node] || out[fill[node] - 1] != recipe)
+                    out[fill[node]++] = recipe;
+            }
+        }
+        // Squeeze out the slots duplicates left empty
+        size_t kept = 0;
+        for (size_t node = 0; node < nodes.size(); node++)
+        {
+            const uint32_t start = out_offsets[node];
+            out_offsets[node] = uint32_t(kept);
+            for (uint32_t i = start; i < fill[node]; i++)
+                out[kept++] = out[i];
+        }
+        out_offsets[nodes.size()] = uint32_t(kept);
+        out.resize(kept);
+    };
+    invert(results, result_offsets, producer_offsets, producers);
+    invert(ingredients, ingredient_offsets, consumer_offsets, consumers);
+
+    timer.stop();
+    timer.print("build production graph");
+    fprintf(stderr, "production graph: %zu recipes, %zu nodes, %zu ingredients, %zu results\n", recipes.size(), nodes.size(), ingredients.size(), results.size());
+}
+
+
+void RawCost::compute(const ProductionGraph& graph, unsigned threads)
+{
+    using Amount = ProductionGraph::Amount;
+
+    prof timer;
+    timer.start();
+
+    const uint32_t count = uint32_t(graph.nodes.size());
+
+    // The recipes a node can be costed through, in the order they're tried: ones making more of it than they use, the one
+    // named after it first
+    struct Candidate
+    {
+        uint32_t recipe;
+        double yield;
+    };
+    std::vector<uint32_t> candidate_offsets(1, 0);
+    std::vector<Candidate> candidates;
+    // What those recipes use, the edges of the graph the components are found in
+    std::vector<uint32_t> edge_offsets(1, 0);
+    std::vector<uint32_t> edges;
+    for (uint32_t node = 0; node < count; node++)
+    {
+        const size_t first = candidates.size();
+        for (uint32_t recipe : graph.producers_of(node))
+        {
+            if (!graph.recipes[recipe].decomposable)
+                continue;
+            double yield = 0;
+            for (const Amount& result : graph.results_of(recipe))
+                yield += result.node == node ? result.amount : 0;
+            for (const Amount& ingredient : graph.ingredients_of(recipe))
+                yield -= ingredient.node == node ? ingredient.amount : 0;
+            if (yield <= 0)
+                continue;
+            candidates.push_back({ recipe, yield });
+            for (const Amount& ingredient : graph.ingredients_of(recipe))
+            {
+                if (ingredient.node != node)
+                    edges.push_back(ingredient.node);
+            }
+        }
+        std::stable_partition(candidates.begin() + first, candidates.end(), [&](const Candidate& candidate) {
+            return graph.recipes[candidate.recipe].name == graph.nodes[node].name;
+        });
+        candidate_offsets.push_back(uint32_t(candidates.size()));
+        edge_offsets.push_back(uint32_t(edges.size()));
+    }
+
+    // Tarjan, with an explicit stack since production chains can be long. Components are numbered as they complete, which
+    // puts everything a component uses before it.
+    const uint32_t unvisited = ~0u;
+    std::vector<uint32_t> index(count, unvisited);
+    std::vector<uint32_t> low(count);
+    std::vector<uint32_t> component(count, unvisited);
+    std::vector<uint32_t> open;
+    struct Frame
+    {
+        uint32_t node;
+        uint32_t next_edge;
+    };
+    std::vector<Frame> calls;
+    std::vector<uint32_t> member_offsets(1, 0);
+    std::vector<uint32_t> members;
+    uint32_t visited = 0;
+
+    auto enter = [&](uint32_t node) {
+        index[node] = low[node] = visited++;
+        open.push_back(node);
+        calls.push_back({ node, edge_offsets[node] });
+    };
+    for (uint32_t start = 0; start < count; start++)
+    {
+        if (index[start] != unvisited)
+            continue;
+        enter(start);
+        while (!calls.empty())
+        {
+            const uint32_t node = calls.back().node;
+            if (calls.back().next_edge < edge_offsets[node + 1])
+            {
+                const uint32_t next = edges[calls.back().next_edge++];
+                if (index[next] == unvisited)
+                    enter(next);
+                else if (component[next] == unvisited)
+                    low[node] = std::min(low[node], index[next]);
+                continue;
+            }
+
+            calls.pop_back();
+            if (!calls.empty())
+                low[calls.back().node] = std::min(low[calls.back().node], low[node]);
+            if (low[node] != index[node])
+                continue;
+
+            const uint32_t id = uint32_t(member_offsets.size() - 1);
+            const size_t first = members.size();
+            uint32_t member;
+            do
+            {
+                member = open.back();
+                open.pop_back();
+                component[member] = id;
+                members.push_back(member);
+            } while (member != node);
+            // Lowest node first, stuck loops give up on nodes in this order
+            std::sort(members.begin() + first, members.end());
+            member_offsets.push_back(uint32_t(members.size()));
+        }
+    }
+    const uint32_t components = uint32_t(member_offsets.size() - 1);
+
+    // How many components each one waits for, and which ones wait for it
+    std::vector<std::atomic<uint32_t>> pending(components);
+    std::vector<uint32_t> dependent_offsets(components + 1, 0);
+    std::vector<uint32_t> dependents;
+    {
+        std::vector<std::pair<uint32_t, uint32_t>> uses;
+        std::vector<uint32_t> seen(components, unvisited);
+        for (uint32_t id = 0; id < components; id++)
+        {
+            uint32_t waits = 0;
+            for (uint32_t i = member_offsets[id]; i < member_offsets[id + 1]; i++)
+            {
+                for (uint32_t e = edge_offsets[members[i]]; e < edge_offsets[members[i] + 1]; e++)
+                {
+                    const uint32_t used = component[edges[e]];
+                    if (used == id || seen[used] == id)
+                        continue;
+                    seen[used] = id;
+                    uses.push_back({ used, id });
+                    dependent_offsets[used + 1]++;
+                    waits++;
+                }
+            }
+            pending[id].store(waits, std::memory_order_relaxed);
+        }
+        for (size_t i = 1; i < dependent_offsets.size(); i++)
+            dependent_offsets[i] += dependent_offsets[i - 1];
+        dependents.resize(uses.size());
+        std::vector<uint32_t> fill(dependent_offsets.begin(), dependent_offsets.end() - 1);
+        for (const auto& use : uses)
+            dependents[fill[use.first]++] = use.second;
+    }
+
+    std::vector<std::vector<Amount>> costs(count);
+    std::vector<uint32_t> chosen(count, raw);
+    // Only written by the worker costing the node's component, the others only read finished components
+    std::vector<uint8_t> done(count, 0);
+    std::atomic<size_t> broken{ 0 };
+
+    // Terms are summed up in a dense array per worker, only the slots touched get looked at again. A slot belongs to the
+    // current call when its stamp says so, a sum of 0 can't tell (zero amounts, or terms cancelling out).
+    struct Scratch
+    {
+        std::vector<double> sums;
+        std::vector<uint32_t> stamps;
+        uint32_t generation = 0;
+        std::vector<uint32_t> touched;
+    };
+    auto cost_through = [&](uint32_t node, const Candidate& candidate, Scratch& scratch) {
+        if (scratch.sums.empty())
+        {
+            scratch.sums.assign(count, 0);
+            scratch.stamps.assign(count, 0);
+        }
+        scratch.generation++;
+        scratch.touched.clear();
+        for (const Amount& ingredient : graph.ingredients_of(candidate.recipe))
+        {
+            if (ingredient.node == node)
+                continue;
+            // Catalysts: whatever of an ingredient the recipe hands back isn't used up
+            double used = ingredient.amount;
+            for (const Amount& result : graph.results_of(candidate.recipe))
+                used -= result.node == ingredient.node ? result.amount : 0;
+            if (used <= 0)
+                continue;
+            const double per_unit = used / candidate.yield;
+            for (const Amount& term : costs[ingredient.node])
+            {
+                if (scratch.stamps[term.node] != scratch.generation)
+                {
+                    scratch.stamps[term.node] = scratch.generation;
+                    scratch.sums[term.node] = 0;
+                    scratch.touched.push_back(term.node);
+                }
+                scratch.sums[term.node] += per_unit * term.amount;
+            }
+        }
+        std::sort(scratch.touched.begin(), scratch.touched.end());
+        std::vector<Amount>& cost = costs[node];
+        cost.clear();
+        cost.reserve(scratch.touched.size());
+        for (uint32_t raw_node : scratch.touched)
+            cost.push_back({ raw_node, scratch.sums[raw_node] });
+        chosen[node] = candidate.recipe;
+        done[node] = 1;
+    };
+    auto make_raw = [&](uint32_t node) {
+        costs[node].assign(1, Amount{ node, 1 });
+        done[node] = 1;
+    };
+
+    auto solve = [&](uint32_t id, Scratch& scratch) {
+        // Keep costing whatever the loop can already make, and when that's nothing give up on the first node left
+        size_t left = member_offsets[id + 1] - member_offsets[id];
+        while (left)
+        {
+            bool progress = false;
+            for (uint32_t i = member_offsets[id]; i < member_offsets[id + 1]; i++)
+            {
+                const uint32_t node = members[i];
+                if (done[node])
+                    continue;
+                for (uint32_t c = candidate_offsets[node]; c < candidate_offsets[node + 1]; c++)
+                {
+                    const auto& used = graph.ingredients_of(candidates[c].recipe);
+                    if (std::all_of(used.begin(), used.end(), [&](const Amount& a) { return a.node == node || done[a.node]; }))
+                    {
+                        cost_through(node, candidates[c], scratch);
+                        break;
+                    }
+                }
+                if (!done[node] && candidate_offsets[node] == candidate_offsets[node + 1])
+                    make_raw(node);
+                if (done[node])
+                {
+                    progress = true;
+                    left--;
+                }
+            }
+            if (!progress)
+            {
+                // Preferably a node made of nothing but what the loop can't make yet (the water of a barrelling loop),
+                // rather than one that also takes something from outside or already costed (the filled barrel)
+                auto only_from_loop = [&](uint32_t node) {
+                    for (uint32_t c = candidate_offsets[node]; c < candidate_offsets[node + 1]; c++)
+                    {
+                        for (const Amount& ingredient : graph.ingredients_of(candidates[c].recipe))
+                        {
+                            if (component[ingredient.node] != id || done[ingredient.node])
+                                return false;
+                        }
+                    }
+                    return true;
+                };
+                uint32_t give_up = unvisited;
+                for (uint32_t i = member_offsets[id]; i < member_offsets[id + 1]; i++)
+                {
+                    const uint32_t node = members[i];
+                    if (done[node])
+                        continue;
+                    if (give_up == unvisited)
+                        give_up = node;
+                    if (only_from_loop(node))
+                    {
+                        give_up = node;
+                        break;
+                    }
+                }
+                make_raw(give_up);
+                broken++;
+                left--;
+            }
+        }
+    };
+
+    // Components that don't wait for anything start out ready, finishing one may make its dependents ready. A worker keeps
+    // one of those for itself instead of going through the queue.
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<uint32_t> ready;
+    size_t finished = 0;
+    for (uint32_t id = 0; id < components; id++)
+    {
+        if (pending[id].load(std::memory_order_relaxed) == 0)
+            ready.push_back(id);
+    }
+
+    auto worker = [&]() {
+        Scratch scratch;
+        std::vector<uint32_t> unlocked;
+        uint32_t id = unvisited;
+        while (true)
+        {
+            if (id == unvisited)
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [&] { return !ready.empty() || finished == components; });
+                if (ready.empty())
+                    return;
+                id = ready.back();
+                ready.pop_back();
+            }
+
+            solve(id, scratch);
+            unlocked.clear();
+            for (uint32_t i = dependent_offsets[id]; i < dependent_offsets[id + 1]; i++)
+            {
+                if (pending[dependents[i]].fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    unlocked.push_back(dependents[i]);
+            }
+
+            id = unlocked.empty() ? unvisited : unlocked.back();
+            bool all_done;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (!unlocked.empty())
+                    ready.insert(ready.end(), unlocked.begin(), unlocked.end() - 1);
+                all_done = ++finished == components;
+            }
+            if (all_done || unlocked.size() > 1)
+                wake.notify_all();
+        }
+    };
+
+    threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max(1u, std::min(threads, components));
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool)
+        thread.join();
+
+    recipe = std::move(chosen);
+    size_t total = 0;
+    for (const std::vector<Amount>& cost : costs)
+        total += cost.size();
+    offsets.assign(1, 0);
+    offsets.reserve(count + 1);
+    terms.clear();
+    terms.reserve(total);
+    size_t raw_nodes = 0;
+    for (uint32_t node = 0; node < count; node++)
+    {
+        terms.insert(terms.end(), costs[node].begin(), costs[node].end());
+        offsets.push_back(uint32_t(terms.size()));
+        raw_nodes += recipe[node] == raw;
+    }
+    loops_broken = broken;
+
+    timer.stop();
+    timer.print("compute raw cost");
+    fprintf(stderr, "raw cost: %u nodes in %u components, %zu raw, %zu loops broken\n", count, components, raw_nodes, loops_broken);
+}
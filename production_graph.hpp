@@ -0,0 +1,134 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <bytell_hash_map.hpp>
+
+#include "fobject.hpp"
+
+//data.raw.recipe compiled into a graph: items and fluids are the nodes, every recipe is a hyperedge from its ingredients to
+//its results. Relations are stored CSR style, one flat array per relation with element i's part at
+//[offsets[i], offsets[i + 1]).
+struct ProductionGraph
+{
+    //Recipes with normal/expensive tables use the one asked for, or the other one if it isn't there
+    enum class Difficulty { normal, expensive, };
+
+    struct Node
+    {
+        FString name;
+        bool fluid;
+    };
+
+    struct Amount
+    {
+        uint32_t node;
+        //Expected amount: a result's probability and amount_min/amount_max are already figured in
+        double amount;
+    };
+
+    struct Recipe
+    {
+        FString name;
+        double energy;
+        //allow_decomposition = false (barrelling, kovarex...), RawCost doesn't look through these
+        bool decomposable;
+    };
+
+    template<typename T>
+    struct Span
+    {
+        const T* first = nullptr;
+        const T* last = nullptr;
+
+        const T* begin() const { return first; }
+        const T* end() const { return last; }
+        size_t size() const { return size_t(last - first); }
+        bool empty() const { return first == last; }
+    };
+
+    static constexpr uint32_t npos = ~0u;
+
+    //In the order they first show up in the recipes, which are in data.raw order
+    std::vector<Node> nodes;
+    std::vector<Recipe> recipes;
+
+    std::vector<uint32_t> ingredient_offsets;
+    std::vector<Amount> ingredients;
+    std::vector<uint32_t> result_offsets;
+    std::vector<Amount> results;
+    //Per node, ascending recipe ids
+    std::vector<uint32_t> producer_offsets;
+    std::vector<uint32_t> producers;
+    std::vector<uint32_t> consumer_offsets;
+    std::vector<uint32_t> consumers;
+
+    //Recipes that aren't available at this difficulty (normal = false) are left out
+    void build(const FObject& data_raw, Difficulty difficulty = Difficulty::normal);
+
+    Span<Amount> ingredients_of(uint32_t recipe) const { return range(ingredients, ingredient_offsets, recipe); }
+    Span<Amount> results_of(uint32_t recipe) const { return range(results, result_offsets, recipe); }
+    Span<uint32_t> producers_of(uint32_t node) const { return range(producers, producer_offsets, node); }
+    Span<uint32_t> consumers_of(uint32_t node) const { return range(consumers, consumer_offsets, node); }
+
+    uint32_t find(std::string_view name, bool fluid = false) const
+    {
+        auto it = by_name[fluid].find(name);
+        return it == by_name[fluid].end() ? npos : it->second;
+    }
+
+    //"item/iron-plate", "fluid/water"
+    std::string node_name(uint32_t node) const
+    {
+        return fmt::format("{0}/{1}", nodes[node].fluid ? "fluid" : "item", nodes[node].name.view());
+    }
+
+private:
+    //Items, then fluids, since the two can share a name. Keyed by the contents (views into the tree's pool), so find()
+    //doesn't need the pool
+    std::array<ska::bytell_hash_map<std::string_view, uint32_t>, 2> by_name;
+
+    template<typename T>
+    static Span<T> range(const std::vector<T>& items, const std::vector<uint32_t>& offsets, uint32_t i)
+    {
+        return Span<T>{ items.data() + offsets[i], items.data() + offsets[i + 1] };
+    }
+
+    uint32_t node(FString name, bool fluid);
+};
+
+
+//Raw resource cost of every node of a ProductionGraph: how much of the nodes nothing (decomposable) makes it takes to make
+//one of it. A node goes through one recipe, the first of the ones making it that is named after it, else the first at all,
+//that doesn't need a loop back to the node itself. The whole recipe is charged to that one result, byproducts are free, and
+//a recipe that uses some of what it makes (kovarex style) only counts what it makes on top.
+//
+//Loops are worked out a strongly connected component at a time. When none of a loop's nodes can be made without the loop
+//(sorting loops, barrelling if it were decomposable) one of them counts as raw and the rest is made from that: the first
+//one made of nothing but what the loop can't make yet, else the first one at all. Catalysts a recipe hands back aren't
+//charged for.
+//Components only wait on the ones they use, the rest are costed in parallel.
+struct RawCost
+{
+    //What recipe is for a raw node
+    static constexpr uint32_t raw = ~0u;
+
+    //The recipe each node's cost goes through
+    std::vector<uint32_t> recipe;
+    std::vector<uint32_t> offsets;
+    //Raw nodes and how much of each, by ascending node
+    std::vector<ProductionGraph::Amount> terms;
+    //Raw only because of a loop, they do have a recipe
+    size_t loops_broken = 0;
+
+    //0 threads is one per hardware thread
+    void compute(const ProductionGraph& graph, unsigned threads = 0);
+
+    ProductionGraph::Span<ProductionGraph::Amount> of(uint32_t node) const
+    {
+        return { terms.data() + offsets[node], terms.data() + offsets[node + 1] };
+    }
+};
@@ -0,0 +1,222 @@
+#include "reference_index.hpp"
+
+#include <atomic>
+#include <deque>
+#include <thread>
+
+// The bits of an entry build_from needs, for either tree
+static bool string_of(const FValue& value, std::string_view& out)
+{
+    const FString* str = value.as<FString>();
+    if (str)
+        out = str->view();
+    return str;
+}
+static bool string_of(const FrozenValue& value, std::string_view& out)
+{
+    out = value.str();
+    return value.is_string();
+}
+static std::string_view key_of(const FKeyValue& entry) { return entry.key.view(); }
+static std::string_view key_of(const FrozenKeyValue& entry) { return entry.key; }
+// Without materializing a stub, that's up to whichever thread gets the type
+static const FObject* table_of(const FValue& value)
+{
+    const FObject* const* table = value.as<FObject*>();
+    return table ? *table : nullptr;
+}
+static FrozenObject table_of(const FrozenValue& value) { return value.is_table() ? value.obj() : FrozenObject(); }
+static const FObject& walked(const FObject* table) { return *table; }
+static const FrozenObject& walked(const FrozenObject& table) { return table; }
+
+void ReferenceIndex::build(const FObject& data_raw, unsigned threads)
+{
+    build_from<FWalker>(data_raw, threads);
+}
+
+void ReferenceIndex::build(const FrozenObject& data_raw, unsigned threads)
+{
+    build_from<FrozenWalker>(data_raw, threads);
+}
+
+template<typename Walker, typename Object>
+void ReferenceIndex::build_from(const Object& data_raw, unsigned threads)
+{
+    prof timer;
+    timer.start();
+
+    prototypes.clear();
+    paths.clear();
+    sites.clear();
+    by_value.clear();
+
+    struct Type
+    {
+        uint32_t first;
+        uint32_t count;
+    };
+    std::vector<Type> types;
+    // const FObject* or FrozenObject, whatever table_of gives for this tree
+    std::vector<decltype(table_of(data_raw.child("")))> tables;
+
+    Walker walker;
+    std::string_view type_name;
+    walker.walk(data_raw, [&](int dir, const auto& entry, const FPath& path) {
+        if (dir < 0)
+            return FObject::visit_result::CONTINUE;
+        if (path.depth() == 1)
+        {
+            type_name = key_of(entry);
+            types.push_back({ uint32_t(prototypes.size()), 0 });
+            return FObject::visit_result::DESCEND;
+        }
+        if (const auto table = table_of(entry.value); table)
+        {
+            prototypes.push_back({ type_name, key_of(entry) });
+            tables.push_back(table);
+            types.back().count++;
+        }
+        return FObject::visit_result::CONTINUE;
+    }, 2);
+
+    struct Entry
+    {
+        std::string_view value;
+        uint32_t prototype;
+        uint32_t path;
+    };
+    //What one type adds. Its paths are numbered on their own until they're merged, a deque so the views into it stay put
+    struct Part
+    {
+        std::vector<Entry> entries;
+        std::deque<std::string> paths;
+    };
+    std::vector<Part> parts(types.size());
+
+    // Types vary a lot in size (a handful of recipes against thousands), so workers pull the next one off a counter
+    std::atomic<size_t> next_type{ 0 };
+    auto worker = [&]() {
+        Walker fields;
+        ska::bytell_hash_map<std::string_view, uint32_t> path_ids;
+        for (size_t type = next_type++; type < types.size(); type = next_type++)
+        {
+            Part& part = parts[type];
+            path_ids.clear();
+            for (uint32_t prototype = types[type].first; prototype < types[type].first + types[type].count; prototype++)
+            {
+                fields.path.reset({});
+                fields.walk(walked(tables[prototype]), [&](int dir, const auto& field, const FPath& path) {
+                    if (dir != 0)
+                        return FObject::visit_result::DESCEND;
+                    std::string_view value;
+                    if (!string_of(field.value, value))
+                        return FObject::visit_result::CONTINUE;
+                    if (path.depth() == 1 && ((key_of(field) == "name" && value == prototypes[prototype].name) ||
+                                              (key_of(field) == "type" && value == prototypes[prototype].type)))
+                        return FObject::visit_result::CONTINUE;
+
+                    // The walk's root is empty, so every path starts with the separator
+                    const std::string_view below = path.view().substr(1);
+                    auto it = path_ids.find(below);
+                    if (it == path_ids.end())
+                    {
+                        part.paths.emplace_back(below);
+                        it = path_ids.emplace(std::string_view(part.paths.back()), uint32_t(part.paths.size() - 1)).first;
+                    }
+                    part.entries.push_back({ value, prototype, it->second });
+                    return FObject::visit_result::CONTINUE;
+                });
+            }
+        }
+    };
+
+    threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max(1u, std::min(threads, unsigned(types.size())));
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool)
+        thread.join();
+
+    // Merged in type order, so every value's sites come out in tree order however the types were split up
+    ska::bytell_hash_map<std::string_view, uint32_t> path_ids;
+    std::vector<uint32_t> renumber;
+    size_t total = 0;
+    for (Part& part : parts)
+    {
+        renumber.resize(part.paths.size());
+        for (size_t i = 0; i < part.paths.size(); i++)
+        {
+            auto added = path_ids.emplace(std::string_view(part.paths[i]), uint32_t(paths.size()));
+            if (added.second)
+                paths.push_back(part.paths[i]);
+            renumber[i] = added.first->second;
+        }
+        for (Entry& entry : part.entries)
+        {
+            entry.path = renumber[entry.path];
+            by_value[entry.value].count++;
+        }
+        total += part.entries.size();
+    }
+
+    sites.resize(total);
+    size_t offset = 0;
+    for (auto& value : by_value)
+    {
+        value.second.first = sites.data() + offset;
+        offset += value.second.count;
+        value.second.count = 0;
+    }
+    for (const Part& part : parts)
+    {
+        for (const Entry& entry : part.entries)
+        {
+            Uses& uses = by_value[entry.value];
+            sites[size_t(uses.first - sites.data()) + uses.count++] = Site{ entry.prototype, entry.path };
+        }
+    }
+
+    timer.stop();
+    timer.print("build reference index");
+    fprintf(stderr, "reference index: %zu prototypes, %zu values, %zu sites, %zu paths\n", prototypes.size(), by_value.size(), sites.size(), paths.size());
+}
+
+
+BackgroundReferences::BackgroundReferences(const FObject& data_raw, bool build_on_worker, unsigned threads)
+{
+    if (!build_on_worker)
+    {
+        lazy = &data_raw;
+        return;
+    }
+    worker = std::thread([this, &data_raw, threads] {
+        references.build(data_raw, threads);
+        ready = true;
+    });
+}
+
+BackgroundReferences::BackgroundReferences(const FrozenObject& data_raw, unsigned threads)
+{
+    worker = std::thread([this, data_raw, threads] {
+        references.build(data_raw, threads);
+        ready = true;
+    });
+}
+
+BackgroundReferences::~BackgroundReferences()
+{
+    if (worker.joinable())
+        worker.join();
+}
+
+const ReferenceIndex* BackgroundReferences::index()
+{
+    if (!ready && lazy)
+    {
+        references.build(*lazy, 1);
+        ready = true;
+    }
+    return ready ? &references : nullptr;
+}
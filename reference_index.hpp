@@ -0,0 +1,107 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <bytell_hash_map.hpp>
+
+#include "fobject.hpp"
+#include "frozen.hpp"
+
+//Where every string value in data.raw is used, the back-links FObject doesn't have: "iron-plate" -> the recipe
+//ingredients, technology unlocks, minable results and so on that name it. A site is a prototype and the path below it
+//the value sits at. The sites of a value are one contiguous run of sites, so a lookup is a single hash probe.
+//
+//A prototype's own "name" and "type" aren't sites, they only repeat where it is in data.raw.
+struct ReferenceIndex
+{
+    //Views into the tree's strings, like the keys of by_value
+    struct Prototype
+    {
+        std::string_view type;
+        std::string_view name;
+    };
+
+    struct Site
+    {
+        uint32_t prototype;
+        uint32_t path;
+    };
+
+    struct Uses
+    {
+        const Site* first = nullptr;
+        size_t count = 0;
+
+        const Site* begin() const { return first; }
+        const Site* end() const { return first + count; }
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+    };
+
+    //data.raw's prototypes in tree order
+    std::vector<Prototype> prototypes;
+    //Below the prototype, "ingredients/1/1". Every distinct one is stored once
+    std::vector<std::string> paths;
+    //Grouped by value, in tree order within a value
+    std::vector<Site> sites;
+    //Value -> its run in sites. Keyed by the contents (views into the tree's pool, or the frozen buffer), so a lookup
+    //doesn't need the pool
+    ska::bytell_hash_map<std::string_view, Uses> by_value;
+
+    ReferenceIndex() = default;
+    //by_value points into sites
+    ReferenceIndex(const ReferenceIndex& copy) = delete;
+
+    //Prototype types are spread over threads, 0 is one per hardware thread. More than one needs a fully converted tree
+    //(no lazy stubs), see SearchIndex::build
+    void build(const FObject& data_raw, unsigned threads = 0);
+    //Same index from the frozen copy, which any thread can read. The tree has to stay mapped while the index is used
+    void build(const FrozenObject& data_raw, unsigned threads = 0);
+
+    //Sites of value, in tree order. Nothing for a string that isn't in data.raw at all
+    Uses uses(std::string_view value) const
+    {
+        auto it = by_value.find(value);
+        return it == by_value.end() ? Uses{} : it->second;
+    }
+
+    //"recipe/iron-gear-wheel/ingredients/1/1"
+    std::string path_of(const Site& site) const
+    {
+        const Prototype& prototype = prototypes[site.prototype];
+        return fmt::format("{0}/{1}/{2}", prototype.type, prototype.name, paths[site.path]);
+    }
+
+private:
+    template<typename Walker, typename Object>
+    void build_from(const Object& data_raw, unsigned threads);
+};
+
+
+//Builds a ReferenceIndex on a thread of its own once data.raw is loaded, so the tree shows (and can be browsed) while
+//it runs. Like BackgroundSearch it can only do that for a fully converted or a frozen tree, a lazy one is built on the
+//calling thread the first time index() is asked for.
+struct BackgroundReferences
+{
+    //threads is passed on to ReferenceIndex::build, a lazy tree is always built on one
+    BackgroundReferences(const FObject& data_raw, bool build_on_worker = true, unsigned threads = 0);
+    //Always builds on the worker, the frozen tree has to stay mapped for as long as this lives
+    BackgroundReferences(const FrozenObject& data_raw, unsigned threads = 0);
+    BackgroundReferences(const BackgroundReferences& copy) = delete;
+    //Waits for a build that is still running, it can't be stopped halfway
+    ~BackgroundReferences();
+
+    //nullptr while the worker is still building
+    const ReferenceIndex* index();
+
+private:
+    //Only kept for a build on first use
+    const FObject* lazy = nullptr;
+    ReferenceIndex references;
+    std::thread worker;
+    std::atomic<bool> ready{ false };
+};
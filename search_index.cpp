@@ -0,0 +1,243 @@
+#include "search_index.hpp"
+
+#include <algorithm>
+
+static uint8_t lower(char c)
+{
+    return uint8_t((c >= 'A' && c <= 'Z') ? c | 0x20 : c);
+}
+
+static uint32_t trigram(const char* at)
+{
+    return uint32_t(lower(at[0])) | uint32_t(lower(at[1])) << 8 | uint32_t(lower(at[2])) << 16;
+}
+
+// The bits of an entry build_from needs, for either tree
+static std::string_view key_of(const FKeyValue& entry) { return entry.key.view(); }
+static std::string_view key_of(const FrozenKeyValue& entry) { return entry.key; }
+static bool string_of(const FValue& value, std::string_view& out)
+{
+    const FString* str = value.as<FString>();
+    if (str)
+        out = str->view();
+    return str;
+}
+static bool string_of(const FrozenValue& value, std::string_view& out)
+{
+    out = value.str();
+    return value.is_string();
+}
+
+void SearchIndex::build(const FObject& data_raw)
+{
+    build_from<FWalker>(data_raw);
+}
+
+void SearchIndex::build(const FrozenObject& data_raw)
+{
+    build_from<FrozenWalker>(data_raw);
+}
+
+template<typename Walker, typename Object>
+void SearchIndex::build_from(const Object& data_raw)
+{
+    prof timer;
+    timer.start();
+
+    Walker walker("data/raw");
+    Walker fields;
+    // Keys and values are interned (or stored once in the frozen pool), so where one starts is enough to only add each
+    // once per document. Not for empty ones, which can start where the next frozen string does (and match nothing)
+    ska::bytell_hash_set<const char*> seen;
+
+    auto add_field = [&](std::string_view field) {
+        if (field.empty() || !seen.insert(field.data()).second)
+            return;
+        text += field;
+        text += '\0';
+    };
+
+    auto open = [&](std::string_view path) {
+        const uint32_t document = uint32_t(documents.size());
+        documents.push_back(Document{ uint32_t(text.size()), 0, uint32_t(path.size()), document, 0 });
+        text += path;
+        text += '\0';
+        seen.clear();
+        return document;
+    };
+    auto close = [&](uint32_t document) {
+        documents[document].length = uint32_t(text.size()) - documents[document].offset;
+    };
+
+    uint32_t type = 0;
+    walker.walk(data_raw, [&](int dir, const auto& entry, const FPath& path) {
+        if (dir < 0 || path.depth() > 2)
+            return FObject::visit_result::CONTINUE;
+
+        const uint32_t document = open(path.view());
+        if (path.depth() == 1)
+        {
+            type = document;
+            close(document);
+            return FObject::visit_result::DESCEND;
+        }
+
+        documents[document].type = type;
+        documents[type].prototypes++;
+        if (dir > 0)
+        {
+            fields.walk(entry.value.obj(), [&](int dir, const auto& field, const FPath&) {
+                std::string_view value;
+                if (dir >= 0)
+                    add_field(key_of(field));
+                if (string_of(field.value, value))
+                    add_field(value);
+                return FObject::visit_result::DESCEND;
+            });
+        }
+        else if (std::string_view value; string_of(entry.value, value))
+        {
+            add_field(value);
+        }
+        close(document);
+        return FObject::visit_result::CONTINUE;
+    }, 2);
+
+    // Each document adds itself once per distinct trigram, in order, so the posting lists come out sorted
+    std::vector<uint32_t> grams;
+    for (uint32_t document = 0; document < documents.size(); document++)
+    {
+        const std::string_view content = document_text(document);
+        grams.clear();
+        for (size_t i = 0; i + 3 <= content.size(); i++)
+        {
+            if (content[i] && content[i + 1] && content[i + 2])
+                grams.push_back(trigram(content.data() + i));
+        }
+        std::sort(grams.begin(), grams.end());
+        grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+        for (uint32_t gram : grams)
+            postings[gram].push_back(document);
+
+        by_path.emplace(path(document), document);
+    }
+
+    timer.stop();
+    timer.print("build search index");
+    fprintf(stderr, "search index: %zu documents, %zu bytes of text, %zu trigrams\n", documents.size(), text.size(), postings.size());
+}
+
+bool SearchIndex::candidates_for(std::string_view query, std::vector<uint32_t>& out) const
+{
+    out.clear();
+    if (query.size() < 3)
+    {
+        out.resize(documents.size());
+        for (uint32_t i = 0; i < out.size(); i++)
+            out[i] = i;
+        return true;
+    }
+
+    std::vector<const std::vector<uint32_t>*> lists;
+    for (size_t i = 0; i + 3 <= query.size(); i++)
+    {
+        auto it = postings.find(trigram(query.data() + i));
+        if (it == postings.end())
+            return false;
+        lists.push_back(&it->second);
+    }
+    // Rarest first, every intersection can only shrink the candidates
+    std::sort(lists.begin(), lists.end(), [](const auto* a, const auto* b) { return a->size() < b->size(); });
+
+    out = *lists[0];
+    std::vector<uint32_t> next;
+    for (size_t i = 1; i < lists.size() && !out.empty(); i++)
+    {
+        next.clear();
+        std::set_intersection(out.begin(), out.end(), lists[i]->begin(), lists[i]->end(), std::back_inserter(next));
+        out.swap(next);
+    }
+    return !out.empty();
+}
+
+
+BackgroundSearch::BackgroundSearch(const FObject& data_raw, bool build_on_worker)
+{
+    if (!build_on_worker)
+        search_index.build(data_raw);
+    worker = std::thread([this, &data_raw, build_on_worker] {
+        if (build_on_worker)
+            search_index.build(data_raw);
+        run();
+    });
+}
+
+BackgroundSearch::BackgroundSearch(const FrozenObject& data_raw)
+{
+    worker = std::thread([this, data_raw] {
+        search_index.build(data_raw);
+        run();
+    });
+}
+
+BackgroundSearch::~BackgroundSearch()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+        generation++;
+    }
+    wake.notify_one();
+    worker.join();
+}
+
+void BackgroundSearch::submit(std::string query, bool ignore_case)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending = std::move(query);
+        pending_ignore_case = ignore_case;
+        generation++;
+    }
+    wake.notify_one();
+}
+
+bool BackgroundSearch::take(SearchIndex::Result& out)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (finished != generation || finished == taken)
+        return false;
+    taken = finished;
+    out = std::move(result);
+    return true;
+}
+
+void BackgroundSearch::run()
+{
+    SearchIndex::Result working;
+    std::string query;
+    bool ignore_case = false;
+    while (true)
+    {
+        uint64_t mine;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this] { return stop || started != generation; });
+            if (stop)
+                return;
+            mine = started = generation;
+            query = pending;
+            ignore_case = pending_ignore_case;
+        }
+
+        if (!search_index.query(query, working, [&] { return generation != mine; }, ignore_case))
+            continue;
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (generation == mine)
+        {
+            result = std::move(working);
+            finished = mine;
+        }
+    }
+}
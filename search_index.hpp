@@ -0,0 +1,202 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <bytell_hash_map.hpp>
+
+#include "fobject.hpp"
+#include "frozen.hpp"
+#include "substring_scan.hpp"
+
+//Substring search over data.raw for the browser's filter. Every prototype type and every prototype is a document whose
+//text is its path ("data/raw/recipe/iron-plate") and, for prototypes, every key and string value below it. Queries look
+//up the trigrams of the query text, intersect their posting lists and only run a real find over the documents left. When
+//that leaves too many (or the query is too short to have a trigram) the whole of text gets scanned in one go instead.
+//Trigrams are folded to lower case, so the same postings serve case sensitive and insensitive queries.
+struct SearchIndex
+{
+    struct Document
+    {
+        //Text is text[offset, offset + length), the path comes first. Fields end in '\0' so a match can't run across two.
+        uint32_t offset;
+        uint32_t length;
+        uint32_t path_length;
+        //The type's document for a prototype. A type is followed by its prototypes, for a type this is how many there are
+        uint32_t type;
+        uint32_t prototypes;
+    };
+
+    //Types in tree order, each followed by its prototypes
+    std::vector<Document> documents;
+    std::string text;
+    //Three bytes of text packed into a uint32_t -> the documents that contain them, ascending
+    ska::bytell_hash_map<uint32_t, std::vector<uint32_t>> postings;
+    ska::bytell_hash_map<std::string_view, uint32_t> by_path;
+
+    static constexpr uint32_t npos = ~0u;
+
+    //What a query found, for every document how it should show
+    struct Result
+    {
+        enum visibility : uint8_t
+        {
+            hidden,
+            //It or its type matches
+            shown,
+            //Only some of its prototypes match, it should be expanded to show them
+            opened,
+        };
+
+        //An empty query, everything shows
+        bool all = true;
+        std::vector<visibility> documents;
+
+        visibility of(uint32_t document) const { return all ? shown : document == npos ? hidden : documents[document]; }
+    };
+
+    SearchIndex() = default;
+    //by_path points into text
+    SearchIndex(const SearchIndex& copy) = delete;
+
+    //The tree must be fully converted (no lazy stubs) if this doesn't run on the thread that owns the VM
+    void build(const FObject& data_raw);
+    //Same index from the frozen copy, which any thread can read
+    void build(const FrozenObject& data_raw);
+
+    std::string_view document_text(uint32_t document) const { return std::string_view(text).substr(documents[document].offset, documents[document].length); }
+    std::string_view path(uint32_t document) const { return document_text(document).substr(0, documents[document].path_length); }
+    uint32_t find(std::string_view path) const
+    {
+        auto it = by_path.find(path);
+        return it == by_path.end() ? npos : it->second;
+    }
+
+    //Changes whenever the set of type's prototypes that result shows does, 0 for a hidden type. Views compare these to find
+    //the expanded types they have to refill.
+    uint64_t shown_prototypes(const Result& result, uint32_t type) const
+    {
+        const Result::visibility shown = result.of(type);
+        if (shown == Result::hidden)
+            return 0;
+        if (shown == Result::shown)
+            return 1;
+        fnv1a hash;
+        hash.add(result.documents.data() + type + 1, documents[type].prototypes);
+        return hash.state | 2;
+    }
+
+    //False if cancelled() said stop before the query was done, out is garbage then
+    template<typename T>
+    bool query(std::string_view query, Result& out, T cancelled, bool ignore_case = false) const
+    {
+        out.all = query.empty();
+        out.documents.assign(out.all ? 0 : documents.size(), Result::hidden);
+        if (out.all)
+            return true;
+
+        std::vector<uint32_t> candidates;
+        if (!candidates_for(query, candidates))
+            return true;
+
+        if (candidates.size() > documents.size() / 4)
+        {
+            // Enough of the documents would need a look that one pass over the pool is cheaper than a find per document
+            size_t at = 0;
+            for (size_t hits = 0; (at = SubstringScan::find(text, query, ignore_case, at)) != SubstringScan::npos; hits++)
+            {
+                if ((hits & 1023) == 0 && cancelled())
+                    return false;
+                const uint32_t document = document_at(at);
+                mark(out, document);
+                at = documents[document].offset + documents[document].length;
+            }
+            return !cancelled();
+        }
+
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            if ((i & 1023) == 0 && cancelled())
+                return false;
+            const uint32_t document = candidates[i];
+            if (SubstringScan::contains(document_text(document), query, ignore_case))
+                mark(out, document);
+        }
+        return !cancelled();
+    }
+
+private:
+    template<typename Walker, typename Object>
+    void build_from(const Object& data_raw);
+
+    //Documents that have every trigram of query, all of them for a query too short to have one. False if none can match.
+    bool candidates_for(std::string_view query, std::vector<uint32_t>& out) const;
+
+    //The document text[offset] belongs to
+    uint32_t document_at(size_t offset) const
+    {
+        auto it = std::upper_bound(documents.begin(), documents.end(), offset, [](size_t offset, const Document& doc) { return offset < doc.offset; });
+        return uint32_t(it - documents.begin() - 1);
+    }
+
+    void mark(Result& out, uint32_t document) const
+    {
+        const Document& doc = documents[document];
+        if (doc.type == document)
+        {
+            // A matching type shows all of its prototypes
+            out.documents[document] = Result::shown;
+            std::fill(out.documents.begin() + document + 1, out.documents.begin() + document + 1 + doc.prototypes, Result::shown);
+        }
+        else if (out.documents[doc.type] != Result::shown)
+        {
+            out.documents[document] = Result::shown;
+            out.documents[doc.type] = Result::opened;
+        }
+    }
+};
+
+
+//Runs SearchIndex queries on a worker thread, which builds the index first. Only the newest query matters: submitting one
+//cancels the one running, and take() only ever hands out the result for the latest.
+struct BackgroundSearch
+{
+    //build_on_worker needs a fully converted tree, see SearchIndex::build
+    BackgroundSearch(const FObject& data_raw, bool build_on_worker = true);
+    //Always builds on the worker, the frozen tree has to stay mapped for as long as this lives
+    BackgroundSearch(const FrozenObject& data_raw);
+    BackgroundSearch(const BackgroundSearch& copy) = delete;
+    ~BackgroundSearch();
+
+    void submit(std::string query, bool ignore_case = false);
+
+    //True once per submitted query when its result is ready (and no newer query was submitted since), with the result in out
+    bool take(SearchIndex::Result& out);
+
+    //Only to be used once take() returned true, the worker is done writing it by then
+    const SearchIndex& index() const { return search_index; }
+
+private:
+    SearchIndex search_index;
+    std::thread worker;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::string pending;
+    bool pending_ignore_case = false;
+    bool stop = false;
+    //Bumped by every submit, the worker checks it to see if what it's running is still wanted
+    std::atomic<uint64_t> generation{ 0 };
+    uint64_t started = 0;
+    uint64_t finished = 0;
+    uint64_t taken = 0;
+    SearchIndex::Result result;
+
+    void run();
+};
@@ -0,0 +1,446 @@
+#include "snapshot.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#include "vm.hpp"
+
+enum class value_tag : uint8_t
+{
+    nil,
+    table,
+    string,
+    uint,
+    number,
+    bool_false,
+    bool_true,
+};
+
+static void hash_file_stamp(fnv1a& hash, const fs::path& path)
+{
+    std::error_code ec;
+    uint64_t size = fs::file_size(path, ec);
+    if (ec) size = ~0ull;
+    int64_t mtime = int64_t(fs::last_write_time(path, ec).time_since_epoch().count());
+    if (ec) mtime = -1;
+
+    hash.add(ws2s(path.wstring()));
+    hash.add_pod(size);
+    hash.add_pod(mtime);
+}
+
+uint64_t Snapshot::fingerprint(const VM& vm)
+{
+    fnv1a hash;
+    hash.add_pod(version);
+    hash.add(ws2s(vm.game_dir.wstring()));
+
+    std::vector<const std::string*> scripts;
+    scripts.reserve(vm.script_path_to_mod_path.size());
+    for (auto& entry : vm.script_path_to_mod_path)
+        scripts.push_back(&entry.first);
+    std::sort(scripts.begin(), scripts.end(), [](auto a, auto b) { return *a < *b; });
+
+    for (const std::string* script : scripts)
+        hash_file_stamp(hash, *script);
+
+    std::vector<const Mod*> mods;
+    for (auto& entry : vm.mod_name_to_mod)
+    {
+        // missing optional dependencies leave null entries behind
+        if (entry.second)
+            mods.push_back(entry.second);
+    }
+    std::sort(mods.begin(), mods.end(), [](auto a, auto b) { return a->name < b->name; });
+
+    for (const Mod* mod : mods)
+    {
+        hash.add(mod->name);
+        // Scripts inside a zip have no stamp of their own, the zip's covers all of them
+        if (mod->archive)
+        {
+            hash_file_stamp(hash, mod->path);
+            continue;
+        }
+        const fs::path info = mod->path / "info.json";
+        if (fs::exists(info))
+        {
+            auto contents = load_file_contents(ws2s(info.wstring()));
+            hash.add(std::string_view(contents.data(), contents.size()));
+        }
+    }
+
+    // Not mod files, but they run before the data stage all the same
+    hash_file_stamp(hash, vm.cwd / "bootstrap.lua");
+    hash_file_stamp(hash, vm.cwd / "serpent.lua");
+
+    return hash.value();
+}
+
+
+struct snapshot_writer
+{
+    std::vector<char> tree;
+    std::vector<char> strings;
+    uint64_t string_count = 0;
+    ska::bytell_hash_map<const std::string*, uint64_t> string_ids;
+
+    static void put_varint(std::vector<char>& out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(char(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(char(value));
+    }
+
+    void put_string(FString str)
+    {
+        auto [it, added] = string_ids.emplace(str.str, string_count);
+        if (added)
+        {
+            string_count++;
+            put_varint(strings, str.get().size());
+            strings.insert(strings.end(), str.get().begin(), str.get().end());
+        }
+        put_varint(tree, it->second);
+    }
+
+    void put_double(double value)
+    {
+        char bytes[sizeof(double)];
+        memcpy(bytes, &value, sizeof(double));
+        tree.insert(tree.end(), bytes, bytes + sizeof(double));
+    }
+
+    void put_value(const FValue& value)
+    {
+        std::visit(overloaded{
+            [&](std::monostate) { tree.push_back(char(value_tag::nil)); },
+            [&](bool value) { tree.push_back(char(value ? value_tag::bool_true : value_tag::bool_false)); },
+            [&](uint64_t value) { tree.push_back(char(value_tag::uint)); put_varint(tree, value); },
+            [&](double value) { tree.push_back(char(value_tag::number)); put_double(value); },
+            [&](FString value) { tree.push_back(char(value_tag::string)); put_string(value); },
+            [&](FObject*) { tree.push_back(char(value_tag::table)); put_object(value.obj()); },
+        }, value.data);
+    }
+
+    // Array part first (count, then its kind and the elements as they are stored), then the children
+    void put_object(const FObject& obj)
+    {
+        const FArray& array = obj.array;
+        put_varint(tree, array.size());
+        if (!array.empty())
+        {
+            tree.push_back(char(array.kind));
+            for (size_t i = 0; i < array.size(); i++)
+            {
+                switch (array.kind)
+                {
+                    case FArray::Kind::ints: put_varint(tree, (uint64_t(array.ints()[i]) << 1) ^ uint64_t(array.ints()[i] >> 63)); break;
+                    case FArray::Kind::doubles: put_double(array.doubles()[i]); break;
+                    default: put_value(array.values()[i]);
+                }
+            }
+        }
+
+        put_varint(tree, obj.children.size());
+        for (const FKeyValue& kv : obj.children)
+        {
+            put_string(kv.key);
+            put_value(kv.value);
+        }
+    }
+};
+
+struct snapshot_reader
+{
+    const char* at;
+    const char* end;
+    Arena& arena;
+    StringPool& pool;
+    std::vector<FString> strings;
+
+    snapshot_reader(const char* begin, const char* end, Arena& arena, StringPool& pool) : at(begin), end(end), arena(arena), pool(pool) {}
+
+    void need(size_t bytes)
+    {
+        if (size_t(end - at) < bytes)
+            throw std::runtime_error("snapshot truncated");
+    }
+
+    uint64_t get_varint()
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            need(1);
+            uint8_t byte = uint8_t(*at++);
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+        throw std::runtime_error("snapshot varint overflow");
+    }
+
+    FString get_string()
+    {
+        uint64_t id = get_varint();
+        if (id >= strings.size())
+            throw std::runtime_error("snapshot string index out of range");
+        return strings[id];
+    }
+
+    void get_strings()
+    {
+        uint64_t count = get_varint();
+        strings.reserve(size_t(std::min<uint64_t>(count, uint64_t(end - at))));
+        for (uint64_t i = 0; i < count; i++)
+        {
+            uint64_t len = get_varint();
+            need(size_t(len));
+            strings.push_back(FString::intern(pool, std::string_view(at, size_t(len))));
+            at += len;
+        }
+    }
+
+    double get_double()
+    {
+        need(sizeof(double));
+        double value;
+        memcpy(&value, at, sizeof(double));
+        at += sizeof(double);
+        return value;
+    }
+
+    FValue get_value()
+    {
+        need(1);
+        switch (value_tag(*at++))
+        {
+            case value_tag::nil: return FValue();
+            case value_tag::bool_false: return false;
+            case value_tag::bool_true: return true;
+            case value_tag::uint: return get_varint();
+            case value_tag::number: return get_double();
+            case value_tag::string: return get_string();
+            case value_tag::table: return get_object();
+            default: throw std::runtime_error("snapshot has an unknown value tag");
+        }
+    }
+
+    FObject* get_object()
+    {
+        FObject* obj = arena.make<FObject>();
+
+        uint64_t array_count = get_varint();
+        if (array_count)
+        {
+            // Every element takes at least one byte, which bounds the allocation for a corrupt count
+            need(size_t(array_count) + 1);
+            FArray& array = obj->array;
+            array.count = uint32_t(array_count);
+            array.kind = FArray::Kind(*at++);
+            switch (array.kind)
+            {
+                case FArray::Kind::ints:
+                {
+                    int64_t* ints = arena.make_array<int64_t>(size_t(array_count));
+                    for (uint64_t i = 0; i < array_count; i++)
+                    {
+                        uint64_t zigzag = get_varint();
+                        ints[i] = int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1);
+                    }
+                    array.items = ints;
+                    break;
+                }
+                case FArray::Kind::doubles:
+                {
+                    double* doubles = arena.make_array<double>(size_t(array_count));
+                    for (uint64_t i = 0; i < array_count; i++)
+                        doubles[i] = get_double();
+                    array.items = doubles;
+                    break;
+                }
+                case FArray::Kind::values:
+                {
+                    FValue* values = arena.make_array<FValue>(size_t(array_count));
+                    for (uint64_t i = 0; i < array_count; i++)
+                        values[i] = get_value();
+                    array.items = values;
+                    break;
+                }
+                default: throw std::runtime_error("snapshot has an unknown array kind");
+            }
+        }
+
+        uint64_t count = get_varint();
+        // Every child takes at least two bytes, which bounds the allocation for a corrupt count
+        need(size_t(count) * 2);
+
+        obj->children.items = arena.make_array<FKeyValue>(size_t(count));
+        obj->children.count = uint32_t(count);
+
+        for (FKeyValue& kv : obj->children)
+        {
+            kv.key = get_string();
+            kv.value = get_value();
+        }
+        return obj;
+    }
+};
+
+
+void Snapshot::write(std::vector<char>& out, uint64_t fingerprint, const FObject& root, bool compress)
+{
+    snapshot_writer writer;
+    writer.put_object(root);
+
+    std::vector<char> payload;
+    payload.reserve(writer.strings.size() + writer.tree.size() + 10);
+    snapshot_writer::put_varint(payload, writer.string_count);
+    payload.insert(payload.end(), writer.strings.begin(), writer.strings.end());
+    payload.insert(payload.end(), writer.tree.begin(), writer.tree.end());
+
+    Header header{};
+    header.magic = magic;
+    header.version = version;
+    header.fingerprint = fingerprint;
+    header.payload_size = payload.size();
+    header.checksum = crc32(crc32(0, nullptr, 0), reinterpret_cast<const Bytef*>(payload.data()), uInt(payload.size()));
+
+    std::vector<char> stored;
+    if (compress)
+    {
+        uLongf stored_size = compressBound(uLong(payload.size()));
+        stored.resize(stored_size);
+        // Only fails when zlib runs out of memory, the payload is then stored as it is
+        if (compress2(reinterpret_cast<Bytef*>(stored.data()), &stored_size, reinterpret_cast<const Bytef*>(payload.data()), uLong(payload.size()), Z_BEST_SPEED) != Z_OK)
+        {
+            compress = false;
+        }
+        else
+        {
+            stored.resize(stored_size);
+            header.flags |= compressed;
+        }
+    }
+    if (!compress)
+    {
+        stored = std::move(payload);
+    }
+    header.stored_size = stored.size();
+
+    out.resize(sizeof(header) + stored.size());
+    memcpy(out.data(), &header, sizeof(header));
+    memcpy(out.data() + sizeof(header), stored.data(), stored.size());
+}
+
+bool Snapshot::save(const fs::path& file, uint64_t fingerprint, const FObject& root, spdlog::logger& logger, bool compress)
+{
+    prof timer;
+    timer.start();
+
+    std::vector<char> contents;
+    write(contents, fingerprint, root, compress);
+
+    // Write next to the target and rename over it, so a crash mid-write can't leave a half snapshot behind
+    fs::path temp = file;
+    temp += ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        out.write(contents.data(), contents.size());
+        if (!out)
+        {
+            logger.warn("could not write data.raw snapshot to {0}", ws2s(temp.wstring()));
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    fs::rename(temp, file, ec);
+    if (ec)
+    {
+        logger.warn("could not move data.raw snapshot into place: {0}", ec.message());
+        return false;
+    }
+
+    timer.stop();
+    timer.print("save snapshot");
+    return true;
+}
+
+FObject* Snapshot::read(const char* data, size_t size, uint64_t fingerprint, Arena& arena, StringPool& strings)
+{
+    Header header;
+    if (size < sizeof(header))
+        throw std::runtime_error("snapshot has no header");
+    memcpy(&header, data, sizeof(header));
+
+    if (header.magic != magic || header.version != version)
+        throw std::runtime_error("snapshot format changed");
+    if (header.fingerprint != fingerprint)
+        return nullptr;
+    if (header.stored_size != size - sizeof(header))
+        throw std::runtime_error("snapshot size mismatch");
+
+    const char* stored = data + sizeof(header);
+    std::vector<char> inflated;
+    if (header.flags & compressed)
+    {
+        inflated.resize(size_t(header.payload_size));
+        uLongf inflated_size = uLongf(header.payload_size);
+        if (uncompress(reinterpret_cast<Bytef*>(inflated.data()), &inflated_size, reinterpret_cast<const Bytef*>(stored), uLong(header.stored_size)) != Z_OK || inflated_size != header.payload_size)
+            throw std::runtime_error("snapshot does not decompress");
+        stored = inflated.data();
+    }
+    else if (header.payload_size != header.stored_size)
+    {
+        throw std::runtime_error("snapshot size mismatch");
+    }
+
+    if (crc32(crc32(0, nullptr, 0), reinterpret_cast<const Bytef*>(stored), uInt(header.payload_size)) != header.checksum)
+        throw std::runtime_error("snapshot checksum mismatch");
+
+    snapshot_reader reader(stored, stored + header.payload_size, arena, strings);
+    reader.get_strings();
+    FObject* root = reader.get_object();
+    if (reader.at != reader.end)
+        throw std::runtime_error("snapshot has trailing data");
+    return root;
+}
+
+FObject* Snapshot::load(const fs::path& file, uint64_t fingerprint, Arena& arena, StringPool& strings, spdlog::logger& logger)
+{
+    if (!fs::exists(file))
+        return nullptr;
+
+    prof timer;
+    timer.start();
+
+    try
+    {
+        std::vector<char> contents = load_file_contents(ws2s(file.wstring()));
+        FObject* root = read(contents.data(), contents.size(), fingerprint, arena, strings);
+        if (!root)
+        {
+            logger.info("data.raw snapshot is stale, rebuilding");
+            return nullptr;
+        }
+
+        timer.stop();
+        timer.print("load snapshot");
+        return root;
+    }
+    catch (const std::exception& e)
+    {
+        // Anything already allocated from the arena is just dead weight until the next reset
+        logger.warn("ignoring data.raw snapshot {0}: {1}", ws2s(file.wstring()), e.what());
+        return nullptr;
+    }
+}
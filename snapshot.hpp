@@ -0,0 +1,51 @@
+#pragma once
+#include <filesystem>
+
+#include "arena.hpp"
+#include "fobject.hpp"
+
+namespace fs = std::filesystem;
+
+struct VM;
+
+//Binary copy of a converted data.raw on disk, so a launch with an unchanged game/mod set doesn't need lua at all.
+//
+//Layout: header, then a payload (optionally zlib compressed) holding a string table followed by the tree.
+//Every string is stored once and referenced by index, children are written in their sorted order so loading never sorts.
+//Array parts are stored the way they are packed.
+struct Snapshot
+{
+    static constexpr uint32_t magic = 0x53524446; // "FDRS"
+    static constexpr uint32_t version = 2;
+
+    enum flags : uint32_t
+    {
+        compressed = 1 << 0,
+    };
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t flags;
+        uint32_t reserved;
+        uint64_t fingerprint;
+        uint64_t payload_size;
+        uint64_t stored_size;
+        uint64_t checksum;
+    };
+
+    //Hash of every lua file the data stage can see (path, size, mtime), each mod's info.json and our own lua helpers
+    static uint64_t fingerprint(const VM& vm);
+
+    //Header plus payload into out, the same bytes save() puts in the file
+    static void write(std::vector<char>& out, uint64_t fingerprint, const FObject& root, bool compress = true);
+    static bool save(const fs::path& file, uint64_t fingerprint, const FObject& root, spdlog::logger& logger, bool compress = true);
+
+    //nullptr for a different fingerprint, throws std::runtime_error if the bytes don't check out. The tree's strings go
+    //into strings
+    static FObject* read(const char* data, size_t size, uint64_t fingerprint, Arena& arena, StringPool& strings);
+
+    //nullptr if the file is missing, was built from a different fingerprint or doesn't check out, the caller rebuilds
+    static FObject* load(const fs::path& file, uint64_t fingerprint, Arena& arena, StringPool& strings, spdlog::logger& logger);
+};
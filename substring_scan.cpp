@@ -0,0 +1,185 @@
+#include "substring_scan.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SUBSTRING_SCAN_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC lets any function use any intrinsic, gcc and clang need to be told which ones may be used where
+#if defined(SUBSTRING_SCAN_X86) && !defined(_MSC_VER)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+static bool is_letter(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static char fold(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? char(c | 0x20) : c;
+}
+
+//The needle's bytes between first and last, the kernels already compared those two (loosely, for a letter)
+static bool middle_matches(const char* at, std::string_view needle, bool ignore_case)
+{
+    if (!ignore_case)
+        return memcmp(at, needle.data(), needle.size()) == 0;
+    for (size_t i = 0; i < needle.size(); i++)
+        if (fold(at[i]) != fold(needle[i]))
+            return false;
+    return true;
+}
+
+static size_t find_scalar(std::string_view haystack, std::string_view needle, bool ignore_case, size_t from)
+{
+    const size_t n = needle.size();
+    const char first = ignore_case ? fold(needle[0]) : needle[0];
+    for (size_t i = from; i + n <= haystack.size(); i++)
+    {
+        const char c = ignore_case ? fold(haystack[i]) : haystack[i];
+        if (c == first && middle_matches(haystack.data() + i, needle, ignore_case))
+            return i;
+    }
+    return SubstringScan::npos;
+}
+
+#if defined(SUBSTRING_SCAN_X86)
+
+// A letter is compared with bit 5 forced on both sides, which only conflates it with its other case. Anything else is
+// compared as is.
+struct byte_pattern
+{
+    char value;
+    char mask;
+
+    byte_pattern(char c, bool ignore_case)
+    {
+        const bool loose = ignore_case && is_letter(c);
+        mask = loose ? 0x20 : 0;
+        value = char(c | mask);
+    }
+};
+
+//Index of the lowest set bit, bits can't be 0
+static unsigned lowest_bit(uint32_t bits)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return unsigned(index);
+#else
+    return unsigned(__builtin_ctz(bits));
+#endif
+}
+
+static size_t find_sse2(std::string_view haystack, std::string_view needle, bool ignore_case, size_t from)
+{
+    const size_t n = needle.size();
+    const byte_pattern first(needle[0], ignore_case), last(needle[n - 1], ignore_case);
+    const __m128i first_value = _mm_set1_epi8(first.value), first_mask = _mm_set1_epi8(first.mask);
+    const __m128i last_value = _mm_set1_epi8(last.value), last_mask = _mm_set1_epi8(last.mask);
+
+    const char* data = haystack.data();
+    size_t i = from;
+    for (; i + n - 1 + 16 <= haystack.size(); i += 16)
+    {
+        const __m128i block_first = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)), first_mask);
+        const __m128i block_last = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + n - 1)), last_mask);
+        uint32_t candidates = uint32_t(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first_value), _mm_cmpeq_epi8(block_last, last_value))));
+        while (candidates)
+        {
+            const unsigned bit = lowest_bit(candidates);
+            if (middle_matches(data + i + bit, needle, ignore_case))
+                return i + bit;
+            candidates &= candidates - 1;
+        }
+    }
+    return find_scalar(haystack, needle, ignore_case, i);
+}
+
+TARGET_AVX2 static size_t find_avx2(std::string_view haystack, std::string_view needle, bool ignore_case, size_t from)
+{
+    const size_t n = needle.size();
+    const byte_pattern first(needle[0], ignore_case), last(needle[n - 1], ignore_case);
+    const __m256i first_value = _mm256_set1_epi8(first.value), first_mask = _mm256_set1_epi8(first.mask);
+    const __m256i last_value = _mm256_set1_epi8(last.value), last_mask = _mm256_set1_epi8(last.mask);
+
+    const char* data = haystack.data();
+    size_t i = from;
+    for (; i + n - 1 + 32 <= haystack.size(); i += 32)
+    {
+        const __m256i block_first = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)), first_mask);
+        const __m256i block_last = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + n - 1)), last_mask);
+        uint32_t candidates = uint32_t(_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first_value), _mm256_cmpeq_epi8(block_last, last_value))));
+        while (candidates)
+        {
+            const unsigned bit = lowest_bit(candidates);
+            if (middle_matches(data + i + bit, needle, ignore_case))
+                return i + bit;
+            candidates &= candidates - 1;
+        }
+    }
+    return find_scalar(haystack, needle, ignore_case, i);
+}
+
+static bool has_avx2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, 7, 0);
+    const bool avx2 = (info[1] & (1 << 5)) != 0;
+    __cpuid(info, 1);
+    // The OS has to save the ymm registers too
+    const bool os_saves_ymm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+    return avx2 && os_saves_ymm;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+using find_kernel = size_t(*)(std::string_view, std::string_view, bool, size_t);
+
+static find_kernel pick_kernel(const char** name)
+{
+#if defined(SUBSTRING_SCAN_X86)
+    if (has_avx2())
+    {
+        *name = "avx2";
+        return find_avx2;
+    }
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    *name = "sse2";
+    return find_sse2;
+#endif
+#endif
+    *name = "scalar";
+    return find_scalar;
+}
+
+static const char* kernel_name;
+static const find_kernel kernel_impl = pick_kernel(&kernel_name);
+
+size_t SubstringScan::find(std::string_view haystack, std::string_view needle, bool ignore_case, size_t from)
+{
+    if (needle.empty())
+        return from <= haystack.size() ? from : npos;
+    if (from >= haystack.size() || needle.size() > haystack.size() - from)
+        return npos;
+    return kernel_impl(haystack, needle, ignore_case, from);
+}
+
+const char* SubstringScan::kernel()
+{
+    return kernel_name;
+}
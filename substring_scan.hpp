@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <string_view>
+
+//Substring search for big flat buffers like SearchIndex::text. Candidate positions are the ones where both the needle's
+//first and last byte match, found 32 (AVX2) or 16 (SSE2) positions at a time, and only those get the full compare. The
+//widest kernel the CPU supports is picked the first time it's used, anything that isn't x86 gets the scalar one.
+//
+//ignore_case folds ASCII letters only, everything else has to match exactly.
+struct SubstringScan
+{
+    static constexpr size_t npos = std::string_view::npos;
+
+    //Where the first match at or after from starts, npos if there is none
+    static size_t find(std::string_view haystack, std::string_view needle, bool ignore_case = false, size_t from = 0);
+
+    static bool contains(std::string_view haystack, std::string_view needle, bool ignore_case = false)
+    {
+        return find(haystack, needle, ignore_case) != npos;
+    }
+
+    //"avx2", "sse2" or "scalar"
+    static const char* kernel();
+};
@@ -0,0 +1,93 @@
+#include "tree_dedup.hpp"
+
+#include <cstring>
+
+static uint64_t value_bits(const FValue& value)
+{
+    return std::visit(overloaded{
+        [](std::monostate) { return uint64_t(0); },
+        [](bool arg) { return uint64_t(arg); },
+        [](uint64_t arg) { return arg; },
+        // Bitwise, so 0.0 and -0.0 stay apart and a NaN still matches itself
+        [](double arg) { uint64_t bits; memcpy(&bits, &arg, sizeof(bits)); return bits; },
+        [](FString arg) { return uint64_t(uintptr_t(arg.str)); },
+        [](FObject* arg) { return uint64_t(uintptr_t(arg)); },
+    }, value.data);
+}
+
+static uint64_t mix(uint64_t h, uint64_t value)
+{
+    h ^= value + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    return h;
+}
+
+size_t TreeDedup::hash(const FKeyValue* items, uint32_t count, const FArray& array)
+{
+    uint64_t h = count;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        h = mix(h, uint64_t(uintptr_t(items[i].key.str)));
+        h = mix(h, items[i].value.data.index());
+        h = mix(h, value_bits(items[i].value));
+    }
+    h = mix(h, array.size());
+    for (size_t i = 0; i < array.size(); i++)
+    {
+        const FValue element = array[i];
+        h = mix(h, element.data.index());
+        h = mix(h, value_bits(element));
+    }
+    // Spread the pointer bits, the low ones pick the shard
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return size_t(h);
+}
+
+bool TreeDedup::Children::operator==(const Children& other) const
+{
+    if (hash != other.hash || count != other.count || array.size() != other.array.size())
+        return false;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (items[i].key != other.items[i].key || items[i].value.data.index() != other.items[i].value.data.index() ||
+            value_bits(items[i].value) != value_bits(other.items[i].value))
+            return false;
+    }
+    for (size_t i = 0; i < array.size(); i++)
+    {
+        const FValue a = array[i];
+        const FValue b = other.array[i];
+        if (a.data.index() != b.data.index() || value_bits(a) != value_bits(b))
+            return false;
+    }
+    return true;
+}
+
+FObject* TreeDedup::intern(const FKeyValue* items, uint32_t count, const FValue* array, size_t array_count, Arena& arena)
+{
+    FArray unpacked;
+    unpacked.items = array;
+    unpacked.count = uint32_t(array_count);
+    const Children key{ items, count, unpacked, hash(items, count, unpacked) };
+    Shard& shard = shards[key.hash % shard_count];
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    tables++;
+    if (auto it = shard.index.find(key); it != shard.index.end())
+    {
+        shared++;
+        const FArray& stored = it->second->array;
+        const size_t element_size = stored.kind == FArray::Kind::values ? sizeof(FValue) : sizeof(double);
+        bytes_saved += sizeof(FObject) + sizeof(FKeyValue) * count + element_size * stored.size();
+        return it->second;
+    }
+
+    FObject* obj = arena.make<FObject>();
+    obj->children.items = arena.make_array<FKeyValue>(count);
+    obj->children.count = count;
+    std::copy(items, items + count, obj->children.items);
+    obj->array = FArray::pack(array, array_count, arena);
+    shard.index.emplace(Children{ obj->children.items, count, obj->array, key.hash }, obj);
+    return obj;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#include <bytell_hash_map.hpp>
+
+#include "arena.hpp"
+#include "fobject.hpp"
+
+//Hash-consing for converted tables: every distinct table (same keys, same values) is allocated once and shared by every
+//place it appears. The converter works bottom-up, so by the time a table is interned its subtables already are, and
+//comparing children is shallow: a subtable compares by pointer.
+//
+//Shared tables are the reason a converted tree must stay read-only. Like StringPool it is split into independently
+//locked shards, so the parallel converter's workers can share one; canonical tables live in whichever arena first
+//asked for them.
+struct TreeDedup
+{
+    static constexpr size_t shard_count = 16;
+
+    //Children and array part of a table, children sorted by key. Lookups point into the converter's scratch space with an
+    //unpacked array, the stored ones into the canonical table; elements compare as FValues, so that doesn't matter.
+    struct Children
+    {
+        const FKeyValue* items;
+        uint32_t count;
+        FArray array;
+        size_t hash;
+
+        bool operator==(const Children& other) const;
+    };
+
+    struct ChildrenHash
+    {
+        size_t operator()(const Children& children) const { return children.hash; }
+    };
+
+    struct Shard
+    {
+        std::mutex lock;
+        ska::bytell_hash_map<Children, FObject*, ChildrenHash> index;
+    };
+
+    std::array<Shard, shard_count> shards;
+
+    std::atomic<size_t> tables{ 0 };
+    std::atomic<size_t> shared{ 0 };
+    //The FObjects and children arrays that didn't have to be allocated
+    std::atomic<size_t> bytes_saved{ 0 };
+
+    //The canonical table with these children (which must be sorted) and array elements, copied into arena the first time
+    //they're seen
+    FObject* intern(const FKeyValue* items, uint32_t count, const FValue* array, size_t array_count, Arena& arena);
+
+    static size_t hash(const FKeyValue* items, uint32_t count, const FArray& array);
+};
@@ -0,0 +1,71 @@
+#include "util.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <codecvt>
+#include <cstring>
+#include <fstream>
+#include <locale>
+#include <stdexcept>
+
+void prof::print(const std::string& name)
+{
+    fprintf(stderr, "elapsed (%s): %" PRId64 "ms\n", name.c_str(), int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed()).count()));
+}
+
+void prof::print(spdlog::logger& logger, const std::string& name)
+{
+    logger.info("elapsed ({0}): {1}ms", name, int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed()).count()));
+}
+
+
+std::wstring s2ws(const std::string& str)
+{
+    using convert_typeX = std::codecvt_utf8<wchar_t>;
+    std::wstring_convert<convert_typeX, wchar_t> converterX;
+
+    return converterX.from_bytes(str);
+}
+
+std::string ws2s(const std::wstring& wstr)
+{
+    using convert_typeX = std::codecvt_utf8<wchar_t>;
+    std::wstring_convert<convert_typeX, wchar_t> converterX;
+
+    return converterX.to_bytes(wstr);
+}
+
+
+std::vector<char> load_file_contents(std::string const& filepath)
+{
+    std::ifstream ifs(filepath, std::ios::binary | std::ios::ate);
+
+    if (!ifs)
+        throw std::runtime_error(filepath + ": " + std::strerror(errno));
+
+    auto end = ifs.tellg();
+    ifs.seekg(0, std::ios::beg);
+
+    auto size = std::size_t(end - ifs.tellg());
+
+    if (size == 0) // avoid undefined behavior
+        return {};
+
+    std::vector<char> buffer(size);
+
+    if (!ifs.read((char*)buffer.data(), buffer.size()))
+        throw std::runtime_error(filepath + ": " + std::strerror(errno));
+
+    return buffer;
+}
+
+std::string_view lua_source(const std::vector<char>& contents)
+{
+    std::string_view source(contents.data(), contents.size());
+    if (source.substr(0, 3) == "\xef\xbb\xbf")
+        source.remove_prefix(3);
+    if (!source.empty() && source[0] == '#')
+        source.remove_prefix(std::min(source.find('\n'), source.size()));
+    return source;
+}
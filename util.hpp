@@ -1,6 +1,8 @@
 #pragma once
 #include <chrono>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <bytell_hash_map.hpp>
 #include "spdlog/spdlog.h"
@@ -31,6 +33,40 @@ struct prof
     }
 
     void print(const std::string& name);
+    //Same line through a logger, for code that belongs to one VM
+    void print(spdlog::logger& logger, const std::string& name);
+};
+
+
+//64-bit FNV-1a, for cache keys and checksums rather than anything adversarial
+struct fnv1a
+{
+    uint64_t state = 14695981039346656037ull;
+
+    void add(const void* data, size_t len)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < len; i++)
+        {
+            state ^= bytes[i];
+            state *= 1099511628211ull;
+        }
+    }
+
+    void add(std::string_view str)
+    {
+        add(str.data(), str.size());
+        //Separator so "ab" + "c" doesn't hash the same as "a" + "bc"
+        add_pod(uint64_t(str.size()));
+    }
+
+    template<typename T>
+    void add_pod(const T& value)
+    {
+        add(&value, sizeof(T));
+    }
+
+    uint64_t value() const { return state; }
 };
 
 
@@ -48,5 +84,7 @@ std::wstring s2ws(const std::string& str);
 std::string ws2s(const std::wstring& wstr);
 
 std::vector<char> load_file_contents(std::string const& filepath);
+//The part of a lua file luaL_loadbuffer should see. luaL_loadfile skips a UTF-8 BOM and a first line starting with '#' on
+//its own, this does the same for sources already in memory (keeping that line's newline so line numbers still match).
+std::string_view lua_source(const std::vector<char>& contents);
 
-extern std::shared_ptr<spdlog::logger> err_logger;
@@ -1,160 +1,392 @@
 #include "vm.hpp"
 
-static void perror_l(int err)
+#include <atomic>
+#include <set>
+
+#include "spdlog/sinks/stdout_color_sinks.h"
+
+static void perror_l(spdlog::logger& logger, int err)
 {
     switch (err)
     {
-        case LUA_OK: err_logger->critical("*** lua internal error: LUA_OK\n"); break;
-        case LUA_YIELD: err_logger->critical(" *** lua internal error: LUA_YIELD\n"); break;
-        case LUA_ERRRUN: err_logger->critical(" *** lua internal error: LUA_ERRRUN\n"); break;
-        case LUA_ERRSYNTAX: err_logger->critical(" *** lua internal error: LUA_ERRSYNTAX\n"); break;
-        case LUA_ERRMEM: err_logger->critical(" *** lua internal error: LUA_ERRMEM\n"); break;
-        case LUA_ERRGCMM: err_logger->critical(" *** lua internal error: LUA_ERRGCMM\n"); break;
-        case LUA_ERRERR: err_logger->critical(" *** lua internal error: LUA_ERRERR\n"); break;
-        default: err_logger->critical(" *** lua internal error: UNKNOWN\n"); break;
+        case LUA_OK: logger.critical("*** lua internal error: LUA_OK\n"); break;
+        case LUA_YIELD: logger.critical(" *** lua internal error: LUA_YIELD\n"); break;
+        case LUA_ERRRUN: logger.critical(" *** lua internal error: LUA_ERRRUN\n"); break;
+        case LUA_ERRSYNTAX: logger.critical(" *** lua internal error: LUA_ERRSYNTAX\n"); break;
+        case LUA_ERRMEM: logger.critical(" *** lua internal error: LUA_ERRMEM\n"); break;
+        case LUA_ERRGCMM: logger.critical(" *** lua internal error: LUA_ERRGCMM\n"); break;
+        case LUA_ERRERR: logger.critical(" *** lua internal error: LUA_ERRERR\n"); break;
+        default: logger.critical(" *** lua internal error: UNKNOWN\n"); break;
     }
 }
 
-static std::unordered_map<std::string, Dependency::Type> depTypes = {
-    {"", Dependency::Type::required},
-    {"?", Dependency::Type::optional},
-    {"(?)", Dependency::Type::optional_hidden},
-    {"!", Dependency::Type::forbidden},
-};
-
-
-void anal(int err)
+void anal(spdlog::logger& logger, int err)
 {
     if (err != LUA_OK)
     {
-        perror_l(err);
+        perror_l(logger, err);
         exit(-1);
     }
 }
 
-void VM::discover_mods()
+Mod* VM::add_mod(const ModInfo& info, const fs::path& path)
 {
-    for (auto& p : fs::directory_iterator(mod_dir))
+    Mod* mod = new Mod();
+    mod->name = info.name;
+    mod->path = path;
+    mod->has_version = ModVersion::parse(info.version, mod->version);
+    if (!mod->has_version)
+        logger->warn("mod {0} has an unreadable version '{1}'", info.name, info.version);
+    mod_name_to_mod[mod->name] = mod;
+
+    modlist.push_back(mod);
+
+    for (auto& depval : info.dependencies)
     {
-        if (p.is_directory()) {
-            const auto& info_path = p.path() / "info.json";
-            if (fs::exists(info_path))
-            {
-                const auto& info_contents_raw = load_file_contents(ws2s(info_path.wstring()));
-                std::string info_contents(info_contents_raw.data(), info_contents_raw.size());
-                JSONValue* value = JSON::Parse(info_contents.c_str());
-                if (!value)
-                {
-                    //std::cerr << "Could not load: " << info_path << "\n";
-                    exit(-1);
-                }
+        Dependency dep;
+        if (Dependency::parse(depval, dep))
+            mod->declared_dependencies.push_back(std::move(dep));
+        else
+            logger->warn("mod {0}: ignoring dependency '{1}'", info.name, depval);
+    }
 
-                JSONObject root = value->AsObject();
-                JSONArray deplist = root[L"dependencies"]->AsArray();
+    return mod;
+}
 
-                Mod* mod = new Mod();
-                mod->name = ws2s(root[L"name"]->AsString());
-                mod->path = p.path();
-                mod_name_to_mod[mod->name] = mod;
+//What one worker finds out about a mod dir or zip, merged into the VM on the main thread
+struct mod_scan
+{
+    fs::path path;
+    bool is_zip = false;
+    bool found = false;
+    bool parsed = false;
+    ModInfo info;
+    std::unique_ptr<ModArchive> archive;
+    std::vector<VM::found_script> scripts;
+};
 
-                modlist.push_back(mod);
+static void scan_mod_entry(mod_scan& scan)
+{
+    std::vector<char> contents;
+    if (scan.is_zip)
+    {
+        scan.archive = ModArchive::open(scan.path);
+        auto info = scan.archive ? scan.archive->read("info.json") : nullptr;
+        if (!info)
+            return;
+        contents = *info;
+    }
+    else
+    {
+        const fs::path info_path = scan.path / "info.json";
+        std::error_code ec;
+        if (!fs::exists(info_path, ec))
+            return;
+        contents = load_file_contents(ws2s(info_path.wstring()));
+        VM::scan_mod(scan.path, scan.scripts);
+    }
 
-                for (auto dep : deplist)
-                {
-                    std::string depval = ws2s(dep->AsString());
-                    std::smatch m;
-                    // std::cout << "matching: '" << depval << "'\n";
-                    if (std::regex_match(depval, m, dep_pattern))
-                    {
-                        // std::cout << "matched type: " << m[1] << "name: " << m[2] << "\n";
-                        Dependency dep;
-                        dep.modName = m[2];
-                        dep.type = depTypes[m[1]];
-                        mod->declared_dependencies.push_back(dep);
-                    }
-                    else
-                    {
-                        // std::cout << "couldn't match\n";
-                    }
-                }
+    scan.found = true;
+    scan.parsed = ModInfo::parse(std::string_view(contents.data(), contents.size()), scan.info);
+}
+
+void VM::discover_mods(unsigned threads)
+{
+    prof timer;
+    timer.start();
 
-                iterate_mod(p);
+    std::vector<mod_scan> scans;
+    for (auto& p : fs::directory_iterator(mod_dir))
+    {
+        if (p.is_directory())
+            scans.push_back({ p.path() });
+        else if (p.is_regular_file() && p.path().extension() == ".zip")
+            scans.push_back({ p.path(), true });
+    }
+    // Directory order is up to the filesystem, merge in a fixed one so the same mod set always comes out the same
+    std::sort(scans.begin(), scans.end(), [](const mod_scan& a, const mod_scan& b) { return a.path < b.path; });
+
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max(1u, std::min(threads, unsigned(scans.size())));
+
+    std::atomic<size_t> next_job{ 0 };
+    std::vector<std::string> failures(scans.size());
+    auto worker = [&]() {
+        for (size_t job = next_job++; job < scans.size(); job = next_job++)
+        {
+            try
+            {
+                scan_mod_entry(scans[job]);
             }
+            catch (const std::exception& e)
+            {
+                failures[job] = e.what();
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool)
+        thread.join();
+
+    for (size_t i = 0; i < scans.size(); i++)
+    {
+        mod_scan& scan = scans[i];
+        if (!failures[i].empty())
+        {
+            logger->critical("could not read mod {0}: {1}", ws2s(scan.path.wstring()), failures[i]);
+            exit(-1);
+        }
+        if (!scan.found)
+        {
+            if (scan.is_zip)
+                logger->warn("skipping {0}: not a readable mod zip", ws2s(scan.path.wstring()));
+            continue;
+        }
+        if (!scan.parsed)
+        {
+            logger->critical("could not parse {0}", ws2s((scan.path / "info.json").wstring()));
+            exit(-1);
+        }
+
+        Mod* mod = add_mod(scan.info, scan.path);
+        if (scan.archive)
+        {
+            mod->archive = scan.archive.release();
+            iterate_archive(mod);
+        }
+        else
+        {
+            add_scripts(scan.path, scan.scripts);
         }
-        // auto current = mods.find(p);
     }
+
+    timer.stop();
+    timer.print(*logger, "discover mods");
 }
 
 
-static void* l_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
-    (void)ud; (void)osize;  /* not used */
-    if (nsize == 0) {
-        free(ptr);
-        return NULL;
+void* VM::lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    VM* vm = static_cast<VM*>(ud);
+    // Without a block osize is the type of object being made, not a size
+    if (!ptr)
+        osize = 0;
+
+    void* block = vm->lua_pool.reallocate(ptr, osize, nsize);
+    if (!block && nsize != 0)
+        return nullptr; // lua keeps the old block when growing fails
+
+    Mod::heap_usage& owner = *vm->heap_owner;
+    vm->lua_heap += nsize;
+    vm->lua_heap -= osize;
+    owner.retained += int64_t(nsize) - int64_t(osize);
+    if (nsize > osize)
+    {
+        owner.allocated += nsize - osize;
+        vm->lua_heap_peak = std::max(vm->lua_heap_peak, vm->lua_heap);
+        owner.peak = std::max(owner.peak, vm->lua_heap);
     }
-    else
-        return realloc(ptr, nsize);
+    return block;
 }
 
-VM::VM(const fs::path &game_dir) :
+static std::shared_ptr<spdlog::logger> make_logger(const fs::path& game_dir)
+{
+    return std::make_shared<spdlog::logger>(ws2s(game_dir.wstring()), std::make_shared<spdlog::sinks::stderr_color_sink_mt>());
+}
+
+VM::VM(const fs::path &game_dir, std::shared_ptr<spdlog::logger> logger, const fs::path& helper_dir, unsigned threads) :
+    logger(logger ? std::move(logger) : make_logger(game_dir)),
     game_dir(game_dir),
     corelib(game_dir / "data" / "core"),
     baselib(game_dir / "data" / "base"),
     mod_dir(game_dir / "mods"),
-    cwd(_getcwd(0, 0))
+    cwd(helper_dir.empty() ? fs::path(_getcwd(0, 0)) : helper_dir),
+    chunks(this->logger, fs::temp_directory_path() / "naughty_factorio_chunks")
 {
 
 #if defined(VERBOSE_LOGGING)
-    std::string logpath = ws2s(fs::temp_directory_path() / "log.txt");
-    log_ = fopen(logpath.c_str(), "w");
+    std::string logpath = ws2s((fs::temp_directory_path() / fmt::format("log_{0:x}.txt", std::hash<std::string>()(ws2s(game_dir.wstring())))).wstring());
+    log_file = fopen(logpath.c_str(), "w");
 #endif
-    L = lua_newstate(l_alloc, this);
-    const fs::path lualib = game_dir / "data" / "core" / "lualib";
-    //std::cout << "lualib: loading\n";
+    // core and base ship with the game instead of living in the mods dir, their info.json is optional
+    auto builtin_mod = [this](const std::string& name, const fs::path& dir) {
+        Mod* mod = new Mod();
+        mod->name = name;
+        mod->path = dir;
 
-    {
-        Mod* core = new Mod();
-        core->name = "core";
-        core->path = corelib;
-        iterate_mod(corelib);
-        mod_name_to_mod[core->name] = core;
-    }
+        std::error_code ec;
+        const fs::path info_path = dir / "info.json";
+        ModInfo info;
+        if (fs::exists(info_path, ec))
+        {
+            const auto contents = load_file_contents(ws2s(info_path.wstring()));
+            if (ModInfo::parse(std::string_view(contents.data(), contents.size()), info))
+                mod->has_version = ModVersion::parse(info.version, mod->version);
+        }
+
+        iterate_mod(dir);
+        mod_name_to_mod[mod->name] = mod;
+        return mod;
+    };
+    builtin_mod("core", corelib);
+    builtin_mod("base", baselib);
+
+    discover_mods(threads);
+}
 
+static const char* operator_string(Dependency::Operator op)
+{
+    switch (op)
     {
-        Mod* base = new Mod();
-        base->name = "base";
-        base->path = baselib;
-        iterate_mod(baselib);
-        mod_name_to_mod[base->name] = base;
+        case Dependency::Operator::le: return "<=";
+        case Dependency::Operator::lt: return "<";
+        case Dependency::Operator::eq: return "=";
+        case Dependency::Operator::gt: return ">";
+        default: return ">=";
     }
+}
+
+bool VM::schedule_mods(const std::vector<Mod*>& active)
+{
+    Mod* core = mod_name_to_mod["core"];
+
+    std::vector<Mod*> mods = active;
+    mods.push_back(mod_name_to_mod["base"]);
+    std::sort(mods.begin(), mods.end(), [](Mod* a, Mod* b) { return a->name < b->name; });
+    mods.erase(std::unique(mods.begin(), mods.end()), mods.end());
 
-    discover_mods();
-    for (Mod* mod : modlist)
+    ska::bytell_hash_map<std::string, Mod*> enabled;
+    enabled.emplace(core->name, core);
+    for (Mod* mod : mods)
+        enabled.emplace(mod->name, mod);
+
+    for (Mod* mod : mods)
     {
-        //std::cout << "detected mod: " << mod->name << ", checking dependencies: ";
+        mod->dependencies.clear();
         for (auto& dep : mod->declared_dependencies)
         {
-            Mod* depmod = mod_name_to_mod[dep.modName];
-            if (depmod)
+            auto found = enabled.find(dep.modName);
+            Mod* depmod = found != enabled.end() ? found->second : nullptr;
+
+            if (dep.type == Dependency::Type::forbidden)
             {
-                // TODO: Check version and if it's forbidden!
-                mod->dependencies.push_back(depmod);
+                if (depmod)
+                {
+                    logger->critical("mod {0} is incompatible with mod {1}", mod->name, dep.modName);
+                    return false;
+                }
+                continue;
             }
-            else
+
+            if (!depmod)
             {
-                if (dep.type == Dependency::Type::required)
+                if (dep.type == Dependency::Type::required || dep.type == Dependency::Type::unordered)
                 {
-                    //std::cerr << "could not find required dependency: " << dep.modName << " of mod: " << mod->name << "\n";
-                    exit(-1);
+                    logger->critical("could not find required dependency: {0} of mod: {1}", dep.modName, mod->name);
+                    return false;
                 }
+                continue;
+            }
+
+            if (depmod->has_version && !dep.accepts(depmod->version))
+            {
+                logger->critical("mod {0} needs {1} {2} {3}, found {4}", mod->name, dep.modName, operator_string(dep.op), dep.versionComp.to_string(), depmod->version.to_string());
+                return false;
             }
 
+            // core always runs first, "~" only asks for the mod to be there
+            if (depmod != core && dep.type != Dependency::Type::unordered)
+                mod->dependencies.push_back(depmod);
         }
-        //std::cout << "success\n";
 
         std::sort(mod->dependencies.begin(), mod->dependencies.end(), [](Mod* a, Mod* b) { return a->name < b->name; });
+        mod->dependencies.erase(std::unique(mod->dependencies.begin(), mod->dependencies.end()), mod->dependencies.end());
+    }
+
+    // Kahn's algorithm, always taking the alphabetically first mod that is ready
+    ska::bytell_hash_map<Mod*, size_t> waiting_on;
+    ska::bytell_hash_map<Mod*, std::vector<Mod*>> dependents;
+    auto by_name = [](Mod* a, Mod* b) { return a->name < b->name; };
+    std::set<Mod*, decltype(by_name)> ready(by_name);
+    for (Mod* mod : mods)
+    {
+        waiting_on[mod] = mod->dependencies.size();
+        for (Mod* dep : mod->dependencies)
+            dependents[dep].push_back(mod);
+        if (mod->dependencies.empty())
+            ready.insert(mod);
+    }
+
+    load_order.clear();
+    load_order.reserve(mods.size() + 1);
+    load_order.push_back(core);
+    while (!ready.empty())
+    {
+        Mod* mod = *ready.begin();
+        ready.erase(ready.begin());
+        load_order.push_back(mod);
+
+        for (Mod* dependent : dependents[mod])
+        {
+            if (--waiting_on[dependent] == 0)
+                ready.insert(dependent);
+        }
+    }
+
+    if (load_order.size() != mods.size() + 1)
+    {
+        // Everything left is waiting on something else that is left, so following any of those edges has to loop
+        Mod* at = nullptr;
+        for (Mod* mod : mods)
+        {
+            if (waiting_on[mod] != 0)
+            {
+                at = mod;
+                break;
+            }
+        }
+
+        std::vector<Mod*> path;
+        ska::bytell_hash_map<Mod*, size_t> seen;
+        while (seen.find(at) == seen.end())
+        {
+            seen[at] = path.size();
+            path.push_back(at);
+            for (Mod* dep : at->dependencies)
+            {
+                if (waiting_on[dep] != 0)
+                {
+                    at = dep;
+                    break;
+                }
+            }
+        }
+
+        std::string cycle;
+        for (size_t i = seen[at]; i < path.size(); i++)
+            cycle += path[i]->name + " -> ";
+        cycle += at->name;
+        logger->critical("dependency cycle: {0}", cycle);
+        return false;
     }
-    std::sort(modlist.begin(), modlist.end(), [](Mod* a, Mod* b) { return a->name < b->name; });
+    return true;
+}
+
+void VM::init_lua()
+{
+    if (L)
+        return;
+
+    L = lua_newstate(lua_alloc, this);
+    if (profiler)
+        profiler->attach(L);
+    const fs::path lualib = game_dir / "data" / "core" / "lualib";
+    //std::cout << "lualib: loading\n";
 
     lua_newtable(L); //defines @1
     lua_newtable(L); //packages
@@ -168,6 +400,7 @@ VM::VM(const fs::path &game_dir) :
     lua_setglobal(L, "serpent");
 
     emplace_global("require", c_require);
+    emplace_global("print", c_bridge<&VM::print>);
     emplace_global("log", c_bridge<&VM::log>);
     emplace_global("log_localised", c_bridge<&VM::log>);
 
@@ -176,11 +409,185 @@ VM::VM(const fs::path &game_dir) :
 
 }
 
-void VM::run_data_stage()
+void VM::begin_data_stage(unsigned threads)
+{
+    std::vector<std::string> scripts;
+    scripts.reserve(script_path_to_mod_path.size() + 2);
+    for (auto& entry : script_path_to_mod_path)
+        scripts.push_back(entry.first);
+    scripts.push_back(normalize(cwd / "serpent.lua"));
+    scripts.push_back(normalize(cwd / "bootstrap.lua"));
+    chunks.precompile(scripts, threads, [this](const std::string& path, std::vector<char>& out) { return read_script(path, out); });
+
+    start_lua();
+}
+
+void VM::start_lua()
 {
+    for (auto& entry : mod_name_to_mod)
+        entry.second->heap = Mod::heap_usage();
+
+    init_lua();
+    set_mods_global();
+
     call_file(corelib / "lualib" / "dataloader.lua");
-    call_file(corelib / "data.lua");
-    call_file(baselib / "data.lua");
+    lua_settop(L, 0);
+
+    step_times.clear();
+}
+
+void VM::set_mods_global()
+{
+    // scripts check it for optional dependencies
+    lua_newtable(L);
+    for (Mod* mod : load_order)
+    {
+        if (mod->name == "core")
+            continue;
+        lua_pushstring(L, mod->version.to_string().c_str());
+        lua_setfield(L, -2, mod->name.c_str());
+    }
+    lua_setglobal(L, "mods");
+}
+
+std::vector<VM::data_step> VM::data_steps()
+{
+    std::vector<data_step> steps;
+    for (int stage = 0; stage < int(std::size(data_stages)); stage++)
+    {
+        for (Mod* mod : load_order)
+        {
+            std::string script;
+            if (find_path(mod->path, data_stages[stage], script))
+                steps.push_back({ mod, stage, std::move(script) });
+        }
+    }
+    return steps;
+}
+
+bool VM::run_step(const data_step& step, std::string* error)
+{
+    heap_owner = &step.mod->heap;
+    running_mod = step.mod;
+
+    // Every mod gets a fresh require cache, like in the game, so two mods' prototypes/item.lua don't shadow each other
+    lua_getglobal(L, "package");
+    lua_newtable(L);
+    lua_setfield(L, -2, "loaded");
+    lua_pop(L, 1);
+
+    prof timer;
+    timer.start();
+
+    bool ok = true;
+    if (error)
+    {
+        // pcall doesn't unwind past here, so the span can be closed by hand
+        if (profiler)
+            profiler->enter(script_path(step.script), step.mod->name);
+        load_file(step.script);
+        int status = lua_pcall(L, 0, 1, 0);
+        if (profiler)
+            profiler->leave();
+        if (status != LUA_OK)
+        {
+            *error = lua_tostring(L, -1) ? lua_tostring(L, -1) : "error object is not a string";
+            ok = false;
+        }
+    }
+    else
+    {
+        call_file(step.script);
+    }
+    lua_settop(L, 0);
+    heap_owner = &lualib_heap;
+    running_mod = nullptr;
 
+    step_times.push_back({ step.mod, step.stage, timer.stop() });
+    return ok;
+}
+
+void VM::end_data_stage()
+{
     lua_settop(L, 0);
+    chunks.clear();
+
+    std::chrono::steady_clock::duration stage_total[std::size(data_stages)] = {};
+    for (auto& step : step_times)
+        stage_total[step.stage] += step.elapsed;
+    for (int stage = 0; stage < int(std::size(data_stages)); stage++)
+        logger->info("{0}: {1}us", data_stages[stage], int64_t(std::chrono::duration_cast<std::chrono::microseconds>(stage_total[stage]).count()));
+
+    logger->info("lua heap: {0} bytes, peak {1}, {2} in pool slabs", lua_heap, lua_heap_peak, lua_pool.reserved());
+    std::vector<std::pair<std::string, const Mod::heap_usage*>> heaps = { { "(lualib)", &lualib_heap } };
+    for (Mod* mod : load_order)
+        heaps.emplace_back(mod->name, &mod->heap);
+    std::sort(heaps.begin(), heaps.end(), [](const auto& a, const auto& b) { return a.second->retained > b.second->retained; });
+    for (size_t i = 0; i < heaps.size() && i < 10; i++)
+        logger->info("  {0}: {1}KB retained, {2}KB allocated, heap peak {3}KB", heaps[i].first, heaps[i].second->retained / 1024, heaps[i].second->allocated / 1024, heaps[i].second->peak / 1024);
+
+    if (profiler)
+    {
+        // The logger ends the line itself
+        std::string summary = profiler->summary();
+        if (!summary.empty() && summary.back() == '\n')
+            summary.pop_back();
+        logger->info("{0}", summary);
+    }
+
+    std::vector<step_time> slowest = step_times;
+    std::sort(slowest.begin(), slowest.end(), [](const step_time& a, const step_time& b) { return a.elapsed > b.elapsed; });
+    for (size_t i = 0; i < slowest.size() && i < 10; i++)
+        logger->info("  {0}/{1}: {2}us", slowest[i].mod->name, data_stages[slowest[i].stage], int64_t(std::chrono::duration_cast<std::chrono::microseconds>(slowest[i].elapsed).count()));
+}
+
+void VM::profiled_call_file(const fs::path& p)
+{
+    LuaProfiler::scope span(*profiler, script_path(p), running_mod ? running_mod->name : "(lualib)");
+    load_file(p);
+    lua_call(L, 0, 1);
+}
+
+void VM::run_data_stage(unsigned threads)
+{
+    begin_data_stage(threads);
+    for (auto& step : data_steps())
+        run_step(step);
+    end_data_stage();
+}
+
+void VM::LazyLoader::load(FObject& stub)
+{
+    lua_State* L = vm.L;
+    Arena& arena = vm.data_arena;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, vm.lazy_pins);
+    const int pins = lua_gettop(L);
+    lua_rawgeti(L, pins, stub.source_ref);
+    luaL_unref(L, pins, stub.source_ref);
+
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0)
+    {
+        FValue value;
+        if (lua_istable(L, -1))
+        {
+            // luaL_ref pops the value, leaving the key for lua_next
+            value = arena.make<FObject>(this, luaL_ref(L, pins));
+        }
+        else
+        {
+            value = converter.convert(L, -1);
+            lua_pop(L, 1);
+        }
+
+        // Integer keys go through the same sorting out into array part and plain keys as in convert_table
+        if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 1 && FValue::is_integral(lua_tonumber(L, -1)))
+            converter.pending.emplace_back(uint64_t(lua_tonumber(L, -1)), value);
+        else
+            converter.scratch.emplace_back(converter.convert_key(L, -1), value);
+    }
+    lua_pop(L, 2);
+
+    converter.finish_table(&stub, 0, 0, 0);
 }
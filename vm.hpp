@@ -1,46 +1,53 @@
 #pragma once
 
 #include <filesystem>
-#include <regex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 
 #include "util.hpp"
-#include <JSON.h>
 
 #include <lauxlib.h>
 #include <lua.h>
 #include <lualib.h>
 
 #include "fobject.hpp"
+#include "converter.hpp"
+#include "chunk_cache.hpp"
+#include "mod_archive.hpp"
+#include "mod_info.hpp"
+#include "lua_pool.hpp"
+#include "lua_profiler.hpp"
 
 namespace fs = std::filesystem;
 
-struct ModVersion {
-    int major, minor, patch;
-};
-
-struct Dependency
-{
-    enum class Operator { le, lt, eq, gt, ge };
-    enum class Type { optional, required, forbidden, optional_hidden };
-    std::string modName;
-    Type type;
-    Operator op;
-    ModVersion versionComp;
-};
-
 struct Mod
 {
     std::string name;
+    ModVersion version = { 0, 0, 0 };
     fs::path path;
     std::vector<Dependency> declared_dependencies;
+    //Mods that have to run before this one, resolved from declared_dependencies by VM::schedule_mods
     std::vector<Mod*> dependencies;
-    int loaded = -1;
+    //False when there was no info.json to take a version from (a bare data/base), version checks then let it through
+    bool has_version = false;
+    //Set for zipped mods, path is then the zip file itself
+    ModArchive* archive = nullptr;
+
+    //Lua heap traffic while this mod's scripts ran (anything they require included). Blocks have no owner, so retained
+    //is simply how much the heap grew during the mod's steps; it can go negative for a mod that mostly frees.
+    struct heap_usage
+    {
+        size_t allocated = 0;
+        int64_t retained = 0;
+        //Highest the whole heap got while the mod ran
+        size_t peak = 0;
+    };
+    heap_usage heap;
 };
 
 
-void anal(int err);
+void anal(spdlog::logger& logger, int err);
 //{
 //    if (err != LUA_OK)
 //    {
@@ -60,56 +67,212 @@ struct VM
     }
 
     lua_State* L = nullptr;
+    //Everything this VM reports goes here, so VMs running side by side in one process can be told apart
+    std::shared_ptr<spdlog::logger> logger;
+#if defined(VERBOSE_LOGGING)
+    FILE* log_file = nullptr;
+#endif
+
+    //The lua heap of this VM, allocated from lua_pool by lua_alloc
+    LuaPool lua_pool;
+    size_t lua_heap = 0;
+    size_t lua_heap_peak = 0;
+    //Charged for every allocation, the running mod during a data stage step and lualib_heap otherwise
+    Mod::heap_usage* heap_owner = &lualib_heap;
+    Mod::heap_usage lualib_heap;
+    //Mod of the data stage step that is running
+    Mod* running_mod = nullptr;
+
+    //Set before init_lua to profile every file the state runs, not owned by the VM
+    LuaProfiler* profiler = nullptr;
+    static void* lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+    //Every lua_State is created with its VM as the allocator's userdata, that's how C functions find their way back
+    static VM* from_state(lua_State* L)
+    {
+        void* ud = nullptr;
+        lua_getallocf(L, &ud);
+        return static_cast<VM*>(ud);
+    }
 
     const fs::path game_dir;
     const fs::path corelib;
     const fs::path baselib;
     const fs::path mod_dir;
+    //Where serpent.lua and bootstrap.lua are, the working directory unless the VM was given one
     const fs::path cwd;
 
     std::unordered_map<std::string, fs::path> script_path_to_mod_path;
     std::unordered_map<std::string, Mod*> mod_name_to_mod;
     std::vector<Mod*> modlist;
 
-    void iterate_mod(fs::path dir)
+    //Every spelling of a script path require() can come up with (as found under the mod dir, under the canonical mod dir,
+    //and canonical itself), lexically normalized, to the canonical path. Lets require resolve without touching the disk.
+    ska::bytell_hash_map<std::string, std::string> virtual_files;
+    //Chunk source ("@path" as lua reports it) to the mod dir of that file, filled as require sees new callers
+    ska::bytell_hash_map<std::string, const fs::path*> chunk_mod;
+
+    //Lua files that live inside a zipped mod, by the path they are known under (zip path / name in the mod)
+    struct archive_file
+    {
+        ModArchive* archive;
+        std::string name;
+    };
+    ska::bytell_hash_map<std::string, archive_file> archive_files;
+
+    static std::string lexical_key(const fs::path& path)
     {
+        return ws2s(path.lexically_normal().wstring());
+    }
+
+    //A lua file found under a mod directory: where the scan found it and its canonical path
+    struct found_script
+    {
+        fs::path path;
+        std::string key;
+    };
+
+    //Only touches the filesystem, so it can run on any thread. Canonical paths are worked out from the canonical mod dir,
+    //only symlinked files need a realpath of their own.
+    static void scan_mod(const fs::path& dir, std::vector<found_script>& out)
+    {
+        const fs::path canonical_dir = fs::canonical(dir);
         for (auto& p : fs::recursive_directory_iterator(dir))
         {
-            if (p.is_regular_file() && p.path().extension() == ".lua")
+            if (p.path().extension() == ".lua" && p.is_regular_file())
             {
-                std::string key = normalize(p.path().wstring());
-                script_path_to_mod_path.emplace(key, dir);
+                std::string key = p.is_symlink() ? normalize(p.path()) : lexical_key(canonical_dir / p.path().lexically_relative(dir));
+                out.push_back({ p.path(), std::move(key) });
             }
         }
     }
 
+    void add_scripts(const fs::path& dir, const std::vector<found_script>& scripts)
+    {
+        for (auto& script : scripts)
+        {
+            script_path_to_mod_path.emplace(script.key, dir);
 
-    template<typename T>
-    void load_mods(std::vector<Mod*>& mods, int stage, T func)
+            virtual_files.emplace(lexical_key(script.path), script.key);
+            virtual_files.emplace(script.key, script.key);
+        }
+    }
+
+    void iterate_mod(fs::path dir)
     {
-        for (Mod* mod : mods)
+        std::vector<found_script> scripts;
+        scan_mod(dir, scripts);
+        add_scripts(dir, scripts);
+    }
+
+    //Same as iterate_mod, but the scripts are entries in the zip and get paths as if the zip were a directory
+    void iterate_archive(Mod* mod)
+    {
+        const fs::path canonical_zip = fs::canonical(mod->path);
+        for (auto& entry : mod->archive->entries)
         {
-            if (mod->loaded == stage) continue;
+            const fs::path name = entry.first;
+            if (name.extension() != ".lua")
+                continue;
 
-            load_mods(mod->dependencies, stage, func);
+            std::string key = lexical_key(canonical_zip / name);
+            script_path_to_mod_path.emplace(key, mod->path);
+            archive_files.emplace(key, archive_file{ mod->archive, entry.first });
 
-            func(mod);
-            mod->loaded = stage;
+            virtual_files.emplace(lexical_key(mod->path / name), key);
+            virtual_files.emplace(key, key);
         }
     }
 
-    // const std::string dep_pattern_str = R"(^(([!?]|\(\?\)) *)?([a-zA-Z0-9_-]+)( *([<>=]=?) *((\d+\.){1,2}\d+))?$)";
-    // const std::string dep_pattern_str = R"(^(?>(?<prefix>[!?]|\(\?\)) *)?(?<name>[a-zA-Z0-9_-]+)(?> *(?<operator>[<>=]=?) *(?<version>(?>\d+\.){1,2}\d+))?$)";
-    // const std::string dep_pattern_str = R"(^(?>([!?]|\(\?\)) *)?)";
-    const std::string dep_pattern_str = R"(^(?:([!?]|\(\?\)) *)?([a-zA-Z0-9_-]+).*)";
+    //Source of a script for the precompile workers, out of the zip for zipped mods
+    bool read_script(const std::string& path, std::vector<char>& out)
+    {
+        if (auto it = archive_files.find(path); it != archive_files.end())
+            return it->second.archive->extract(it->second.name, out);
+        out = load_file_contents(path);
+        return true;
+    }
 
-    const std::regex dep_pattern = std::regex(dep_pattern_str);
+    //Canonical path of a script, from the index when it's a known mod file
+    std::string script_path(const fs::path& path)
+    {
+        if (auto it = virtual_files.find(lexical_key(path)); it != virtual_files.end())
+            return it->second;
+        return normalize(path);
+    }
 
-    void discover_mods();
+    static constexpr const char* data_stages[] = { "data.lua", "data-updates.lua", "data-final-fixes.lua" };
 
-    VM(const fs::path &game_dir);
+    //core, then every mod after everything it depends on, ties going to the alphabetically first. Built once by
+    //schedule_mods() and walked once per data stage.
+    std::vector<Mod*> load_order;
 
-    void run_data_stage();
+    struct step_time
+    {
+        Mod* mod;
+        int stage;
+        std::chrono::steady_clock::duration elapsed;
+    };
+    //One per mod script run by the last run_data_stage, in the order they ran
+    std::vector<step_time> step_times;
+
+    //Checks the dependencies (missing, forbidden, wrong version) of every active mod and fills load_order. Mods that
+    //aren't in active count as missing, core and base are always there. Logs and returns false on a problem or a
+    //dependency cycle.
+    bool schedule_mods(const std::vector<Mod*>& active);
+
+    //One script of the data stage: a mod's data.lua, data-updates.lua or data-final-fixes.lua
+    struct data_step
+    {
+        Mod* mod;
+        int stage;
+        std::string script;
+
+        bool operator==(const data_step& other) const { return mod == other.mod && stage == other.stage; }
+    };
+    //Every stage over load_order, skipping mods that don't have the script
+    std::vector<data_step> data_steps();
+
+    //run_data_stage in pieces, so a caller can stop after a prefix of the steps (and fork, see ForkServer)
+    void begin_data_stage(unsigned threads = 0);
+    //The lua half of begin_data_stage: init_lua, the mods global and dataloader
+    void start_lua();
+    //mods[name] = version for load_order
+    void set_mods_global();
+    //With error set the script runs protected, a lua error comes back as false plus the message instead of ending the process
+    bool run_step(const data_step& step, std::string* error = nullptr);
+    void end_data_stage();
+
+    //Registers a new Mod from its parsed info.json, path is the mod directory or zip
+    Mod* add_mod(const ModInfo& info, const fs::path& path);
+    //Every mod dir/zip is read and scanned on its own thread, then merged in path order. 0 threads means one per hardware
+    //thread.
+    void discover_mods(unsigned threads = 0);
+
+    //Only discovers mods and their files, schedule_mods picks which of them load before a data stage can run. The lua
+    //state is created by init_lua() the first time it's needed. Without a logger the VM makes its own, writing to stderr
+    //under the game dir's name. threads is for discover_mods.
+    //VMs share nothing but the index keys (see FObject::index_key, that pool locks), so any number of them can run on
+    //their own threads.
+    VM(const fs::path &game_dir, std::shared_ptr<spdlog::logger> logger = nullptr, const fs::path& helper_dir = {}, unsigned threads = 0);
+
+    void init_lua();
+    //Throws the lua state away, the next init_lua starts from scratch
+    void close_lua()
+    {
+        if (L)
+            lua_close(L);
+        L = nullptr;
+        lazy_pins = LUA_NOREF;
+        lua_pool.release();
+        lua_heap_peak = 0;
+        lualib_heap = Mod::heap_usage();
+    }
+    //threads is how many workers precompile the lua files first, 0 means one per hardware thread
+    void run_data_stage(unsigned threads = 0);
+
+    //Bytecode for every file in script_path_to_mod_path, filled right before the data stage and dropped after it
+    ChunkCache chunks;
     
 
     static std::string lua_type_to_string(int type)
@@ -130,159 +293,104 @@ struct VM
         }
     }
 
-    static std::string lua_key(lua_State* L, int index)
-    {
-        int type = lua_type(L, index);
-
-        switch (type)
-        {
-            case LUA_TSTRING:
-            {
-                return std::string(lua_tostring(L, index));
-            }
-            case LUA_TNUMBER:
-            {
-                int isnum;
-                if (lua_Integer d = lua_tointegerx(L, index, &isnum); isnum)
-                {
-                    return std::to_string(uint64_t(d));
-                }
-                else
-                {
-                    return std::to_string(double(lua_tonumber(L, index)));
-                }
-            }
-            case LUA_TBOOLEAN:
-            {
-                return lua_toboolean(L, index) ? "true" : "false";
-                break;
-            }
-            default:
-            {
-                err_logger->critical("unsupported lua type for key: {0}", lua_type_to_string(type));
-                abort();
-            }
-        }
-        abort();
-    }
+    //Owns every FObject produced by get_data_raw, free_data_raw() throws the whole tree away at once
+    Arena data_arena;
+    //Every string in that tree, the worker arenas' included. Freed along with it
+    StringPool data_strings;
+    //One per thread when converting in parallel, the top two levels of data.raw still live in data_arena
+    std::vector<Arena> worker_arenas;
 
-#if defined(VERBOSE_LOGGING)
-#define lua_fvalue_params lua_State *L, int index, const std::string &path, int depth
-#else
-#define lua_fvalue_params lua_State *L, int index
-#endif    
+    //get_data_raw shares every table that appears more than once (sounds, sprites, resistances, ...) instead of converting
+    //each copy, see TreeDedup. Costs a hash lookup per table, the tree has to stay read-only.
+    bool dedup_data_raw = false;
 
-    static void cb(lua_State* L, void* obj_)
+    //threads > 1 converts the prototypes of data.raw on that many threads, 0 means one per hardware thread
+    FObject* get_data_raw(unsigned threads = 1)
     {
-        FObject* obj = (FObject*)obj_;
-        std::string key = lua_key(L, -2);
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
 
-#if defined(VERBOSE_LOGGING)
-        for (int indent = 0; indent < depth; indent++)
-            fprintf(log_, "  ");
+        prof get_data;
 
-        verbose_log(log_, "loading %s.%s", path.c_str(), key.c_str());
-        FValue value = lua_fvalue(-1, path + "." + key, depth + 1);
-#else
-        FValue value = lua_fvalue(L, -1);
-#endif
+        lua_getglobal(L, "data"); //1
+        lua_getfield(L, 1, "raw"); //2
 
-        obj->children.emplace_back(key, value);
+        get_data.start();
 
+        LuaConverter converter(data_arena, data_strings, *logger);
+        TreeDedup dedup;
+        if (dedup_data_raw)
+            converter.dedup = &dedup;
+        FValue value;
+        if (threads > 1 && lua_istable(L, -1))
+            value = converter.convert_parallel(static_cast<const Table*>(lua_topointer(L, -1)), worker_arenas, threads);
+        else
+            value = converter.convert(L, -1);
+        lua_pop(L, 2);
+
+        get_data.stop();
+        get_data.print(*logger, "convert data.raw");
+
+        size_t arena_bytes = data_arena.used;
+        for (auto& arena : worker_arenas)
+            arena_bytes += arena.used;
+        logger->info("data.raw: {0} bytes in {1} arenas, {2} interned strings", arena_bytes, worker_arenas.size() + 1, data_strings.size());
+        if (dedup_data_raw)
+            logger->info("dedup: {0} of {1} tables shared, {2} bytes saved ({3:.1f}% of the tree)", dedup.shared.load(), dedup.tables.load(),
+                         dedup.bytes_saved.load(), 100.0 * double(dedup.bytes_saved) / double(std::max<size_t>(1, arena_bytes + dedup.bytes_saved)));
+        return *value.as<FObject*>();
     }
 
-    static FValue lua_fvalue(lua_fvalue_params)
+    //Converts one level of a pinned lua table when a stub FObject is first reached
+    struct LazyLoader : FLoader
     {
-        int type = lua_type(L, index);
-
-        switch (type)
-        {
-            case LUA_TSTRING:
-            {
-                //verbose_log(log_, " [string]\n");
-                return std::string(lua_tostring(L, index));
-            }
-            case LUA_TNUMBER:
-            {
-                int isnum;
-                if (lua_Integer d = lua_tointegerx(L, index, &isnum); isnum)
-                {
-                    //verbose_log(log_, " [num/int]\n");
-                    return uint64_t(d);
-                }
-                else
-                {
-                    //fprintf(log_, " [num/double]\n");
-                    return double(lua_tonumber(L, index));
-                }
-            }
-            case LUA_TBOOLEAN:
-            {
-                //verbose_log(log_, " [bool]\n");
-                return bool(lua_toboolean(L, index));
-                break;
-            }
-            case LUA_TTABLE:
-            {
-                //verbose_log(log_, " [table]\n");
-
-                FObject* obj = new FObject();
-                int i = 0;
-
-                // Currently only 5-10% faster, will do more.
-#define USE_FOREACH 0
-#if USE_FOREACH
-                lua_foreach(L, -1, obj, cb);
-#else
-                lua_pushnil(L);
-                while (lua_next(L, -2) != 0)
-                {
-                    std::string key = lua_key(L, -2);
-
-#if defined(VERBOSE_LOGGING)
-                    for (int indent = 0; indent < depth; indent++)
-                        fprintf(log_, "  ");
+        VM& vm;
+        //Shared by every load, so its scratch vectors keep their capacity
+        LuaConverter converter;
+        LazyLoader(VM& vm) : vm(vm), converter(vm.data_arena, vm.data_strings, *vm.logger, false) {}
+        void load(FObject& stub) override;
+    };
+
+    LazyLoader lazy_loader{ *this };
+    //Registry reference to a table holding the lua table of every stub that hasn't been loaded yet, stubs' source_refs
+    //are references into it
+    int lazy_pins = LUA_NOREF;
+
+    //Only the top level of data.raw is converted, everything below it is a stub pinning its lua table until someone looks
+    //inside
+    FObject* get_data_raw_lazy()
+    {
+        prof get_data;
+        get_data.start();
 
-                    //verbose_log(log_, "loading %s.%s", path.c_str(), key.c_str());
-                    FValue value = lua_fvalue(-1, path + "." + key, depth + 1);
-#else
-                    FValue value = lua_fvalue(L, -1);
-#endif
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lazy_pins = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_getglobal(L, "data");
+        lua_getfield(L, -1, "raw");
+        lua_remove(L, -2);
+        FObject* root = data_arena.make<FObject>(&lazy_loader, luaL_ref(L, -2));
+        lua_pop(L, 1);
+        root->materialize();
 
-                    obj->children.emplace_back(key, value);
-                    lua_pop(L, 1);
-                    i++;
-                }
-#endif
-                obj->sort();
-                return obj;
-            }
-            default:
-            {
-                abort();
-            }
-        }
-        abort();
+        get_data.stop();
+        get_data.print(*logger, "convert data.raw (lazy)");
+        return root;
     }
 
-    FObject* get_data_raw()
+    void free_data_raw()
     {
-        prof get_data;
-
-        lua_getglobal(L, "data"); //1
-        lua_getfield(L, 1, "raw"); //2
-
-        get_data.start();
+        // Every stub that was never loaded is pinned by the one table, dropping it releases them all at once
+        if (lazy_pins != LUA_NOREF)
+        {
+            luaL_unref(L, LUA_REGISTRYINDEX, lazy_pins);
+            lazy_pins = LUA_NOREF;
+        }
 
-#if defined(VERBOSE_LOGGING)
-        FValue value = lua_fvalue(-1, "data.raw", 0);
-        fflush(log_);
-#else
-        FValue value = lua_fvalue(L, -1);
-#endif
-        get_data.stop();
-        get_data.print("convert data.raw");
-        return *value.as<FObject*>();
+        data_arena.reset();
+        for (auto& arena : worker_arenas)
+            arena.reset();
+        data_strings.clear();
     }
 
 
@@ -290,7 +398,7 @@ struct VM
     template<cpp_lua_call member_call>
     static int c_bridge(lua_State* L)
     {
-        VM* vm = (VM*)lua_getuserdata(L);
+        VM* vm = from_state(L);
         return (vm->*member_call)();
     }
 
@@ -300,31 +408,77 @@ struct VM
         return 0;
     }
 
+    //stdout is for whoever embeds the VM (a data.raw export streams there), so lua's print goes to stderr
+    int print()
+    {
+        int count = lua_gettop(L);
+        for (int i = 1; i <= count; i++)
+        {
+            size_t len;
+            const char* text = luaL_tolstring(L, i, &len);
+            if (i > 1)
+                fputc('\t', stderr);
+            fwrite(text, 1, len, stderr);
+            lua_pop(L, 1);
+        }
+        fputc('\n', stderr);
+        return 0;
+    }
+
 
     ~VM()
     {
-        lua_close(L);
+        if (L)
+            lua_close(L);
+#if defined(VERBOSE_LOGGING)
+        if (log_file)
+            fclose(log_file);
+#endif
     }
 
     void load_file(const fs::path& p)
     {
-        std::string str = normalize(p);
+        std::string str = script_path(p);
         // printf("    loading: '%s' ... ", str.c_str());
-        int err = luaL_loadfile(L, str.c_str());
+        if (chunks.load(L, str))
+            return;
+
+        int err;
+        if (auto it = archive_files.find(str); it != archive_files.end())
+        {
+            std::vector<char> source;
+            if (!it->second.archive->extract(it->second.name, source))
+            {
+                logger->critical("ERROR:\n**could not inflate {0} from {1}\n", it->second.name, ws2s(it->second.archive->path.wstring()));
+                exit(-1);
+            }
+            const std::string_view text = lua_source(source);
+            err = luaL_loadbuffer(L, text.data(), text.size(), ("@" + str).c_str());
+        }
+        else
+        {
+            err = luaL_loadfile(L, str.c_str());
+        }
         if (err)
         {
-            err_logger->critical("ERROR:\n**{0}\n", lua_tostring(L, -1));
+            logger->critical("ERROR:\n**{0}\n", lua_tostring(L, -1));
         }
-        anal(err);
+        anal(*logger, err);
         // printf("success\n");
     }
 
     void call_file(const fs::path& p)
     {
+        if (profiler)
+        {
+            profiled_call_file(p);
+            return;
+        }
         load_file(p);
         lua_call(L, 0, 1);
         // std::cerr << "executed " << p << "!\n";
     }
+    void profiled_call_file(const fs::path& p);
 
     std::string str()
     {
@@ -341,6 +495,34 @@ struct VM
 
     }
 
+    bool find_path(const fs::path& from, const fs::path& request, std::string& out)
+    {
+        if (auto it = virtual_files.find(lexical_key(from / request)); it != virtual_files.end())
+        {
+            out = it->second;
+            return true;
+        }
+        return false;
+    }
+
+    //Mod dir of the file a chunk was loaded from, empty for files outside any mod
+    const fs::path& mod_of_chunk(const char* source)
+    {
+        auto it = chunk_mod.find(source);
+        if (it == chunk_mod.end())
+        {
+            static const fs::path no_mod;
+            const fs::path* mod = &no_mod;
+            if (source[0] == '@')
+            {
+                if (auto script = script_path_to_mod_path.find(script_path(source + 1)); script != script_path_to_mod_path.end())
+                    mod = &script->second;
+            }
+            it = chunk_mod.emplace(source, mod).first;
+        }
+        return *it->second;
+    }
+
     bool check_path(const std::string& label, const fs::path& from, const fs::path& request, std::string& out)
     {
         auto path = from / request;
@@ -361,26 +543,68 @@ struct VM
 
     static int c_require(lua_State* L)
     {
-        VM* vm = (VM*)lua_getuserdata(L);
+        VM* vm = from_state(L);
         return vm->require();
     }
 
-    void resolve()
+    //Finds the file for a require from the chunk described by ar: "__mod__/file" from that mod's root, anything else
+    //next to the calling file, then from its mod's root, then from core's lualib
+    bool resolve(const std::string& path, const lua_Debug& ar, std::string& out)
     {
+        if (path.compare(0, 2, "__") == 0)
+        {
+            size_t end = path.find("__/", 2);
+            if (end == std::string::npos)
+                return false;
+
+            auto mod = mod_name_to_mod.find(path.substr(2, end - 2));
+            if (mod == mod_name_to_mod.end() || !mod->second)
+                return false;
+
+            fs::path requested = path.substr(end + 3) + ".lua";
+            requested.make_preferred();
+            return find_path(mod->second->path, requested, out) || check_path("mod path", mod->second->path, requested, out);
+        }
+
+        fs::path requested = path;
+        requested.replace_extension(".lua");
+        requested.make_preferred();
+
+        fs::path current = ar.source[0] == '@' ? ar.source + 1 : "";
+
+        fs::path current_dir = current.parent_path();
+        const fs::path& mod_dir = mod_of_chunk(ar.source);
+
+        if (find_path(current_dir, requested, out)) return true;
+        if (find_path(mod_dir, requested, out)) return true;
+        if (find_path(corelib / "lualib", requested, out)) return true;
 
+        // Not a file iterate_mod saw under that spelling (symlinks inside a mod, files outside any mod), ask the disk
+        if (check_path("current_dir", current_dir, requested, out)) return true;
+        if (check_path("mod_root", mod_dir, requested, out)) return true;
+        if (check_path("core lualib", corelib / "lualib", requested, out)) return true;
+
+        return false;
     }
+
     int require()
     {
-        // take a copy so we can turn . -> /
         std::string path = str();
         // std::cout << "require: <" << path << ">\n";
 
         constexpr int package = 2;
         constexpr int loaded = 3;
 
+        // "a.b" and "a/b" are the same module, both for finding the file and in package.loaded
+        std::string module = path;
+        for (auto& ch : module)
+        {
+            if (ch == '.') ch = '/';
+        }
+
         lua_getglobal(L, "package");
         lua_getfield(L, package, "loaded");
-        lua_getfield(L, loaded, path.c_str());
+        lua_getfield(L, loaded, module.c_str());
         if (lua_isnil(L, -1))
         {
             // std::cerr << "not loaded yet, loading...\n";
@@ -388,43 +612,20 @@ struct VM
             std::string actual_path;
 
             lua_Debug ar;
+            ar.source = "=?";
             if (lua_getstack(L, 1, &ar)) {
                 lua_getinfo(L, "Sl", &ar);  /* get info about it */
             }
 
-            for (auto& ch : path)
-            {
-                if (ch == '.') ch = '/';
-            }
-
-            if (path[0] == '_')
-            {
-                // std::cerr << "mod-relative path help\n";
-                exit(-1);
-            }
-
-            fs::path requested = path;
-            requested.replace_extension(".lua");
-            requested.make_preferred();
-
-            fs::path current = ar.source + 1;
-
-            fs::path current_dir = current.parent_path();
-            fs::path mod_dir = script_path_to_mod_path[normalize(current)];
-
-            if (check_path("current_dir", current_dir, requested, actual_path)) goto load;
-            if (check_path("mod_root", mod_dir, requested, actual_path)) goto load;
-            if (check_path("core lualib", corelib / "lualib", requested, actual_path)) goto load;
+            if (!resolve(module, ar, actual_path))
+                return luaL_error(L, "module '%s' not found", path.c_str());
 
-        load:
-
-            load_file(actual_path);
             //call it
-            lua_call(L, 0, 1);
+            call_file(actual_path);
             // dup it
             lua_pushvalue(L, -1);
             //package.loaded[path] = module
-            lua_setfield(L, loaded, path.c_str());
+            lua_setfield(L, loaded, module.c_str());
         }
         else
         {
@@ -440,7 +641,8 @@ struct VM
         return L;
     }
 
-    fs::path resolve_mod_path(const std::string& raw)
+    //Splits "__mod__/some/file.png" into the mod and the path inside it
+    Mod* split_mod_path(const std::string& raw, fs::path& inner)
     {
         fs::path path = raw;
         auto it = path.begin();
@@ -448,12 +650,41 @@ struct VM
         it++;
         root = root.substr(2, root.length() - 4);
 
-        fs::path actual_base = mod_name_to_mod[root]->path;
+        inner.clear();
         for (; it != path.end(); it++)
         {
-            actual_base /= *it;
+            inner /= *it;
         }
 
-        return actual_base;
+        return mod_name_to_mod[root];
+    }
+
+    //For zipped mods this points inside the zip, use read_mod_file to get at the contents
+    fs::path resolve_mod_path(const std::string& raw)
+    {
+        fs::path inner;
+        Mod* mod = split_mod_path(raw, inner);
+        return mod->path / inner;
+    }
+
+    //Contents of a "__mod__/..." file wherever the mod lives, zipped files come out of the archive's cache
+    std::shared_ptr<const std::vector<char>> read_mod_file(const std::string& raw)
+    {
+        fs::path inner;
+        Mod* mod = split_mod_path(raw, inner);
+        if (!mod)
+            return nullptr;
+
+        if (mod->archive)
+            return mod->archive->read(ws2s(inner.generic_wstring()));
+
+        try
+        {
+            return std::make_shared<const std::vector<char>>(load_file_contents(ws2s((mod->path / inner).wstring())));
+        }
+        catch (const std::exception&)
+        {
+            return nullptr;
+        }
     }
 };